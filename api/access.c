@@ -0,0 +1,233 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <string.h>
+#include "api-internal.h"
+
+/*
+ * Access pattern detection.
+ *
+ * The cost of reading through a mapping is dominated by page faults on data that isn't resident
+ * yet.  We see every offset that is read, so we classify the recent reads on each file state as
+ * sequential, strided or random, and give the kernel hints accordingly:
+ *   - sequential: MADV_SEQUENTIAL on the mapping, MADV_WILLNEED (or, if the prefetch threads are
+ *     running, a prefetch request) for the next READMAP_READAHEAD bytes ahead of the reader, and
+ *     MADV_COLD (or MADV_DONTNEED, if that's all we have) for what is more than
+ *     READMAP_DROP_BEHIND bytes behind it.
+ *   - strided: MADV_WILLNEED for the next few strides.
+ *   - random: MADV_RANDOM, so the kernel doesn't read around every fault.
+ * Hints are only given as the reader moves into new territory, so a steady scan costs one
+ * madvise per READMAP_READAHEAD bytes rather than one per read.
+ *
+ * Mappings are shared between file states, so the advice given for one applies to all of them;
+ * it is only advice.  Setting READMAP_ADVISE=0 in the environment turns all of this off.
+ */
+
+#define ACCESS_STREAK 2   // consecutive matching reads before we believe in a pattern
+#define ACCESS_MISSES 4   // consecutive unrelated reads before we call it random
+#define ACCESS_STRIDES 4  // number of strides to prefetch
+
+static int    access_enabled = 1;
+static size_t access_page_size;
+
+static void access_madvise(readmap_file_state_t *file_state, off_t start, off_t end, int advice)
+{
+    off_t map_end = file_state->map_offset + file_state->map_length;
+
+    if (start < file_state->map_offset) {
+        start = file_state->map_offset;
+    }
+    if (end > map_end) {
+        end = map_end;
+    }
+
+    // madvise wants a page aligned start
+    start -= (start - file_state->map_offset) % access_page_size;
+
+    if (start >= end) {
+        return;
+    }
+
+    (void)madvise((char *)file_state->map_location + (start - file_state->map_offset), end - start, advice);
+}
+
+/* the mapping-wide advice for a pattern */
+static void access_advise_mapping(readmap_file_state_t *file_state, unsigned char pattern)
+{
+    int advice;
+
+    switch (pattern) {
+        case READMAP_ACCESS_SEQUENTIAL:
+            advice = MADV_SEQUENTIAL;
+            break;
+        case READMAP_ACCESS_RANDOM:
+            advice = MADV_RANDOM;
+            break;
+        default:
+            advice = MADV_NORMAL;
+            break;
+    }
+
+    (void)madvise(file_state->map_location, file_state->map_length, advice);
+}
+
+static unsigned char access_classify(readmap_access_t *access, off_t offset, size_t length)
+{
+    int64_t stride = offset - access->last;
+
+    if (offset == access->next) {
+        access->streak = (READMAP_ACCESS_SEQUENTIAL == access->candidate) ? access->streak + 1 : 1;
+        access->candidate = READMAP_ACCESS_SEQUENTIAL;
+        access->misses    = 0;
+    }
+    else if ((0 != stride) && (stride == access->stride)) {
+        access->streak    = (READMAP_ACCESS_STRIDED == access->candidate) ? access->streak + 1 : 1;
+        access->candidate = READMAP_ACCESS_STRIDED;
+        access->misses    = 0;
+    }
+    else {
+        access->streak    = 0;
+        access->candidate = READMAP_ACCESS_UNKNOWN;
+        access->misses++;
+    }
+
+    access->stride = stride;
+    access->last   = offset;
+    access->next   = offset + length;
+
+    if (access->streak >= ACCESS_STREAK) {
+        return access->candidate;
+    }
+
+    if (access->misses >= ACCESS_MISSES) {
+        return READMAP_ACCESS_RANDOM;
+    }
+
+    // not enough evidence to change our minds
+    return access->pattern;
+}
+
+/*
+ * Note a read of length bytes at offset (in a file that is size bytes long) and give the kernel
+ * whatever hints that suggests.
+ *
+ * Caller must hold file_state->lock (for read or write), so the mapping can't change underneath
+ * us.  If another thread is busy updating the access state, this read is simply not counted.
+ */
+void readmap_access_note(readmap_file_state_t *file_state, off_t offset, size_t length, size_t size)
+{
+    readmap_access_t *access = &file_state->access;
+    unsigned char     pattern;
+    off_t             end = offset + length;
+    off_t             start;
+    off_t             target;
+
+    if (!access_enabled || (0 == length) || !file_state->mapped) {
+        return;
+    }
+
+    if (__atomic_exchange_n(&access->busy, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    pattern = access_classify(access, offset, length);
+
+    if (access->mapping != file_state->mapping) {
+        // a new mapping (or window) has none of our advice
+        access->mapping     = file_state->mapping;
+        access->advised_end = 0;
+        access->dropped_end = 0;
+        __atomic_store_n(&access->pattern, READMAP_ACCESS_UNKNOWN, __ATOMIC_RELAXED);
+    }
+
+    if (pattern != access->pattern) {
+        access_advise_mapping(file_state, pattern);
+        __atomic_store_n(&access->pattern, pattern, __ATOMIC_RELAXED);
+        access->advised_end = 0;
+    }
+
+    switch (pattern) {
+        case READMAP_ACCESS_SEQUENTIAL:
+            // stay half the readahead distance ahead of the reader
+            if (end + (off_t)(READMAP_READAHEAD / 2) > access->advised_end) {
+                target = end + READMAP_READAHEAD;
+                if (target > (off_t)size) {
+                    target = size;
+                }
+                start = end > access->advised_end ? end : access->advised_end;
+                if (target > (off_t)(file_state->map_offset + file_state->map_length)) {
+                    target = file_state->map_offset + file_state->map_length;
+                }
+                if ((start < target) && (0 != readmap_prefetch(file_state, start, target - start))) {
+                    access_madvise(file_state, start, target, MADV_WILLNEED);
+                }
+                access->advised_end = target;
+            }
+
+            if (offset > access->dropped_end + (off_t)(2 * READMAP_DROP_BEHIND)) {
+                target = offset - READMAP_DROP_BEHIND;
+                if (access->dropped_end < file_state->map_offset) {
+                    access->dropped_end = file_state->map_offset;
+                }
+#if defined(MADV_COLD)
+                access_madvise(file_state, access->dropped_end, target, MADV_COLD);
+#else
+                access_madvise(file_state, access->dropped_end, target, MADV_DONTNEED);
+#endif
+                access->dropped_end = target;
+            }
+            break;
+
+        case READMAP_ACCESS_STRIDED:
+            if ((access->stride > 0) && (end > access->advised_end)) {
+                for (unsigned index = 1; index <= ACCESS_STRIDES; index++) {
+                    target = offset + (index * access->stride);
+                    if (target >= (off_t)size) {
+                        break;
+                    }
+                    access_madvise(file_state, target, target + length, MADV_WILLNEED);
+                    access->advised_end = target + length;
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    __atomic_store_n(&access->busy, 0, __ATOMIC_RELEASE);
+}
+
+int readmap_get_access_pattern(int fd)
+{
+    readmap_file_state_t *file_state;
+    int                   pattern;
+
+    file_state = readmap_lookup_file_state(fd);
+    if (NULL == file_state) {
+        errno = EBADF;
+        return -1;
+    }
+
+    pattern = __atomic_load_n(&file_state->access.pattern, __ATOMIC_RELAXED);
+    readmap_release_file_state(file_state);
+
+    return pattern;
+}
+
+/* set up the access state for a new file state */
+void readmap_access_init(readmap_file_state_t *file_state)
+{
+    memset(&file_state->access, 0, sizeof(file_state->access));
+    file_state->access.next = -1;
+}
+
+void readmap_init_access_tracking(void)
+{
+    const char *enabled = getenv("READMAP_ADVISE");
+
+    access_page_size = sysconf(_SC_PAGESIZE);
+    access_enabled   = (NULL == enabled) || (0 != strcmp(enabled, "0"));
+}
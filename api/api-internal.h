@@ -0,0 +1,337 @@
+/*
+ * (C) Copyright 2017-2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#pragma once
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "readmapapi.h"
+
+/*
+ * Objects that are released through the epoch mechanism (epoch.c) embed one of these.
+ */
+typedef struct readmap_epoch_entry
+{
+    struct readmap_epoch_entry *next;
+    uint64_t epoch;
+    void (*release)(struct readmap_epoch_entry *entry);
+} readmap_epoch_entry_t;
+
+void readmap_epoch_enter(void);
+void readmap_epoch_exit(void);
+void readmap_epoch_retire(readmap_epoch_entry_t *entry, void (*release)(readmap_epoch_entry_t *entry));
+void readmap_epoch_flush(void);
+
+/*
+ * Fixed size objects that are created and destroyed all the time come from slabs (slab.c), each
+ * with its own id (which indexes the per-thread caches.)  size is rounded up to a cache line;
+ * construct (which may be NULL) runs once per object, not on every allocation.
+ */
+typedef enum readmap_slab_id
+{
+    READMAP_SLAB_FILE_STATE,
+    READMAP_SLAB_TABLE_ENTRY,
+    READMAP_SLAB_COUNT,
+} readmap_slab_id_t;
+
+typedef struct readmap_slab
+{
+    readmap_slab_id_t id;
+    size_t size;
+    void (*construct)(void *object);
+    pthread_mutex_t lock;  // protects the rest
+    void *free_list;
+    size_t free_count;
+    void *chunks;
+} readmap_slab_t;
+
+#define READMAP_SLAB_INITIALIZER(_id, _size, _construct)                                \
+    {                                                                                   \
+        .id = (_id), .size = (((_size) + 63) & ~(size_t)63), .construct = (_construct), \
+        .lock = PTHREAD_MUTEX_INITIALIZER,                                              \
+    }
+
+void *readmap_slab_alloc(readmap_slab_t *slab);
+void readmap_slab_free(readmap_slab_t *slab, void *object);
+
+/*
+ * Reference counts on file state objects are split across this many cache line sized slots
+ * (indexed by CPU), see fdmgr.c
+ */
+#define READMAP_REF_SLOTS (8)
+
+typedef struct readmap_ref_slot
+{
+    int64_t count;
+} __attribute__((aligned(64))) readmap_ref_slot_t;
+
+/*
+ * Mappings are shared by all the file states for a given inode (mapcache.c)
+ */
+typedef struct readmap_mapping readmap_mapping_t;
+
+#define READMAP_MAPPING_CACHE_LIMIT ((size_t)1024 * 1024 * 1024)
+#define READMAP_HUGEPAGE_THRESHOLD ((size_t)64 * 1024 * 1024)
+#define READMAP_WINDOW_SIZE ((size_t)64 * 1024 * 1024)
+#define READMAP_WINDOW_THRESHOLD ((size_t)1024 * 1024 * 1024)
+#define READMAP_WHOLE_FILE UINT64_MAX
+
+readmap_mapping_t *readmap_mapping_get(int fd, dev_t dev, ino_t ino, uint64_t window, off_t offset, size_t size, int prot);
+void readmap_mapping_hold(readmap_mapping_t *mapping);
+void readmap_mapping_put(readmap_mapping_t *mapping);
+void *readmap_mapping_location(readmap_mapping_t *mapping);
+off_t readmap_mapping_offset(readmap_mapping_t *mapping);
+size_t readmap_mapping_length(readmap_mapping_t *mapping);
+size_t readmap_mapping_window_size(size_t file_size);
+size_t readmap_mapping_page_size(readmap_mapping_t *mapping);
+off_t readmap_mapping_valid_end(readmap_mapping_t *mapping);
+void readmap_mapping_invalidate(dev_t dev, ino_t ino, off_t offset);
+size_t readmap_mapping_bytes(void);
+int readmap_init_mapping_cache(void);
+void readmap_terminate_mapping_cache(void);
+
+/*
+ * What all the file states for an inode agree on (mapcache.c.)  size is the logical size of the
+ * file.  Writes through the mapping grow the file in large steps, so the size on disk
+ * (allocated_size) may be larger; while it is, extended is set, nothing may be read beyond size,
+ * and the padding has to come off again (readmap_trim_file()) before anything outside the library
+ * looks at the end of the file.  Otherwise that happens when the last of the file states that
+ * grew the file (the extenders list) goes away.
+ *
+ * size is read, and advanced by writes, atomically.  Growing or trimming the file takes lock for
+ * write; writes through the mapping hold it for read while they copy, so the end of the file
+ * can't be trimmed from underneath them.  It nests inside the file states' locks.
+ */
+typedef struct readmap_inode
+{
+    dev_t dev;
+    ino_t ino;
+    unsigned refcount;      // protected by the mapping cache's lock
+    unsigned char cached;   // still in the table
+    pthread_rwlock_t lock;
+    size_t size;
+    size_t allocated_size;
+    unsigned char extended;
+    struct readmap_file_state *extenders;
+} readmap_inode_t;
+
+readmap_inode_t *readmap_inode_get(dev_t dev, ino_t ino);
+void readmap_inode_put(readmap_inode_t *inode);
+
+typedef struct readmap_size_watch readmap_size_watch_t;
+
+/*
+ * Recent read history for a file state, used to pick madvise() hints (access.c)
+ */
+#define READMAP_READAHEAD ((size_t)2 * 1024 * 1024)
+#define READMAP_DROP_BEHIND ((size_t)8 * 1024 * 1024)
+
+typedef struct readmap_access
+{
+    unsigned char busy;       // whoever sets this owns the rest
+    unsigned char pattern;    // what we have told the kernel
+    unsigned char candidate;  // what the recent reads look like
+    unsigned streak;
+    unsigned misses;
+    off_t last;               // start of the previous read
+    off_t next;               // where the next sequential read would start
+    int64_t stride;
+    off_t advised_end;        // MADV_WILLNEED given up to here
+    off_t dropped_end;        // dropped behind the reader up to here
+    readmap_mapping_t *mapping;  // the mapping our advice was given for
+} readmap_access_t;
+
+/*
+ * The parts of a file written through the mapping and not yet flushed (dirty.c)
+ */
+#define READMAP_DIRTY_EXTENTS (8)
+#define READMAP_FLUSH_INTERVAL ((uint64_t)1000 * 1000 * 1000) // ns
+
+typedef struct readmap_dirty_extent
+{
+    off_t start;
+    off_t end;
+} readmap_dirty_extent_t;
+
+typedef struct readmap_dirty
+{
+    unsigned count;
+    uint64_t bytes;  // covered by the extents; the flusher reads this without the lock
+    readmap_dirty_extent_t extents[READMAP_DIRTY_EXTENTS];  // sorted, disjoint, page aligned
+} readmap_dirty_t;
+
+/*
+ * Per file descriptor state.  Files that are not regular files never get one of these,
+ * so anything that finds one can assume it is dealing with something that can be mapped.
+ *
+ * lock protects this file state's view of the mapping (mapping, mapped, map_location, map_offset,
+ * map_length; the mapping itself is shared and immutable) as well as the file offset.  The
+ * mapping covers map_length bytes of the file starting at map_offset; unless the file is being
+ * read through windows (see mapcache.c) that is the whole file.  The offset is owned by the library while offset_owned is set; at that
+ * point the kernel's idea of the file position is stale and must be pushed back via
+ * readmap_release_offset() before anything else uses the file descriptor.  Ownership only
+ * changes under the lock held for write, but while it is owned, holders of the shared lock
+ * move the offset with atomic compare-and-swap (see lseek.c.)  Once the open file description
+ * is shared with another descriptor (dup) offset_shared is set and the offset is left to the
+ * kernel from then on.
+ *
+ * The size of the file is kept in inode, which is shared with every other file state for the
+ * same file; extending is set while this one is on the inode's list of states that grew it.
+ *
+ * The fields are grouped by how often they are written, so that a read of a file whose mapping
+ * and size are settled only writes to the lock's line (and the reference count and access
+ * history lines), never to the lines holding what it reads.
+ */
+typedef struct readmap_file_state
+{
+    // Read by every call; only written (under lock, for write) when the size or mapping changes.
+    // Exactly one cache line, see fdmgr.c
+    int flags;
+    unsigned char mapped;
+    unsigned char check_size;  // revalidate on the next check (size.c)
+    void *map_location;
+    off_t map_offset;
+    size_t map_length;
+    readmap_inode_t *inode;
+    uint64_t size_deadline;  // CLOCK_MONOTONIC_COARSE ns; revalidate after this
+    uint64_t size_changes;   // size_watch->changes as of the last revalidation
+    readmap_size_watch_t *size_watch;
+
+    // set up when the file state is created, or written once or twice in its life
+    int fd;
+    mode_t mode;
+    uint64_t hash;
+    dev_t dev;
+    ino_t ino;
+    readmap_mapping_t *mapping;
+    uint64_t size_interval;  // ns
+    unsigned char dead;      // removed from the table
+    unsigned char grace;     // no lookup can still be taking a reference
+    unsigned char destroyed; // set by whoever releases it
+
+    // every reader writes to the lock, so it gets a line of its own
+    pthread_rwlock_t lock __attribute__((aligned(64)));
+
+    // written by calls that use the file position, and by writes
+    off_t offset __attribute__((aligned(64)));
+    unsigned char offset_owned;
+    unsigned char offset_shared;
+    unsigned char extending;
+    struct readmap_file_state *next_extender;  // inode->lock
+    readmap_dirty_t dirty;
+
+    // written by reads (access.c)
+    readmap_access_t access __attribute__((aligned(64)));
+
+    // written by every call served through the mapping while stats are being collected
+    uint64_t served_calls __attribute__((aligned(64)));
+    uint64_t served_bytes;
+    readmap_epoch_entry_t retire_entry;
+
+    // what fstat() said when the size was last revalidated (size.c)
+    struct stat last_stat __attribute__((aligned(64)));
+
+    readmap_ref_slot_t refs[READMAP_REF_SLOTS];
+} readmap_file_state_t;
+
+readmap_file_state_t *readmap_create_file_state(int fd, const char *pathname, int flags);
+readmap_file_state_t *readmap_lookup_file_state(int fd);
+void readmap_release_file_state(readmap_file_state_t *file_state);
+void readmap_visit_file_states(int (*visit)(readmap_file_state_t *file_state, void *context), void *context);
+void readmap_settle_file_state(readmap_file_state_t *file_state);
+void readmap_delete_file_state(readmap_file_state_t *file_state);
+int readmap_forget_file_state(readmap_file_state_t *file_state);
+int readmap_init_file_state_mgr(void);
+void readmap_terminate_file_state_mgr(void);
+
+/* reading (read.c) */
+size_t readmap_copy_from_map(readmap_file_state_t *file_state, const struct iovec *iov, int iovcnt, off_t offset, size_t size,
+                             size_t done);
+
+/* copying out of mappings (copy.c) */
+#define READMAP_COPY_NT_THRESHOLD ((size_t)4 * 1024 * 1024)
+
+void *readmap_copy(void *destination, const void *source, size_t length);
+int readmap_copy_set_kernel(const char *name);
+const char *readmap_copy_kernel_name(void);
+void readmap_copy_set_threshold(size_t threshold);
+void readmap_init_copy(void);
+
+/* access pattern tracking (access.c) */
+void readmap_access_note(readmap_file_state_t *file_state, off_t offset, size_t length, size_t size);
+void readmap_access_init(readmap_file_state_t *file_state);
+void readmap_init_access_tracking(void);
+
+/* background prefetching (prefetch.c) */
+int readmap_prefetch(readmap_file_state_t *file_state, off_t offset, size_t length);
+int readmap_init_prefetch(void);
+void readmap_terminate_prefetch(void);
+
+/* call statistics (stats.c, and see callstats.h) */
+int readmap_init_stats(void);
+void readmap_terminate_stats(void);
+
+/* publishing them in shared memory (shmstats.c, and see readmapshm.h) */
+#define READMAP_STATS_SHM_INTERVAL ((uint64_t)1000 * 1000 * 1000) // ns
+
+int readmap_init_shm_stats(void);
+void readmap_terminate_shm_stats(void);
+
+/* io_uring fallback (uring.c) */
+int readmap_uring_read_batch(readmap_batch_request_t **requests, unsigned count);
+void readmap_init_uring(void);
+void readmap_terminate_uring(void);
+
+/* size tracking (size.c) */
+#define READMAP_SIZE_INTERVAL_DEFAULT ((uint64_t)1000 * 1000 * 1000) // ns
+
+int readmap_get_size(readmap_file_state_t *file_state, size_t *size);
+void readmap_size_init(readmap_file_state_t *file_state);
+void readmap_size_cleanup(readmap_file_state_t *file_state);
+int readmap_init_size_tracking(void);
+void readmap_terminate_size_tracking(void);
+
+/* dirty extent tracking (dirty.c) */
+void readmap_dirty_note(readmap_file_state_t *file_state, off_t offset, size_t length);
+int readmap_dirty_flush(readmap_file_state_t *file_state);
+void readmap_dirty_start_writeback(readmap_file_state_t *file_state);
+int readmap_init_dirty_tracking(void);
+void readmap_terminate_dirty_tracking(void);
+
+/*
+ * Files written through the mapping grow by at least READMAP_GROW_MIN bytes at a time,
+ * doubling until the step reaches READMAP_GROW_MAX_STEP.
+ */
+#define READMAP_GROW_MIN (1024 * 1024)
+#define READMAP_GROW_MAX_STEP (64 * 1024 * 1024)
+
+/* mapping management (map.c) */
+int readmap_map_file(readmap_file_state_t *file_state, size_t size);
+int readmap_map_range(readmap_file_state_t *file_state, off_t offset, size_t size);
+void readmap_unmap_file(readmap_file_state_t *file_state);
+int readmap_extend_file(readmap_file_state_t *file_state, size_t size);
+int readmap_trim_file(readmap_file_state_t *file_state);
+int readmap_stop_extending(readmap_file_state_t *file_state, int trim);
+
+/* file offset ownership (lseek.c) */
+int readmap_claim_offset(readmap_file_state_t *file_state);
+int readmap_release_offset(readmap_file_state_t *file_state);
+int readmap_share_offset(readmap_file_state_t *file_state);
+void readmap_release_offsets(void);
+void readmap_init_offset_tracking(void);
@@ -0,0 +1,227 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include "api-internal.h"
+#include "callstats.h"
+
+/*
+ * Batched reads.
+ *
+ * readmap_submit_batch() takes a whole set of positional reads at once.  They are sorted by file
+ * and offset, so each file state is looked up (and its size checked) once per batch, and its
+ * reads are done in order under a single acquisition of its lock.  Anything the mapping can't
+ * handle (files we aren't tracking, mapping failures) is handed to the kernel in one go through
+ * the io_uring fallback (uring.c) once the mapped reads are finished, or read natively if there
+ * is no ring.
+ */
+
+#define BATCH_STACK_REQUESTS 64  // batches up to this size don't need to allocate
+
+static int batch_compare(const void *first, const void *second)
+{
+    const readmap_batch_request_t *a = *(const readmap_batch_request_t *const *)first;
+    const readmap_batch_request_t *b = *(const readmap_batch_request_t *const *)second;
+
+    if (a->fd != b->fd) {
+        return (a->fd < b->fd) ? -1 : 1;
+    }
+
+    if (a->offset != b->offset) {
+        return (a->offset < b->offset) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Try to complete the request from the current mapping.  Returns non-zero if it was done.
+ *
+ * Caller must hold file_state->lock.
+ */
+static int batch_copy(readmap_file_state_t *file_state, readmap_batch_request_t *request, size_t size)
+{
+    struct iovec iov    = {.iov_base = request->buffer, .iov_len = request->length};
+    size_t       wanted = request->length;
+    size_t       done;
+
+    if ((size_t)request->offset >= size) {
+        request->result = 0;
+        return 1;
+    }
+
+    if (wanted > size - request->offset) {
+        wanted = size - request->offset;
+    }
+
+    done = readmap_copy_from_map(file_state, &iov, 1, request->offset, size, 0);
+    if (done != wanted) {
+        return 0;
+    }
+
+    readmap_access_note(file_state, request->offset, done, size);
+    readmap_stats_served(file_state, done);
+    request->result = done;
+
+    return 1;
+}
+
+/*
+ * Do the mapped reads for requests[0..count), which are all for file_state, in offset order.
+ * Requests that can't be done this way are left with a result of -ENOTSUP.
+ */
+static void batch_file(readmap_file_state_t *file_state, readmap_batch_request_t **requests, unsigned count)
+{
+    struct iovec iov;
+    size_t       size;
+    size_t       done;
+    size_t       progress;
+    size_t       wanted;
+    unsigned     pending = 0;
+
+    if (O_WRONLY == (file_state->flags & O_ACCMODE)) {
+        return;
+    }
+
+    if (0 != readmap_get_size(file_state, &size)) {
+        // these are left for the kernel, which will report the error
+        return;
+    }
+
+    // most of them should already be mapped
+    readmap_stats_rdlock(file_state);
+    for (unsigned index = 0; index < count; index++) {
+        if (!batch_copy(file_state, requests[index], size)) {
+            pending++;
+        }
+    }
+    pthread_rwlock_unlock(&file_state->lock);
+
+    if (0 == pending) {
+        return;
+    }
+
+    readmap_stats_wrlock(file_state);
+    for (unsigned index = 0; index < count; index++) {
+        readmap_batch_request_t *request = requests[index];
+
+        if (-ENOTSUP != request->result) {
+            continue;
+        }
+
+        iov.iov_base = request->buffer;
+        iov.iov_len  = request->length;
+        wanted       = request->length;
+        if (wanted > size - request->offset) {
+            wanted = size - request->offset;
+        }
+
+        // this may take more than one window
+        done = 0;
+        while (done < wanted) {
+            if (0 != readmap_map_range(file_state, request->offset + done, size)) {
+                break;
+            }
+
+            progress = readmap_copy_from_map(file_state, &iov, 1, request->offset, size, done);
+            if (progress == done) {
+                break;
+            }
+            done = progress;
+        }
+
+        if (done == wanted) {
+            readmap_access_note(file_state, request->offset, done, size);
+            readmap_stats_served(file_state, done);
+            request->result = done;
+        }
+    }
+    pthread_rwlock_unlock(&file_state->lock);
+}
+
+/*
+ * Perform count positional reads.  Each request's result is set to the number of bytes read, or
+ * to -errno if that read failed.  Returns the number of requests that succeeded, or -1 (with errno
+ * set) if the batch couldn't be processed at all.
+ */
+int readmap_submit_batch(readmap_batch_request_t *requests, unsigned count)
+{
+    readmap_batch_request_t * stack_sorted[BATCH_STACK_REQUESTS];
+    readmap_batch_request_t **sorted = stack_sorted;
+    readmap_file_state_t *    file_state;
+    unsigned                  valid    = 0;
+    unsigned                  leftover = 0;
+    unsigned                  first;
+    unsigned                  last;
+    int                       succeeded = 0;
+    ssize_t                   result;
+
+    if ((NULL == requests) && (0 != count)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (count > BATCH_STACK_REQUESTS) {
+        sorted = malloc(count * sizeof(readmap_batch_request_t *));
+        if (NULL == sorted) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    for (unsigned index = 0; index < count; index++) {
+        if ((requests[index].offset < 0) || (requests[index].length > SSIZE_MAX)) {
+            requests[index].result = -EINVAL;
+            continue;
+        }
+        requests[index].result = -ENOTSUP;  // not done yet
+        sorted[valid++]        = &requests[index];
+    }
+
+    qsort(sorted, valid, sizeof(readmap_batch_request_t *), batch_compare);
+
+    // the mapped reads, a file at a time
+    for (first = 0; first < valid; first = last) {
+        for (last = first + 1; (last < valid) && (sorted[last]->fd == sorted[first]->fd); last++) {
+            // find the end of this file's requests
+        }
+
+        file_state = readmap_lookup_file_state(sorted[first]->fd);
+        if (NULL != file_state) {
+            batch_file(file_state, &sorted[first], last - first);
+            readmap_release_file_state(file_state);
+        }
+    }
+
+    // and whatever is left over, all at once if we can
+    for (unsigned index = 0; index < valid; index++) {
+        if (-ENOTSUP == sorted[index]->result) {
+            sorted[leftover++] = sorted[index];
+        }
+    }
+
+    if ((0 != leftover) && (0 != readmap_uring_read_batch(sorted, leftover))) {
+        for (unsigned index = 0; index < leftover; index++) {
+            if (-ENOTSUP == sorted[index]->result) {
+                result                = readmap_pread(sorted[index]->fd, sorted[index]->buffer, sorted[index]->length, sorted[index]->offset);
+                sorted[index]->result = (result < 0) ? -errno : result;
+            }
+        }
+    }
+
+    for (unsigned index = 0; index < count; index++) {
+        if (requests[index].result >= 0) {
+            succeeded++;
+        }
+    }
+
+    if (sorted != stack_sorted) {
+        free(sorted);
+    }
+
+    return succeeded;
+}
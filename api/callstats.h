@@ -0,0 +1,118 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#pragma once
+
+/*
+ * Call statistics (stats.c).
+ *
+ * Each API entry point does
+ *
+ *     DECLARE_TIME(FINESSE_API_CALL_xxx)
+ *     START_TIME
+ *     ... try the mapping ...  STOP_MAPPED_TIME;
+ *     START_TIME
+ *     ... native call ...      STOP_NATIVE_TIME;
+ *
+ * and its public wrapper counts the outcome with FinesseApiCountCall().  The data paths take
+ * file state locks with readmap_stats_rdlock()/readmap_stats_wrlock(), which count contention.
+ * All of this costs a single test of a flag unless statistics are being collected.
+ *
+ * This goes after api-internal.h.
+ */
+
+typedef enum finesse_api_call {
+    FINESSE_API_CALL_READ    = READMAP_CALL_READ,
+    FINESSE_API_CALL_PREAD   = READMAP_CALL_PREAD,
+    FINESSE_API_CALL_READV   = READMAP_CALL_READV,
+    FINESSE_API_CALL_PREADV  = READMAP_CALL_PREADV,
+    FINESSE_API_CALL_WRITE   = READMAP_CALL_WRITE,
+    FINESSE_API_CALL_PWRITE  = READMAP_CALL_PWRITE,
+    FINESSE_API_CALL_WRITEV  = READMAP_CALL_WRITEV,
+    FINESSE_API_CALL_PWRITEV = READMAP_CALL_PWRITEV,
+} finesse_api_call_t;
+
+extern int readmap_stats_enabled;
+
+uint64_t readmap_stats_start(void);
+void readmap_stats_time(int call, int path, uint64_t start);
+void readmap_stats_count(int call, int success);
+void readmap_stats_lock_wait(uint64_t start);
+
+/*
+ * Take the file state lock, counting the time spent waiting for it.
+ */
+static inline void readmap_stats_rdlock(readmap_file_state_t *file_state)
+{
+    uint64_t start;
+
+    if (!__atomic_load_n(&readmap_stats_enabled, __ATOMIC_RELAXED)) {
+        pthread_rwlock_rdlock(&file_state->lock);
+        return;
+    }
+
+    if (0 != pthread_rwlock_tryrdlock(&file_state->lock)) {
+        start = readmap_stats_start();
+        pthread_rwlock_rdlock(&file_state->lock);
+        readmap_stats_lock_wait(start);
+    }
+}
+
+static inline void readmap_stats_wrlock(readmap_file_state_t *file_state)
+{
+    uint64_t start;
+
+    if (!__atomic_load_n(&readmap_stats_enabled, __ATOMIC_RELAXED)) {
+        pthread_rwlock_wrlock(&file_state->lock);
+        return;
+    }
+
+    if (0 != pthread_rwlock_trywrlock(&file_state->lock)) {
+        start = readmap_stats_start();
+        pthread_rwlock_wrlock(&file_state->lock);
+        readmap_stats_lock_wait(start);
+    }
+}
+
+/*
+ * Count a read or write of bytes done through the file state's mapping.
+ */
+static inline void readmap_stats_served(readmap_file_state_t *file_state, size_t bytes)
+{
+    if (__atomic_load_n(&readmap_stats_enabled, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&file_state->served_calls, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&file_state->served_bytes, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+#define DECLARE_TIME(call)           \
+    const int stats_call_  = (call); \
+    uint64_t  stats_start_ = 0;
+
+#define START_TIME                                                   \
+    if (__atomic_load_n(&readmap_stats_enabled, __ATOMIC_RELAXED)) { \
+        stats_start_ = readmap_stats_start();                        \
+    }
+
+#define STOP_MAPPED_TIME                                                        \
+    do {                                                                        \
+        if (0 != stats_start_) {                                                \
+            readmap_stats_time(stats_call_, READMAP_PATH_MAPPED, stats_start_); \
+        }                                                                       \
+    } while (0)
+
+#define STOP_NATIVE_TIME                                                        \
+    do {                                                                        \
+        if (0 != stats_start_) {                                                \
+            readmap_stats_time(stats_call_, READMAP_PATH_NATIVE, stats_start_); \
+        }                                                                       \
+    } while (0)
+
+#define FinesseApiCountCall(call, success)                               \
+    do {                                                                 \
+        if (__atomic_load_n(&readmap_stats_enabled, __ATOMIC_RELAXED)) { \
+            readmap_stats_count((call), (success));                      \
+        }                                                                \
+    } while (0)
@@ -0,0 +1,191 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <string.h>
+#include "api-internal.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif  // __x86_64__
+
+/*
+ * Copying out of the mapping.
+ *
+ * Once reads are served from the mapping, the copy into the caller's buffer is most of the cost.
+ * For ordinary sizes the C library's memcpy is as good as it gets (it already picks a kernel for
+ * the CPU it is running on), but for large copies it pulls everything it writes through the cache,
+ * pushing the caller's working set out for data it may never look at again.  So above a threshold
+ * (READMAP_COPY_NT_THRESHOLD, in bytes; by default half the last level cache) we copy with
+ * non-temporal (streaming) stores instead, using the widest vector kernel the CPU supports
+ * (AVX-512, AVX2 or SSE2, picked at startup via CPUID.)  READMAP_COPY_KERNEL can be set to one of
+ * the kernel names (or "memcpy") to override the choice.
+ */
+
+typedef void (*copy_kernel_t)(char *destination, const char *source, size_t length);
+
+typedef struct copy_kernel_entry
+{
+    const char *  name;
+    copy_kernel_t kernel;
+    int (*supported)(void);
+} copy_kernel_entry_t;
+
+#define COPY_ALIGNMENT 64  // the kernels store whole, aligned, cache lines
+
+#if defined(__x86_64__)
+
+/* length is a multiple of COPY_ALIGNMENT and destination is aligned to it */
+__attribute__((target("sse2"))) static void copy_nt_sse2(char *destination, const char *source, size_t length)
+{
+    for (size_t index = 0; index < length; index += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(source + index));
+        __m128i b = _mm_loadu_si128((const __m128i *)(source + index + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(source + index + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(source + index + 48));
+
+        _mm_stream_si128((__m128i *)(destination + index), a);
+        _mm_stream_si128((__m128i *)(destination + index + 16), b);
+        _mm_stream_si128((__m128i *)(destination + index + 32), c);
+        _mm_stream_si128((__m128i *)(destination + index + 48), d);
+    }
+    _mm_sfence();
+}
+
+__attribute__((target("avx2"))) static void copy_nt_avx2(char *destination, const char *source, size_t length)
+{
+    for (size_t index = 0; index < length; index += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(source + index));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(source + index + 32));
+
+        _mm256_stream_si256((__m256i *)(destination + index), a);
+        _mm256_stream_si256((__m256i *)(destination + index + 32), b);
+    }
+    _mm_sfence();
+}
+
+__attribute__((target("avx512f"))) static void copy_nt_avx512(char *destination, const char *source, size_t length)
+{
+    for (size_t index = 0; index < length; index += 64) {
+        __m512i a = _mm512_loadu_si512((const void *)(source + index));
+
+        _mm512_stream_si512((void *)(destination + index), a);
+    }
+    _mm_sfence();
+}
+
+static int copy_has_sse2(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+static int copy_has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static int copy_has_avx512(void)
+{
+    return __builtin_cpu_supports("avx512f");
+}
+
+#endif  // __x86_64__
+
+// best first
+static const copy_kernel_entry_t copy_kernels[] = {
+#if defined(__x86_64__)
+    {"avx512", copy_nt_avx512, copy_has_avx512},
+    {"avx2", copy_nt_avx2, copy_has_avx2},
+    {"sse2", copy_nt_sse2, copy_has_sse2},
+#endif  // __x86_64__
+    {NULL, NULL, NULL},
+};
+
+static const copy_kernel_entry_t *copy_selected;
+static size_t                     copy_threshold = SIZE_MAX;
+
+/*
+ * Copy length bytes from source (in a mapping) to destination.
+ */
+void *readmap_copy(void *destination, const void *source, size_t length)
+{
+    const copy_kernel_entry_t *selected = __atomic_load_n(&copy_selected, __ATOMIC_RELAXED);
+    size_t                     head;
+    size_t                     body;
+
+    if ((NULL == selected) || (length < __atomic_load_n(&copy_threshold, __ATOMIC_RELAXED)) || (length < 2 * COPY_ALIGNMENT)) {
+        return memcpy(destination, source, length);
+    }
+
+    head = (COPY_ALIGNMENT - ((uintptr_t)destination & (COPY_ALIGNMENT - 1))) & (COPY_ALIGNMENT - 1);
+    body = (length - head) & ~((size_t)COPY_ALIGNMENT - 1);
+
+    memcpy(destination, source, head);
+    selected->kernel((char *)destination + head, (const char *)source + head, body);
+    memcpy((char *)destination + head + body, (const char *)source + head + body, length - head - body);
+
+    return destination;
+}
+
+/*
+ * Use the named kernel ("memcpy" for none).  Returns ENOTSUP if this CPU can't run it.
+ */
+int readmap_copy_set_kernel(const char *name)
+{
+    if (0 == strcmp(name, "memcpy")) {
+        __atomic_store_n(&copy_selected, NULL, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    for (const copy_kernel_entry_t *entry = copy_kernels; NULL != entry->name; entry++) {
+        if (0 == strcmp(name, entry->name)) {
+            if (!entry->supported()) {
+                break;
+            }
+            __atomic_store_n(&copy_selected, entry, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+
+    return ENOTSUP;
+}
+
+const char *readmap_copy_kernel_name(void)
+{
+    const copy_kernel_entry_t *selected = __atomic_load_n(&copy_selected, __ATOMIC_RELAXED);
+
+    return selected ? selected->name : "memcpy";
+}
+
+/*
+ * Copies of at least threshold bytes use the streaming kernel.
+ */
+void readmap_copy_set_threshold(size_t threshold)
+{
+    __atomic_store_n(&copy_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+void readmap_init_copy(void)
+{
+    const char *kernel    = getenv("READMAP_COPY_KERNEL");
+    const char *threshold = getenv("READMAP_COPY_NT_THRESHOLD");
+    long        cache     = sysconf(_SC_LEVEL3_CACHE_SIZE);
+
+    copy_selected = NULL;
+    for (const copy_kernel_entry_t *entry = copy_kernels; NULL != entry->name; entry++) {
+        if (entry->supported()) {
+            copy_selected = entry;
+            break;
+        }
+    }
+
+    if (NULL != kernel) {
+        (void)readmap_copy_set_kernel(kernel);
+    }
+
+    copy_threshold = (cache > 0) ? (size_t)cache / 2 : READMAP_COPY_NT_THRESHOLD;
+    if (NULL != threshold) {
+        copy_threshold = strtoull(threshold, NULL, 0);
+    }
+}
@@ -0,0 +1,286 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include "api-internal.h"
+
+/*
+ * Dirty extents.
+ *
+ * Data written through the mapping sits in the page cache until the kernel gets around to it, so
+ * an fsync() can find any amount of it to write, and msync() of the whole mapping has to walk all
+ * of it.  Each file state instead keeps the page aligned extents written since they were last
+ * flushed, as a short sorted array: for an appending writer that is a single extent.  When the
+ * array is full the two extents closest together are merged, so it over-approximates rather than
+ * growing.
+ *
+ * readmap_fsync() and readmap_fdatasync() msync() just those extents before making the native
+ * call (which then has little or nothing left to write); close starts writeback of them without
+ * waiting for it.
+ *
+ * If READMAP_DIRTY_LIMIT_MB is set in the environment, a flusher thread writes back any file that
+ * has more than that much dirty, so the cost of an fsync stays bounded.  Writers wake it as they
+ * cross the limit, and it looks over the open files every READMAP_FLUSH_INTERVAL as well.
+ */
+
+static size_t          dirty_page_size = 4096;
+static uint64_t        dirty_limit;  // bytes; zero if there is no flusher
+static pthread_t       dirty_thread;
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  dirty_wakeup;
+static int             dirty_stop;
+static int             dirty_pending;
+static int             dirty_running;
+
+static void dirty_clear(readmap_dirty_t *dirty)
+{
+    dirty->count = 0;
+    __atomic_store_n(&dirty->bytes, 0, __ATOMIC_RELAXED);
+}
+
+static void dirty_wake(void)
+{
+    pthread_mutex_lock(&dirty_lock);
+    dirty_pending = 1;
+    pthread_cond_signal(&dirty_wakeup);
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+/*
+ * Note that length bytes at offset have been written through the mapping.
+ *
+ * Caller must hold file_state->lock for write.
+ */
+void readmap_dirty_note(readmap_file_state_t *file_state, off_t offset, size_t length)
+{
+    readmap_dirty_t *      dirty = &file_state->dirty;
+    readmap_dirty_extent_t extents[READMAP_DIRTY_EXTENTS + 1];
+    off_t                  start = offset & ~((off_t)dirty_page_size - 1);
+    off_t                  end   = (offset + length + dirty_page_size - 1) & ~((off_t)dirty_page_size - 1);
+    uint64_t               before = dirty->bytes;
+    uint64_t               bytes  = 0;
+    uint64_t               limit;
+    unsigned               count  = 0;
+    unsigned               closest;
+    unsigned               index;
+
+    if (0 == length) {
+        return;
+    }
+
+    // the extents before the new one, then the new one (absorbing any it touches), then the rest
+    for (index = 0; (index < dirty->count) && (dirty->extents[index].end < start); index++) {
+        extents[count++] = dirty->extents[index];
+    }
+    for (; (index < dirty->count) && (dirty->extents[index].start <= end); index++) {
+        if (dirty->extents[index].start < start) {
+            start = dirty->extents[index].start;
+        }
+        if (dirty->extents[index].end > end) {
+            end = dirty->extents[index].end;
+        }
+    }
+    extents[count].start = start;
+    extents[count].end   = end;
+    count++;
+    for (; index < dirty->count; index++) {
+        extents[count++] = dirty->extents[index];
+    }
+
+    if (count > READMAP_DIRTY_EXTENTS) {
+        // no room: merge the two that are closest together
+        closest = 0;
+        for (index = 1; index < count - 1; index++) {
+            if (extents[index + 1].start - extents[index].end < extents[closest + 1].start - extents[closest].end) {
+                closest = index;
+            }
+        }
+        extents[closest].end = extents[closest + 1].end;
+        memmove(&extents[closest + 1], &extents[closest + 2], (count - closest - 2) * sizeof(extents[0]));
+        count--;
+    }
+
+    for (index = 0; index < count; index++) {
+        dirty->extents[index] = extents[index];
+        bytes += extents[index].end - extents[index].start;
+    }
+    dirty->count = count;
+    __atomic_store_n(&dirty->bytes, bytes, __ATOMIC_RELAXED);
+
+    limit = __atomic_load_n(&dirty_limit, __ATOMIC_RELAXED);
+    if ((0 != limit) && (before <= limit) && (bytes > limit)) {
+        dirty_wake();
+    }
+}
+
+/* msync() the parts of the extents that lie within the mapping; returns 0 or an errno value */
+static int dirty_msync(readmap_mapping_t *mapping, const readmap_dirty_extent_t *extents, unsigned count)
+{
+    char * location    = readmap_mapping_location(mapping);
+    off_t  map_offset  = readmap_mapping_offset(mapping);
+    off_t  map_end     = map_offset + readmap_mapping_length(mapping);
+    off_t  start;
+    off_t  end;
+    int    status = 0;
+
+    for (unsigned index = 0; index < count; index++) {
+        start = (extents[index].start > map_offset) ? extents[index].start : map_offset;
+        end   = (extents[index].end < map_end) ? extents[index].end : map_end;
+        if (start >= end) {
+            continue;
+        }
+
+        if ((0 != msync(location + (start - map_offset), end - start, MS_SYNC)) && (0 == status)) {
+            status = errno;
+        }
+    }
+
+    return status;
+}
+
+/*
+ * Write back the dirty extents and wait for them.  Anything dirty outside the current mapping (if
+ * it has been replaced or dropped since the write) is left for the native fsync()/fdatasync()
+ * that follows this.
+ *
+ * Caller must hold file_state->lock for write.
+ */
+int readmap_dirty_flush(readmap_file_state_t *file_state)
+{
+    int status = 0;
+
+    if ((0 != file_state->dirty.count) && file_state->mapped) {
+        status = dirty_msync(file_state->mapping, file_state->dirty.extents, file_state->dirty.count);
+    }
+    dirty_clear(&file_state->dirty);
+
+    return status;
+}
+
+/*
+ * Start writeback of the dirty extents, but don't wait for it.  (MS_ASYNC does nothing on Linux,
+ * so this goes through the file descriptor instead.)
+ *
+ * Caller must hold file_state->lock for write.
+ */
+void readmap_dirty_start_writeback(readmap_file_state_t *file_state)
+{
+    readmap_dirty_t *dirty = &file_state->dirty;
+
+    for (unsigned index = 0; index < dirty->count; index++) {
+        (void)sync_file_range(file_state->fd, dirty->extents[index].start, dirty->extents[index].end - dirty->extents[index].start,
+                              SYNC_FILE_RANGE_WRITE);
+    }
+    dirty_clear(dirty);
+}
+
+static int dirty_flush_visit(readmap_file_state_t *file_state, void *context)
+{
+    readmap_dirty_extent_t extents[READMAP_DIRTY_EXTENTS];
+    readmap_mapping_t *    mapping = NULL;
+    unsigned               count   = 0;
+
+    (void)context;
+
+    if (__atomic_load_n(&file_state->dirty.bytes, __ATOMIC_RELAXED) <= __atomic_load_n(&dirty_limit, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    // take the extents (and hold the mapping) so the writers aren't kept waiting for the I/O
+    pthread_rwlock_wrlock(&file_state->lock);
+    if (file_state->mapped) {
+        mapping = file_state->mapping;
+        readmap_mapping_hold(mapping);
+        count = file_state->dirty.count;
+        memcpy(extents, file_state->dirty.extents, count * sizeof(extents[0]));
+        dirty_clear(&file_state->dirty);
+    }
+    else {
+        readmap_dirty_start_writeback(file_state);
+    }
+    pthread_rwlock_unlock(&file_state->lock);
+
+    if (NULL != mapping) {
+        (void)dirty_msync(mapping, extents, count);
+        readmap_mapping_put(mapping);
+    }
+
+    return 0;
+}
+
+static void *dirty_flusher(void *arg)
+{
+    struct timespec deadline;
+    uint64_t        next;
+
+    (void)arg;
+
+    pthread_mutex_lock(&dirty_lock);
+    while (!dirty_stop) {
+        dirty_pending = 0;
+        pthread_mutex_unlock(&dirty_lock);
+        readmap_visit_file_states(dirty_flush_visit, NULL);
+        pthread_mutex_lock(&dirty_lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        next             = ((uint64_t)deadline.tv_sec * 1000 * 1000 * 1000) + deadline.tv_nsec + READMAP_FLUSH_INTERVAL;
+        deadline.tv_sec  = next / (1000 * 1000 * 1000);
+        deadline.tv_nsec = next % (1000 * 1000 * 1000);
+        while (!dirty_stop && !dirty_pending && (ETIMEDOUT != pthread_cond_timedwait(&dirty_wakeup, &dirty_lock, &deadline))) {
+            // woken early
+        }
+    }
+    pthread_mutex_unlock(&dirty_lock);
+
+    return NULL;
+}
+
+int readmap_init_dirty_tracking(void)
+{
+    const char *       limit = getenv("READMAP_DIRTY_LIMIT_MB");
+    pthread_condattr_t attributes;
+    int                status;
+
+    dirty_page_size = sysconf(_SC_PAGESIZE);
+
+    if ((NULL == limit) || (0 == strtoull(limit, NULL, 0))) {
+        return 0;
+    }
+
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&dirty_wakeup, &attributes);
+    pthread_condattr_destroy(&attributes);
+
+    dirty_stop    = 0;
+    dirty_pending = 0;
+    status        = pthread_create(&dirty_thread, NULL, dirty_flusher, NULL);
+    if (0 != status) {
+        pthread_cond_destroy(&dirty_wakeup);
+        return status;
+    }
+    dirty_running = 1;
+    __atomic_store_n(&dirty_limit, strtoull(limit, NULL, 0) * 1024 * 1024, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+void readmap_terminate_dirty_tracking(void)
+{
+    if (!dirty_running) {
+        return;
+    }
+
+    __atomic_store_n(&dirty_limit, 0, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&dirty_lock);
+    dirty_stop = 1;
+    pthread_cond_signal(&dirty_wakeup);
+    pthread_mutex_unlock(&dirty_lock);
+    pthread_join(dirty_thread, NULL);
+    pthread_cond_destroy(&dirty_wakeup);
+    dirty_running = 0;
+}
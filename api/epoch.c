@@ -0,0 +1,207 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include "api-internal.h"
+
+/*
+ * Epoch based reclamation.
+ *
+ * Readers bracket their use of shared objects with readmap_epoch_enter()/readmap_epoch_exit().
+ * All this does is record (in a per-thread, cache line sized record) the global epoch that was
+ * current when the thread entered.  Nothing shared is written, so readers never contend.
+ *
+ * An object that has been unpublished (so no new reader can find it) is handed to
+ * readmap_epoch_retire(), which advances the global epoch.  Any reader that could still be
+ * looking at the object entered at (or before) the epoch of retirement, so once no thread is
+ * active in such an epoch the object can be released.
+ */
+
+typedef struct readmap_epoch_record
+{
+    uint64_t epoch;    // 0 = not in a critical section
+    unsigned nesting;  // only touched by the owning thread
+    int pending;       // set if this thread retired something while in a critical section
+    int in_use;
+    struct readmap_epoch_record *next;
+} __attribute__((aligned(64))) readmap_epoch_record_t;
+
+static uint64_t global_epoch __attribute__((aligned(64))) = 1;
+static readmap_epoch_record_t *epoch_records;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+static __thread readmap_epoch_record_t *local_record;
+
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static readmap_epoch_entry_t *retire_list;
+
+static void epoch_reclaim(int force);
+
+static void epoch_thread_exit(void *arg)
+{
+    readmap_epoch_record_t *record = (readmap_epoch_record_t *)arg;
+
+    __atomic_store_n(&record->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&record->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void epoch_key_init(void)
+{
+    int status = pthread_key_create(&epoch_key, epoch_thread_exit);
+
+    assert(0 == status);
+    (void)status;
+}
+
+static readmap_epoch_record_t *epoch_get_record(void)
+{
+    readmap_epoch_record_t *record = local_record;
+
+    if (NULL != record) {
+        return record;
+    }
+
+    pthread_once(&epoch_key_once, epoch_key_init);
+
+    // Records are never freed, so reuse one left behind by a thread that has exited
+    for (record = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE); NULL != record; record = record->next) {
+        if (0 == __atomic_exchange_n(&record->in_use, 1, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+
+    if (NULL == record) {
+        record = aligned_alloc(sizeof(readmap_epoch_record_t), sizeof(readmap_epoch_record_t));
+        assert(NULL != record);
+        memset(record, 0, sizeof(readmap_epoch_record_t));
+        record->in_use = 1;
+        record->next   = __atomic_load_n(&epoch_records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&epoch_records, &record->next, record, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            // record->next was updated with the current head
+        }
+    }
+
+    record->nesting = 0;
+    local_record    = record;
+    pthread_setspecific(epoch_key, record);
+
+    return record;
+}
+
+void readmap_epoch_enter(void)
+{
+    readmap_epoch_record_t *record = epoch_get_record();
+
+    if (0 == record->nesting++) {
+        __atomic_store_n(&record->epoch, __atomic_load_n(&global_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        // our epoch must be visible before we look at anything shared
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+void readmap_epoch_exit(void)
+{
+    readmap_epoch_record_t *record = local_record;
+
+    assert(NULL != record);
+    assert(record->nesting > 0);
+
+    if (0 == --record->nesting) {
+        __atomic_store_n(&record->epoch, 0, __ATOMIC_RELEASE);
+
+        if (record->pending) {
+            // we were holding up our own retirements
+            record->pending = 0;
+            epoch_reclaim(0);
+        }
+    }
+}
+
+/*
+ * Return the oldest epoch in which some thread is still active (or UINT64_MAX if none are)
+ */
+static uint64_t epoch_oldest_active(void)
+{
+    uint64_t oldest = UINT64_MAX;
+    uint64_t epoch;
+
+    for (readmap_epoch_record_t *record = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE); NULL != record;
+         record = record->next) {
+        epoch = __atomic_load_n(&record->epoch, __ATOMIC_ACQUIRE);
+        if ((0 != epoch) && (epoch < oldest)) {
+            oldest = epoch;
+        }
+    }
+
+    return oldest;
+}
+
+/*
+ * Release everything that no reader can still be looking at.  If force is set, release
+ * everything; this is only safe when there can be no readers (shutdown).
+ */
+static void epoch_reclaim(int force)
+{
+    readmap_epoch_entry_t *ready = NULL;
+    readmap_epoch_entry_t **prev;
+    readmap_epoch_entry_t *entry;
+    uint64_t oldest;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    oldest = force ? UINT64_MAX : epoch_oldest_active();
+
+    pthread_mutex_lock(&retire_lock);
+    prev = &retire_list;
+    while (NULL != (entry = *prev)) {
+        if (entry->epoch < oldest) {
+            *prev       = entry->next;
+            entry->next = ready;
+            ready       = entry;
+        }
+        else {
+            prev = &entry->next;
+        }
+    }
+    pthread_mutex_unlock(&retire_lock);
+
+    while (NULL != ready) {
+        entry = ready;
+        ready = entry->next;
+        entry->release(entry);
+    }
+}
+
+/*
+ * Hand an object (which must already be unreachable for new readers) over to be released
+ * once all current readers are done with it.  The release callback may run on any thread,
+ * possibly before this call returns.
+ */
+void readmap_epoch_retire(readmap_epoch_entry_t *entry, void (*release)(readmap_epoch_entry_t *entry))
+{
+    entry->release = release;
+    entry->epoch   = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&retire_lock);
+    entry->next = retire_list;
+    retire_list = entry;
+    pthread_mutex_unlock(&retire_lock);
+
+    if ((NULL != local_record) && (local_record->nesting > 0)) {
+        // nothing can be released until we leave our own critical section
+        local_record->pending = 1;
+        return;
+    }
+
+    epoch_reclaim(0);
+}
+
+/*
+ * Used at shutdown to release anything that is still pending.
+ */
+void readmap_epoch_flush(void)
+{
+    epoch_reclaim(1);
+}
@@ -0,0 +1,264 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include "api-internal.h"
+
+/*
+ * Calls that duplicate a descriptor, or otherwise care where its file position is.  The file
+ * offset of a descriptor we serve from a mapping usually lives in user space (see lseek.c), so
+ * it has to be handed back to the kernel first; a duplicate shares the open file description,
+ * and with it the offset, so that offset then stays with the kernel.
+ */
+
+static int fin_dup(int oldfd)
+{
+    typedef int (*orig_dup_t)(int oldfd);
+    static orig_dup_t orig_dup = NULL;
+
+    if (NULL == orig_dup) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_dup = (orig_dup_t)dlsym(RTLD_NEXT, "dup");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_dup);
+    if (NULL == orig_dup) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_dup(oldfd);
+}
+
+static int fin_dup2(int oldfd, int newfd)
+{
+    typedef int (*orig_dup2_t)(int oldfd, int newfd);
+    static orig_dup2_t orig_dup2 = NULL;
+
+    if (NULL == orig_dup2) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_dup2 = (orig_dup2_t)dlsym(RTLD_NEXT, "dup2");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_dup2);
+    if (NULL == orig_dup2) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_dup2(oldfd, newfd);
+}
+
+static int fin_dup3(int oldfd, int newfd, int flags)
+{
+    typedef int (*orig_dup3_t)(int oldfd, int newfd, int flags);
+    static orig_dup3_t orig_dup3 = NULL;
+
+    if (NULL == orig_dup3) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_dup3 = (orig_dup3_t)dlsym(RTLD_NEXT, "dup3");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_dup3);
+    if (NULL == orig_dup3) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_dup3(oldfd, newfd, flags);
+}
+
+static int fin_fcntl(int fd, int cmd, void *arg)
+{
+    typedef int (*orig_fcntl_t)(int fd, int cmd, ...);
+    static orig_fcntl_t orig_fcntl = NULL;
+
+    if (NULL == orig_fcntl) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_fcntl = (orig_fcntl_t)dlsym(RTLD_NEXT, "fcntl");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_fcntl);
+    if (NULL == orig_fcntl) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_fcntl(fd, cmd, arg);
+}
+
+/*
+ * Hand fd's offset back to the kernel; if shared is set the open file description is about to
+ * gain another descriptor, so it stays there.  Returns 0 or an errno value.
+ */
+static int sync_offset(int fd, int shared)
+{
+    readmap_file_state_t *file_state;
+    int                   status = 0;
+
+    file_state = readmap_lookup_file_state(fd);
+    if (NULL != file_state) {
+        pthread_rwlock_wrlock(&file_state->lock);
+        status = shared ? readmap_share_offset(file_state) : readmap_release_offset(file_state);
+        pthread_rwlock_unlock(&file_state->lock);
+        readmap_release_file_state(file_state);
+    }
+
+    return status;
+}
+
+/*
+ * dup2() and dup3() close newfd (if it is open) as they reuse it.  Its state is settled while the
+ * descriptor is still its file, and kept locked across the native call so nothing else uses it in
+ * the meantime; it is only dropped once the call has succeeded.
+ */
+static readmap_file_state_t *replace_begin(int oldfd, int newfd)
+{
+    readmap_file_state_t *file_state;
+
+    if (oldfd == newfd) {
+        // nothing gets closed
+        return NULL;
+    }
+
+    file_state = readmap_lookup_file_state(newfd);
+    if (NULL != file_state) {
+        pthread_rwlock_wrlock(&file_state->lock);
+        readmap_settle_file_state(file_state);
+    }
+
+    return file_state;
+}
+
+static void replace_end(readmap_file_state_t *file_state, int result)
+{
+    int saved_errno = errno;
+
+    if (NULL == file_state) {
+        return;
+    }
+
+    if (result >= 0) {
+        // the descriptor is oldfd's file now
+        (void)readmap_forget_file_state(file_state);
+    }
+    pthread_rwlock_unlock(&file_state->lock);
+    readmap_release_file_state(file_state);
+
+    errno = saved_errno;
+}
+
+int readmap_dup(int oldfd)
+{
+    int status = sync_offset(oldfd, 1);
+
+    if (0 != status) {
+        errno = status;
+        return -1;
+    }
+
+    return fin_dup(oldfd);
+}
+
+int readmap_dup2(int oldfd, int newfd)
+{
+    readmap_file_state_t *file_state;
+    int                   status = sync_offset(oldfd, 1);
+    int                   result;
+
+    if (0 != status) {
+        errno = status;
+        return -1;
+    }
+
+    file_state = replace_begin(oldfd, newfd);
+    result     = fin_dup2(oldfd, newfd);
+    replace_end(file_state, result);
+
+    return result;
+}
+
+int readmap_dup3(int oldfd, int newfd, int flags)
+{
+    readmap_file_state_t *file_state;
+    int                   status = sync_offset(oldfd, 1);
+    int                   result;
+
+    if (0 != status) {
+        errno = status;
+        return -1;
+    }
+
+    file_state = replace_begin(oldfd, newfd);
+    result     = fin_dup3(oldfd, newfd, flags);
+    replace_end(file_state, result);
+
+    return result;
+}
+
+static int internal_fcntl(int fd, int cmd, void *arg)
+{
+    readmap_file_state_t *file_state;
+    int                   status = 0;
+    int                   result;
+
+    switch (cmd) {
+    case F_GETFD:
+    case F_SETFD:
+    case F_GETFL:
+        // nothing to do with the file position
+        break;
+    case F_DUPFD:
+    case F_DUPFD_CLOEXEC:
+        status = sync_offset(fd, 1);
+        break;
+    default:
+        // F_SETFL, and record locks (which may be relative to the file position)
+        status = sync_offset(fd, 0);
+        break;
+    }
+
+    if (0 != status) {
+        errno = status;
+        return -1;
+    }
+
+    result = fin_fcntl(fd, cmd, arg);
+
+    if ((result >= 0) && (F_SETFL == cmd)) {
+        // O_APPEND is the one flag that changes what we do (such writes go to the kernel)
+        file_state = readmap_lookup_file_state(fd);
+        if (NULL != file_state) {
+            pthread_rwlock_wrlock(&file_state->lock);
+            __atomic_store_n(&file_state->flags, (file_state->flags & ~O_APPEND) | ((int)(intptr_t)arg & O_APPEND), __ATOMIC_RELAXED);
+            pthread_rwlock_unlock(&file_state->lock);
+            readmap_release_file_state(file_state);
+        }
+    }
+
+    return result;
+}
+
+int readmap_fcntl(int fd, int cmd, ...)
+{
+    va_list args;
+    void *  arg;
+
+    // the argument (if there is one) is an int or a pointer; pass along whatever is there
+    va_start(args, cmd);
+    arg = va_arg(args, void *);
+    va_end(args);
+
+    return internal_fcntl(fd, cmd, arg);
+}
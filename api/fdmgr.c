@@ -4,10 +4,10 @@
  */
 
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <assert.h>
 #include "api-internal.h"
-#include "list.h"
 
 #if !defined(offsetof)
 #define offsetof(type, member) __builtin_offsetof(type, member)
@@ -23,279 +23,360 @@
 #define container_of(ptr, type, member) (type *)((char *)(ptr)-offsetof(type, member))
 #endif // container_of
 
-typedef uint32_t (*lookup_table_hash_t)(void *key, size_t length);
-
 /*
- * Note: at the present time this is set up for a single lock on the table
- *       this should be sufficient for single process use, but if not,
- *       this could be split into per-bucket locks for greater parallelism.
+ * When preloaded, fstat() is our own (readmap_fstat), which answers from the state already in the
+ * table for the descriptor; here we need to know what the descriptor refers to now.
  */
-typedef struct lookup_table
-{
-    unsigned char EntryCountShift;
-    unsigned char Name[7];
-    pthread_rwlock_t TableLock; /* protects table against changes */
-    lookup_table_hash_t Hash;
-    size_t KeySize;
-    struct list TableBuckets[1];
-} lookup_table_t;
-
-typedef struct lookup_table_entry
+static int fin_fstat(int fd, struct stat *buf)
 {
-    struct list ListEntry;
-    void *Object;
-    unsigned char Key[1];
-} lookup_table_entry_t, *plookup_table_entry_t;
+    typedef int (*orig_fstat_t)(int fd, struct stat *buf);
+    static orig_fstat_t orig_fstat = NULL;
 
-static lookup_table_entry_t *lookup_table_entry_create(void *key, size_t key_size, void *object)
-{
-    size_t size = (offsetof(lookup_table_entry_t, Key) + key_size + 0x7) & ~0x7;
-    lookup_table_entry_t *new_entry = malloc(size);
+    if (NULL == orig_fstat)
+    {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_fstat = (orig_fstat_t)dlsym(RTLD_NEXT, "fstat");
+#pragma GCC diagnostic pop
+    }
 
-    while (NULL != new_entry)
+    assert(NULL != orig_fstat);
+    if (NULL == orig_fstat)
     {
-        new_entry->Object = object;
-        memcpy(new_entry->Key, key, key_size);
-        break;
+        errno = ENOSYS;
+        return -1;
     }
 
-    return new_entry;
+    return orig_fstat(fd, buf);
 }
 
-static void lookup_table_entry_destroy(lookup_table_entry_t *DeadEntry)
-{
-    free(DeadEntry);
-}
+/*
+ * File descriptors are small, dense integers, so rather than hashing them we index a two level
+ * array with them.  The top level is allocated once; second level (leaf) arrays are allocated as
+ * they are needed and are never released until the manager is torn down.  Thus, lookups are a
+ * pair of loads, with no locks and no writes to shared memory.
+ *
+ * File state objects are released via the epoch mechanism, so a reader that finds a state
+ * within an epoch critical section can safely take a reference to it.
+ */
+#define READMAP_FD_LEAF_SHIFT (10)
+#define READMAP_FD_LEAF_SIZE (1 << READMAP_FD_LEAF_SHIFT)
+#define READMAP_FD_TOP_SIZE (4096)
+#define READMAP_FD_MAX (READMAP_FD_TOP_SIZE * READMAP_FD_LEAF_SIZE)
 
-/* simple generic hash */
-static uint32_t default_hash(void *key, size_t length)
+typedef struct fd_table
 {
-    uint32_t hash = ~0;
-    const char *blob = (const char *)key;
+    readmap_file_state_t **Leaves[READMAP_FD_TOP_SIZE];
+} fd_table_t;
 
-    for (unsigned char index = 0; index < length; index += sizeof(uint32_t))
-    {
-        hash ^= *(const uint32_t *)&blob[index];
-    }
-
-    return hash;
-}
-
-static uint32_t lookup_table_hash(lookup_table_t *Table, void *Key)
+static fd_table_t *fd_table_create(void)
 {
-    return (Table->Hash(Key, Table->KeySize) & ((1 << Table->EntryCountShift) - 1));
+    return calloc(1, sizeof(fd_table_t));
 }
 
-static lookup_table_t *lookup_table_create(unsigned int SizeHint, const char *Name, lookup_table_hash_t Hash, size_t KeySize)
+static void fd_table_destroy(fd_table_t *Table)
 {
-    lookup_table_t *table = NULL;
-    unsigned char entry_count_shift = 0;
-    unsigned entrycount;
-
-    if (SizeHint > 65536)
+    for (unsigned index = 0; index < READMAP_FD_TOP_SIZE; index++)
     {
-        SizeHint = 65536;
+        // note: any remaining file state objects are simply abandoned (once their files have been
+        // put in order, see readmap_terminate_file_state_mgr)
+        free(Table->Leaves[index]);
     }
+    free(Table);
+}
+
+/* returns the slot for this fd, or NULL (if the leaf doesn't exist and create isn't set) */
+static readmap_file_state_t **fd_table_slot(fd_table_t *Table, int fd, int create)
+{
+    readmap_file_state_t **leaf;
+    readmap_file_state_t **new_leaf;
 
-    while (((unsigned int)(1 << entry_count_shift)) < SizeHint)
+    if ((fd < 0) || (fd >= READMAP_FD_MAX))
     {
-        entry_count_shift++;
+        return NULL;
     }
 
-    entrycount = 1 << entry_count_shift;
-
-    table = malloc(offsetof(struct lookup_table, TableBuckets) + (sizeof(struct list) * entrycount));
+    leaf = __atomic_load_n(&Table->Leaves[fd >> READMAP_FD_LEAF_SHIFT], __ATOMIC_ACQUIRE);
 
-    while (NULL != table)
+    if ((NULL == leaf) && create)
     {
-        table->EntryCountShift = entry_count_shift;
-        memcpy(table->Name, Name, 7);
-        table->Hash = Hash ? Hash : default_hash;
-        table->KeySize = KeySize;
-        pthread_rwlock_init(&table->TableLock, NULL);
+        new_leaf = calloc(READMAP_FD_LEAF_SIZE, sizeof(readmap_file_state_t *));
+        if (NULL == new_leaf)
+        {
+            return NULL;
+        }
 
-        for (unsigned index = 0; index < entrycount; index++)
+        if (__atomic_compare_exchange_n(&Table->Leaves[fd >> READMAP_FD_LEAF_SHIFT], &leaf, new_leaf, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
         {
-            table->TableBuckets[index].prv = table->TableBuckets[index].nxt = &table->TableBuckets[index];
+            leaf = new_leaf;
+        }
+        else
+        {
+            // lost the race; leaf now holds the winner's array
+            free(new_leaf);
         }
-        break;
     }
 
-    return table;
+    if (NULL == leaf)
+    {
+        return NULL;
+    }
+
+    return &leaf[fd & (READMAP_FD_LEAF_SIZE - 1)];
 }
 
-static void lookup_table_destroy(lookup_table_t *Table)
+static int fd_table_insert(fd_table_t *Table, int fd, readmap_file_state_t *FileState)
 {
-    unsigned bucket_index = 0;
-    lookup_table_entry_t *table_entry;
+    readmap_file_state_t **slot = fd_table_slot(Table, fd, 1);
+    readmap_file_state_t *expected = NULL;
 
-    pthread_rwlock_wrlock(&Table->TableLock);
+    if (NULL == slot)
+    {
+        return (fd < 0) || (fd >= READMAP_FD_MAX) ? EBADF : ENOMEM;
+    }
 
-    for (bucket_index = 0; bucket_index < (unsigned)(1 << Table->EntryCountShift); bucket_index++)
+    if (!__atomic_compare_exchange_n(slot, &expected, FileState, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
     {
-        while (!list_is_empty(&Table->TableBuckets[bucket_index]))
-        {
-            table_entry = container_of(list_head(&Table->TableBuckets[bucket_index]), struct lookup_table_entry, ListEntry);
-            list_remove(&table_entry->ListEntry);
-            lookup_table_entry_destroy(table_entry);
-        }
+        return EEXIST;
     }
 
-    pthread_rwlock_unlock(&Table->TableLock);
+    return 0;
+}
 
-    free(Table);
+static readmap_file_state_t *fd_table_lookup(fd_table_t *Table, int fd)
+{
+    readmap_file_state_t **slot = fd_table_slot(Table, fd, 0);
 
-    return;
+    return NULL == slot ? NULL : __atomic_load_n(slot, __ATOMIC_ACQUIRE);
 }
 
-static struct lookup_table_entry *lookup_table_locked(lookup_table_t *Table, void *Key)
+/* removes the entry, but only if it still refers to FileState */
+static int fd_table_remove(fd_table_t *Table, int fd, readmap_file_state_t *FileState)
 {
-    uint32_t bucket_index = lookup_table_hash(Table, Key);
-    struct lookup_table_entry *table_entry = NULL;
-    struct list *le;
+    readmap_file_state_t **slot = fd_table_slot(Table, fd, 0);
+    readmap_file_state_t *expected = FileState;
 
-    list_for_each(&Table->TableBuckets[bucket_index], le)
+    if ((NULL == slot) || !__atomic_compare_exchange_n(slot, &expected, NULL, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
     {
-        table_entry = container_of(le, struct lookup_table_entry, ListEntry);
-        if (0 == memcmp(Key, table_entry->Key, Table->KeySize))
-        {
-            return table_entry;
-        }
+        return ENODATA;
     }
 
-    return NULL;
+    return 0;
 }
 
-static int lookup_table_insert(lookup_table_t *Table, void *Key, void *Object)
+/* local lookup table based on file descriptors */
+static fd_table_t *fd_lookup_table;
+
+/*
+ * The readmap_file_state_t structure is reference counted.  The table holds one reference, and
+ * each successful readmap_lookup_file_state() returns another, which the caller drops with
+ * readmap_release_file_state().  Thus, a close can race with reads that are still using the
+ * mapping: the mapping and the memory are released when the last reference is dropped.
+ *
+ * The count is split across per-CPU slots, so threads on different CPUs don't fight over a
+ * single cache line.  Only the sum is meaningful (a reference may be taken on one CPU and
+ * dropped on another), and it is only computed once the state is dead (no longer in the
+ * table).  Since a lookup might have found the state just before it was removed, the sum
+ * isn't trusted until an epoch grace period has passed; after that no new reference can be
+ * taken, so the sum only goes down and zero is final.
+ *
+ * Dropping a reference is done within an epoch critical section, as the releaser still looks at
+ * the state after its decrement, by which time some other thread may have seen the zero.  For
+ * the same reason, the memory itself goes through a second grace period before it is freed.
+ */
+
+static inline readmap_ref_slot_t *file_state_ref_slot(readmap_file_state_t *file_state)
 {
-    lookup_table_entry_t *entry = lookup_table_entry_create(Key, Table->KeySize, Object);
-    int status = ENOMEM;
-    uint32_t bucket_index = lookup_table_hash(Table, Key);
-    struct lookup_table_entry *table_entry = NULL;
+    int cpu = sched_getcpu();
 
-    while (NULL != entry)
-    {
-        pthread_rwlock_wrlock(&Table->TableLock);
-        table_entry = lookup_table_locked(Table, Key);
+    return &file_state->refs[(cpu < 0 ? 0 : cpu) & (READMAP_REF_SLOTS - 1)];
+}
 
-        if (table_entry)
-        {
-            status = EEXIST;
-        }
-        else
-        {
-            list_insert_tail(&Table->TableBuckets[bucket_index], &entry->ListEntry);
-            status = 0;
-        }
-        pthread_rwlock_unlock(&Table->TableLock);
+static void file_state_ref(readmap_file_state_t *file_state)
+{
+    __atomic_add_fetch(&file_state_ref_slot(file_state)->count, 1, __ATOMIC_SEQ_CST);
+}
 
-        break;
-    }
+/*
+ * File states come from a slab, which keeps their locks initialized between uses (and them a
+ * cache line apart, as the reference count slots want their own lines.)
+ */
+static void file_state_construct(void *object)
+{
+    pthread_rwlock_init(&((readmap_file_state_t *)object)->lock, NULL);
+}
 
-    if (0 != status)
-    {
-        if (NULL != entry)
-        {
-            free(entry);
-            entry = NULL;
-        }
-    }
+// the read path relies on what it reads sharing one line that nothing writes to (api-internal.h)
+_Static_assert(offsetof(readmap_file_state_t, fd) <= 64, "the read-hot fields of readmap_file_state_t no longer fit in a cache line");
+_Static_assert(0 == (offsetof(readmap_file_state_t, lock) % 64), "readmap_file_state_t's lock must start a cache line");
 
-    return status;
+static readmap_slab_t file_state_slab = READMAP_SLAB_INITIALIZER(READMAP_SLAB_FILE_STATE, sizeof(readmap_file_state_t), file_state_construct);
+
+static void file_state_free(readmap_epoch_entry_t *entry)
+{
+    readmap_slab_free(&file_state_slab, container_of(entry, readmap_file_state_t, retire_entry));
+}
+
+static void file_state_destroy(readmap_file_state_t *file_state)
+{
+    readmap_unmap_file(file_state);
+    // normally done when it was deleted; not if it went stale
+    (void)readmap_stop_extending(file_state, 0);
+    readmap_inode_put(file_state->inode);
+    readmap_size_cleanup(file_state);
+    // the entry is free for reuse: the first grace period has completed
+    readmap_epoch_retire(&file_state->retire_entry, file_state_free);
 }
 
-static int lookup_table_lookup(lookup_table_t *Table, void *Key, void **Object)
+/* release the state if it is dead, past its grace period, and unreferenced */
+static void file_state_try_destroy(readmap_file_state_t *file_state)
 {
-    struct lookup_table_entry *entry;
+    int64_t references = 0;
+    unsigned char expected = 0;
 
-    pthread_rwlock_rdlock(&Table->TableLock);
-    entry = lookup_table_locked(Table, Key);
-    pthread_rwlock_unlock(&Table->TableLock);
+    if (!__atomic_load_n(&file_state->grace, __ATOMIC_SEQ_CST))
+    {
+        // the grace period callback will check again
+        return;
+    }
 
-    if (entry)
+    for (unsigned index = 0; index < READMAP_REF_SLOTS; index++)
     {
-        *Object = entry->Object;
+        references += __atomic_load_n(&file_state->refs[index].count, __ATOMIC_SEQ_CST);
     }
-    else
+
+    assert(references >= 0);
+    if (0 != references)
     {
-        *Object = NULL;
+        return;
     }
 
-    return NULL == entry ? ENODATA : 0;
+    // both the last releaser and the grace period callback can get here
+    if (__atomic_compare_exchange_n(&file_state->destroyed, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+        file_state_destroy(file_state);
+    }
 }
 
-static int lookup_table_remove(lookup_table_t *Table, void *Key)
+static void file_state_grace_done(readmap_epoch_entry_t *entry)
 {
-    struct lookup_table_entry *entry;
-    int status = ENODATA;
+    readmap_file_state_t *file_state = container_of(entry, readmap_file_state_t, retire_entry);
 
-    pthread_rwlock_wrlock(&Table->TableLock);
-    entry = lookup_table_locked(Table, Key);
+    __atomic_store_n(&file_state->grace, 1, __ATOMIC_SEQ_CST);
+    file_state_try_destroy(file_state);
+}
 
-    if (entry)
-    {
-        list_remove(&entry->ListEntry);
-    }
-    pthread_rwlock_unlock(&Table->TableLock);
+void readmap_release_file_state(readmap_file_state_t *file_state)
+{
+    readmap_epoch_enter();
+    __atomic_sub_fetch(&file_state_ref_slot(file_state)->count, 1, __ATOMIC_SEQ_CST);
 
-    if (entry)
+    if (__atomic_load_n(&file_state->dead, __ATOMIC_SEQ_CST))
     {
-        lookup_table_entry_destroy(entry);
-        status = 0;
+        file_state_try_destroy(file_state);
     }
-
-    return status;
+    readmap_epoch_exit();
 }
 
-/* local lookup table based on file descriptors */
-/* static */ lookup_table_t *fd_lookup_table;
-
 /*
- * Note: at the present time, the readmap_file_state_t structure is **Not** reference counted.
- *       Instead, it relies upon the open/close management logic to know when it is time
- *       to delete the state.
+ * The state has been removed from the table: mark it dead and drop the table's reference.
  */
+static void file_state_unpublished(readmap_file_state_t *file_state)
+{
+    __atomic_store_n(&file_state->dead, 1, __ATOMIC_SEQ_CST);
+    readmap_epoch_retire(&file_state->retire_entry, file_state_grace_done);
+    readmap_release_file_state(file_state);
+}
 
 readmap_file_state_t *readmap_create_file_state(int fd, const char *pathname, int flags)
 {
     readmap_file_state_t *file_state = NULL;
-    size_t size = sizeof(readmap_file_state_t);
     int status;
     struct stat st;
 
-    (void)pathname;
+    (void)pathname; // files are identified by inode, not name
 
-    assert(fd_lookup_table);
+    if (NULL == __atomic_load_n(&fd_lookup_table, __ATOMIC_ACQUIRE))
+    {
+        // Not set up yet, or shut down: when preloaded, we see the opens made by our own
+        // initialization, and by other libraries' constructors and destructors.  Those files are
+        // left to the kernel.
+        return NULL;
+    }
 
-    status = fstat(fd, &st);
-    if (!S_ISREG(st.st_mode))
+    // O_DIRECT asks to bypass the page cache, which is exactly what a mapping can't do
+    status = fin_fstat(fd, &st);
+    if ((0 != status) || !S_ISREG(st.st_mode) || (flags & O_DIRECT))
     {
         return NULL;
     }
 
-    file_state = malloc(size);
+    file_state = readmap_slab_alloc(&file_state_slab);
     while (NULL != file_state)
     {
+        // the size (and any padding) is shared with the other file states for this file
+        file_state->inode = readmap_inode_get(st.st_dev, st.st_ino);
+        if (NULL == file_state->inode)
+        {
+            readmap_slab_free(&file_state_slab, file_state);
+            file_state = NULL;
+            break;
+        }
+
         file_state->fd = fd;
-        file_state->check_size = 0;
         file_state->mapped = 0;
         file_state->flags = flags;
         file_state->mode = st.st_mode;
+        file_state->dev = st.st_dev;
+        file_state->ino = st.st_ino;
+        file_state->mapping = NULL;
         file_state->map_location = 0;
-        pthread_rwlock_init(&file_state->lock, NULL);
+        file_state->map_offset = 0;
+        file_state->map_length = 0;
+        file_state->offset = 0;
+        file_state->offset_owned = 0;
+        file_state->offset_shared = 0;
+        file_state->dirty.count = 0;
+        file_state->dirty.bytes = 0;
+        file_state->extending = 0;
+        file_state->next_extender = NULL;
+        file_state->dead = 0;
+        file_state->grace = 0;
+        file_state->destroyed = 0;
+        memset(file_state->refs, 0, sizeof(file_state->refs));
+        file_state->refs[0].count = 1; // the table's reference
         file_state->hash = 0; // TODO
-
-        file_state->cached_size = 0;
-        status = clock_gettime(CLOCK_REALTIME_COARSE, &file_state->check_time);
-        assert(0 == status);
+        readmap_size_init(file_state);
+        readmap_access_init(file_state);
+        file_state->served_calls = 0;
+        file_state->served_bytes = 0;
 
         // Try to insert it
-        status = lookup_table_insert(fd_lookup_table, &fd, file_state);
+        status = fd_table_insert(fd_lookup_table, fd, file_state);
+
+        if (EEXIST == status)
+        {
+            // The previous user of this fd was closed without our seeing it (e.g., inside the C
+            // library), so the state we have is stale.  It describes some other file, so all we can
+            // do is discard it.
+            readmap_file_state_t *stale_state;
+
+            readmap_epoch_enter();
+            stale_state = fd_table_lookup(fd_lookup_table, fd);
+            if ((NULL != stale_state) && (0 == fd_table_remove(fd_lookup_table, fd, stale_state)))
+            {
+                file_state_unpublished(stale_state);
+            }
+            readmap_epoch_exit();
+
+            status = fd_table_insert(fd_lookup_table, fd, file_state);
+        }
 
         if (0 != status)
         {
-            // note: we *could* do a lookup in case of a collision, but we shouldn't need to do so
-            free(file_state);
+            readmap_size_cleanup(file_state);
+            readmap_inode_put(file_state->inode);
+            readmap_slab_free(&file_state_slab, file_state);
             file_state = NULL;
             break;
         }
@@ -307,116 +388,152 @@ readmap_file_state_t *readmap_create_file_state(int fd, const char *pathname, in
     return file_state;
 }
 
+/*
+ * Returns a referenced state, which the caller must release (readmap_release_file_state)
+ */
 readmap_file_state_t *readmap_lookup_file_state(int fd)
 {
+    fd_table_t *table = __atomic_load_n(&fd_lookup_table, __ATOMIC_ACQUIRE);
     readmap_file_state_t *file_state;
-    int status;
 
-    if (NULL == fd_lookup_table)
+    if (NULL == table)
     {
         // This can happen during shutdown.
         return NULL;
     }
 
-    assert(fd_lookup_table);
-    status = lookup_table_lookup(fd_lookup_table, &fd, (void **)&file_state);
-
-    if (0 != status)
+    // the epoch keeps the memory valid until we have our reference
+    readmap_epoch_enter();
+    file_state = fd_table_lookup(table, fd);
+    if (NULL != file_state)
     {
-        file_state = NULL;
+        file_state_ref(file_state);
+        if (__atomic_load_n(&file_state->dead, __ATOMIC_SEQ_CST))
+        {
+            // raced with a close
+            readmap_release_file_state(file_state);
+            file_state = NULL;
+        }
     }
+    readmap_epoch_exit();
 
     return file_state;
 }
 
-static inline void timespec_diff(struct timespec *begin, struct timespec *end, struct timespec *diff)
+/*
+ * Call visit with (a reference to) each file state in the table, until it returns non-zero.  This
+ * is for reporting (see shmstats.c); states come and go while it runs.
+ */
+void readmap_visit_file_states(int (*visit)(readmap_file_state_t *file_state, void *context), void *context)
 {
-    struct timespec result = {.tv_sec = 0, .tv_nsec = 0};
-    assert((end->tv_sec > begin->tv_sec) || ((end->tv_sec == begin->tv_sec) && end->tv_nsec >= begin->tv_nsec));
-    result.tv_sec = end->tv_sec - begin->tv_sec;
-    if (end->tv_nsec < begin->tv_nsec)
+    fd_table_t *table = __atomic_load_n(&fd_lookup_table, __ATOMIC_ACQUIRE);
+    readmap_file_state_t **leaf;
+    readmap_file_state_t *file_state;
+    int stop = 0;
+
+    if (NULL == table)
     {
-        result.tv_sec--;
-        result.tv_nsec = (long)1000000000 + end->tv_nsec - begin->tv_nsec;
+        return;
+    }
+
+    for (unsigned top = 0; (top < READMAP_FD_TOP_SIZE) && !stop; top++)
+    {
+        leaf = __atomic_load_n(&table->Leaves[top], __ATOMIC_ACQUIRE);
+        if (NULL == leaf)
+        {
+            continue;
+        }
+
+        for (unsigned index = 0; (index < READMAP_FD_LEAF_SIZE) && !stop; index++)
+        {
+            if (NULL == __atomic_load_n(&leaf[index], __ATOMIC_RELAXED))
+            {
+                continue;
+            }
+
+            file_state = readmap_lookup_file_state((int)((top << READMAP_FD_LEAF_SHIFT) | index));
+            if (NULL != file_state)
+            {
+                stop = visit(file_state, context);
+                readmap_release_file_state(file_state);
+            }
+        }
     }
-    *diff = result;
 }
 
-static void readmap_update_size(readmap_file_state_t *file_state)
+/*
+ * The file descriptor is about to stop referring to the file: put the real file position and size
+ * back while we still have it (others may share the open file description), and get what we wrote
+ * on its way to disk; the rest can wait for the readers.
+ *
+ * Caller must hold file_state->lock for write.
+ */
+void readmap_settle_file_state(readmap_file_state_t *file_state)
 {
-    struct stat st;
     int status;
 
-    assert(S_ISREG(file_state->mode)); // shouldn't be handling anything but files
-
-    status = fstat(file_state->fd, &st);
-    assert(0 == status);
-
-    file_state->check_size = 0;
-    file_state->cached_size = st.st_size;
-    status = clock_gettime(CLOCK_REALTIME, &file_state->check_time);
+    (void)readmap_release_offset(file_state);
+    readmap_dirty_start_writeback(file_state);
+    status = readmap_stop_extending(file_state, 1);
     assert(0 == status);
+    (void)status;
 }
 
-size_t readmap_get_size(readmap_file_state_t *file_state)
+/*
+ * Removes the state from the table and drops the table's reference.  The caller's own reference
+ * (from the lookup) remains valid until it is released.
+ */
+void readmap_delete_file_state(readmap_file_state_t *file_state)
 {
-    struct timespec now, diff;
-    int status = clock_gettime(CLOCK_REALTIME, &now);
-    size_t size;
+    int fd;
+    int status;
 
+    assert(fd_lookup_table);
+    fd = file_state->fd;
+    status = fd_table_remove(fd_lookup_table, fd, file_state);
     assert(0 == status);
-
-    pthread_rwlock_rdlock(&file_state->lock);
-    timespec_diff(&now, &file_state->check_time, &diff);
-    size = file_state->cached_size;
-    pthread_rwlock_unlock(&file_state->lock);
-
-    if (diff.tv_sec > 0) // at least 1 second
+    if (0 != status)
     {
-        pthread_rwlock_wrlock(&file_state->lock);
-        readmap_update_size(file_state);
-        size = file_state->cached_size;
-        pthread_rwlock_unlock(&file_state->lock);
+        return;
     }
 
-    return size;
+    pthread_rwlock_wrlock(&file_state->lock);
+    readmap_settle_file_state(file_state);
+    pthread_rwlock_unlock(&file_state->lock);
+
+    file_state_unpublished(file_state);
 }
 
-void readmap_delete_file_state(readmap_file_state_t *file_state)
+/*
+ * Removes the state from the table without going near its file descriptor, which no longer refers
+ * to the file the state describes.  Returns ENODATA if the state had already gone.
+ */
+int readmap_forget_file_state(readmap_file_state_t *file_state)
 {
-    int fd;
     int status;
 
     assert(fd_lookup_table);
-    fd = file_state->fd;
-    status = lookup_table_remove(fd_lookup_table, &fd);
-    assert(0 == status);
+    status = fd_table_remove(fd_lookup_table, file_state->fd, file_state);
     if (0 != status)
     {
-        return;
+        return status;
     }
 
-    // cleanup the file state
-    free(file_state);
+    file_state_unpublished(file_state);
+
+    return 0;
 }
 
 int readmap_init_file_state_mgr(void)
 {
-    lookup_table_t *new_table = NULL;
+    fd_table_t *new_table = NULL;
     int status = 0;
 
     while (NULL == fd_lookup_table)
     {
         /*
-         * table size: this is a speed/space trade-off.  I did a quick run with various power-of-two values with
-         * a test of 64K file descriptors (which is the max on my linux box at this time for a single process).
-         * I don't want to add dynamic resizing into the mix, though someone _could_ do so, if they thought it
-         * worth the cost (I've seldom found it to be worthwhile).  Another approach would be to use a more
-         * efficient secondary scheme, such as b-tree or AVL tree.  That still gives good parallelism across
-         * buckets.
-         *
-         * My test iteratively created 64K entries, then looked each of them up 100 times.  I picked the value
-         * that seemed to be a reasonable compromise between space and efficiency.
+         * This used to be a hash table (lookup_table_t) with 4096 buckets under a single lock.  A quick run
+         * that iteratively created 64K entries and looked each of them up 100 times gave:
          *
          * 8192 -  2.420 seconds
          * 4096 -  3.022 seconds
@@ -424,8 +541,11 @@ int readmap_init_file_state_mgr(void)
          * 1024 -  7.654 seconds
          *  512 - 14.118 seconds
          *
+         * but every lookup took the table lock, which made it a contention point for multi-threaded readers.
+         * The direct indexed table avoids both the hashing and the lock.
+         * tests/tablebench.c compares the two as the number of threads grows.
          */
-        new_table = lookup_table_create(4096, "readmapFD", NULL, sizeof(int));
+        new_table = fd_table_create();
 
         if (NULL == new_table)
         {
@@ -436,7 +556,7 @@ int readmap_init_file_state_mgr(void)
         if (!__sync_bool_compare_and_swap(&fd_lookup_table, NULL, new_table))
         {
             // presumably a race that we've lost
-            lookup_table_destroy(new_table);
+            fd_table_destroy(new_table);
             new_table = NULL;
             status = EINVAL;
             break;
@@ -448,15 +568,35 @@ int readmap_init_file_state_mgr(void)
     return status;
 }
 
+/*
+ * The descriptor outlives the library, and from now on it is the kernel's alone: give it back the
+ * real file position and size, and get what was written through the mapping to disk.
+ */
+static int file_state_shutdown_visit(readmap_file_state_t *file_state, void *context)
+{
+    (void)context;
+
+    pthread_rwlock_wrlock(&file_state->lock);
+    (void)readmap_release_offset(file_state);
+    (void)readmap_dirty_flush(file_state);
+    (void)readmap_trim_file(file_state);
+    pthread_rwlock_unlock(&file_state->lock);
+
+    return 0;
+}
+
 void readmap_terminate_file_state_mgr(void)
 {
-    lookup_table_t *existing_table = fd_lookup_table;
+    fd_table_t *existing_table = fd_lookup_table;
 
     if (NULL != existing_table)
     {
+        readmap_visit_file_states(file_state_shutdown_visit, NULL);
+
         if (__sync_bool_compare_and_swap(&fd_lookup_table, existing_table, NULL))
         {
-            lookup_table_destroy(existing_table);
+            fd_table_destroy(existing_table);
+            readmap_epoch_flush();
         }
         /* else: don't do anything because it changed and someone else must be doing something */
     }
@@ -13,6 +13,16 @@ pthread_once_t readmap_initialized = PTHREAD_ONCE_INIT;
 static void readmap_init_internal(void)
 {
     readmap_initialized = 1;
+    readmap_init_stats();
+    readmap_init_shm_stats();
+    readmap_init_copy();
+    readmap_init_mapping_cache();
+    readmap_init_size_tracking();
+    readmap_init_access_tracking();
+    readmap_init_prefetch();
+    readmap_init_uring();
+    readmap_init_dirty_tracking();
+    readmap_init_offset_tracking();
     readmap_init_file_state_mgr();
 }
 
@@ -23,17 +33,18 @@ void readmap_init(void)
 
 void readmap_shutdown(void)
 {
-    static unsigned char shutdown_called;
     static pthread_mutex_t shutdown_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    if (0 == shutdown_called)
-    {
-        pthread_mutex_lock(&shutdown_lock);
-        if (0 == shutdown_called)
-        {
-            readmap_terminate_file_state_mgr();
-            shutdown_called = 1;
-        }
-        pthread_mutex_unlock(&shutdown_lock);
-    }
+    pthread_mutex_lock(&shutdown_lock);
+    readmap_terminate_shm_stats();
+    readmap_terminate_stats();
+    readmap_terminate_uring();
+    readmap_terminate_dirty_tracking();
+    readmap_terminate_file_state_mgr();
+    readmap_terminate_prefetch();
+    readmap_terminate_mapping_cache();
+    readmap_terminate_size_tracking();
+    // allow a subsequent readmap_init() to bring things back up
+    readmap_initialized = PTHREAD_ONCE_INIT;
+    pthread_mutex_unlock(&shutdown_lock);
 }
@@ -0,0 +1,551 @@
+/*
+ * (C) Copyright 2017 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <assert.h>
+#include "api-internal.h"
+#include "lookuptable.h"
+#include "list.h"
+
+#if !defined(offsetof)
+#define offsetof(type, member) __builtin_offsetof(type, member)
+#endif // offsetof
+
+#if !defined(container_of)
+#define container_of(ptr, type, member) (type *)((char *)(ptr)-offsetof(type, member))
+#endif // container_of
+
+/*
+ * Each bucket has its own lock, and the table sizes itself: it grows when the entries average
+ * more than LOOKUP_TABLE_GROW_LOAD per bucket, and shrinks when they average less than one in
+ * LOOKUP_TABLE_SHRINK_LOAD, in both cases to about one entry per bucket.
+ *
+ * Resizing doesn't stop anyone.  The new bucket array is published with a pointer to the old one
+ * (Previous), and from then on every operation first moves the old bucket its key hashes to into
+ * the new array, plus a few more (LOOKUP_TABLE_MIGRATE_STEP that have entries, or up to
+ * LOOKUP_TABLE_MIGRATE_EMPTY of the empty buckets a shrinking table is mostly made of), before
+ * doing its work there.  Moved buckets are marked, so anyone who got to one through a stale array
+ * pointer knows to start again.  Whoever moves the last bucket unlinks the old array and hands it to the epoch code
+ * (epoch.c) to be released once nobody can still be looking at it.
+ *
+ * Locks are taken old bucket first, then new bucket, and only while moving entries; everything
+ * else holds one bucket lock at a time.
+ *
+ * The entry count is split over LOOKUP_TABLE_COUNT_SLOTS cache lines (by bucket) so that inserts
+ * and removes don't all write the same one; it only has to be added up when a bucket gets long or
+ * empty.
+ */
+#define LOOKUP_TABLE_MIN_SHIFT (4)
+#define LOOKUP_TABLE_MAX_SHIFT (24)
+#define LOOKUP_TABLE_GROW_LOAD (2)
+#define LOOKUP_TABLE_GROW_CHAIN (4)  // only look at the load when a bucket gets this long
+#define LOOKUP_TABLE_SHRINK_LOAD (8)
+#define LOOKUP_TABLE_MIGRATE_STEP (2)    // buckets with something in them
+#define LOOKUP_TABLE_MIGRATE_EMPTY (16)  // or this many empty ones
+#define LOOKUP_TABLE_COUNT_SLOTS (8)
+
+typedef struct lookup_table_bucket
+{
+    pthread_mutex_t Lock;
+    struct list Entries;
+    unsigned Length;
+    unsigned char Moved; /* the entries are now in the next array */
+} lookup_table_bucket_t;
+
+typedef struct lookup_table_array
+{
+    struct lookup_table_array *Previous; /* still being drained into this one */
+    unsigned char Shift;
+    uint32_t NextToMigrate;              /* when draining: the next bucket to claim */
+    uint32_t Migrated;                   /* and how many have been moved */
+    readmap_epoch_entry_t RetireEntry;
+    lookup_table_bucket_t Buckets[1];
+} lookup_table_array_t;
+
+typedef struct lookup_table_count
+{
+    int64_t Count;
+} __attribute__((aligned(64))) lookup_table_count_t;
+
+typedef struct lookup_table
+{
+    unsigned char Name[8];
+    lookup_table_array_t *Current;
+    pthread_mutex_t ResizeLock; /* one resize at a time */
+    lookup_table_hash_t Hash;
+    size_t KeySize;
+    lookup_table_count_t Counts[LOOKUP_TABLE_COUNT_SLOTS];
+} lookup_table_t;
+
+typedef struct lookup_table_entry
+{
+    struct list ListEntry;
+    void *Object;
+    uint32_t Hash;
+    unsigned char Key[1];
+} lookup_table_entry_t, *plookup_table_entry_t;
+
+/*
+ * Entries small enough (which covers integer and pointer keys) come from a slab; others from
+ * malloc.
+ */
+#define LOOKUP_TABLE_SLAB_ENTRY (64)
+
+static readmap_slab_t entry_slab = READMAP_SLAB_INITIALIZER(READMAP_SLAB_TABLE_ENTRY, LOOKUP_TABLE_SLAB_ENTRY, NULL);
+
+static lookup_table_entry_t *lookup_table_entry_create(void *key, size_t key_size, uint32_t hash, void *object)
+{
+    size_t size = (offsetof(lookup_table_entry_t, Key) + key_size + 0x7) & ~0x7;
+    lookup_table_entry_t *new_entry = (size <= LOOKUP_TABLE_SLAB_ENTRY) ? readmap_slab_alloc(&entry_slab) : malloc(size);
+
+    while (NULL != new_entry)
+    {
+        new_entry->Object = object;
+        new_entry->Hash = hash;
+        memcpy(new_entry->Key, key, key_size);
+        break;
+    }
+
+    return new_entry;
+}
+
+static void lookup_table_entry_destroy(lookup_table_entry_t *DeadEntry, size_t key_size)
+{
+    if (((offsetof(lookup_table_entry_t, Key) + key_size + 0x7) & ~0x7) <= LOOKUP_TABLE_SLAB_ENTRY)
+    {
+        readmap_slab_free(&entry_slab, DeadEntry);
+        return;
+    }
+
+    free(DeadEntry);
+}
+
+/* simple generic hash */
+static uint32_t default_hash(void *key, size_t length)
+{
+    uint32_t hash = ~0;
+    const char *blob = (const char *)key;
+
+    for (unsigned char index = 0; index < length; index += sizeof(uint32_t))
+    {
+        hash ^= *(const uint32_t *)&blob[index];
+    }
+
+    return hash;
+}
+
+static inline uint32_t lookup_table_index(lookup_table_array_t *Array, uint32_t Hash)
+{
+    return Hash & ((1U << Array->Shift) - 1);
+}
+
+static lookup_table_array_t *lookup_table_array_create(unsigned char Shift)
+{
+    uint32_t bucket_count = 1U << Shift;
+    lookup_table_array_t *array = malloc(offsetof(lookup_table_array_t, Buckets) + (sizeof(lookup_table_bucket_t) * bucket_count));
+
+    while (NULL != array)
+    {
+        array->Previous = NULL;
+        array->Shift = Shift;
+        array->NextToMigrate = 0;
+        array->Migrated = 0;
+
+        for (unsigned index = 0; index < bucket_count; index++)
+        {
+            pthread_mutex_init(&array->Buckets[index].Lock, NULL);
+            array->Buckets[index].Entries.prv = array->Buckets[index].Entries.nxt = &array->Buckets[index].Entries;
+            array->Buckets[index].Length = 0;
+            array->Buckets[index].Moved = 0;
+        }
+        break;
+    }
+
+    return array;
+}
+
+/* frees the array; any entries must already be gone */
+static void lookup_table_array_destroy(lookup_table_array_t *Array)
+{
+    for (unsigned index = 0; index < (1U << Array->Shift); index++)
+    {
+        assert(list_is_empty(&Array->Buckets[index].Entries));
+        pthread_mutex_destroy(&Array->Buckets[index].Lock);
+    }
+
+    free(Array);
+}
+
+static void lookup_table_array_release(readmap_epoch_entry_t *Entry)
+{
+    lookup_table_array_destroy(container_of(Entry, lookup_table_array_t, RetireEntry));
+}
+
+static int64_t lookup_table_count(lookup_table_t *Table)
+{
+    int64_t count = 0;
+
+    for (unsigned index = 0; index < LOOKUP_TABLE_COUNT_SLOTS; index++)
+    {
+        count += __atomic_load_n(&Table->Counts[index].Count, __ATOMIC_RELAXED);
+    }
+
+    return count;
+}
+
+/* the shift that gives about one bucket per entry */
+static unsigned char lookup_table_fit(int64_t Count)
+{
+    unsigned char shift = LOOKUP_TABLE_MIN_SHIFT;
+
+    while ((shift < LOOKUP_TABLE_MAX_SHIFT) && (((int64_t)1 << shift) < Count))
+    {
+        shift++;
+    }
+
+    return shift;
+}
+
+/*
+ * Move one bucket of From into To (which is the array that replaced it), returning how many
+ * entries that took.  Whoever moves the last one retires From.
+ */
+static unsigned lookup_table_migrate_bucket(lookup_table_array_t *From, lookup_table_array_t *To, uint32_t Index)
+{
+    lookup_table_bucket_t *bucket = &From->Buckets[Index];
+    lookup_table_bucket_t *new_bucket;
+    lookup_table_entry_t *entry;
+    unsigned entries = 0;
+    int moved = 0;
+
+    if (__atomic_load_n(&bucket->Moved, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&bucket->Lock);
+    if (!bucket->Moved)
+    {
+        while (!list_is_empty(&bucket->Entries))
+        {
+            entry = container_of(list_head(&bucket->Entries), struct lookup_table_entry, ListEntry);
+            list_remove(&entry->ListEntry);
+
+            new_bucket = &To->Buckets[lookup_table_index(To, entry->Hash)];
+            pthread_mutex_lock(&new_bucket->Lock);
+            list_insert_tail(&new_bucket->Entries, &entry->ListEntry);
+            new_bucket->Length++;
+            pthread_mutex_unlock(&new_bucket->Lock);
+            entries++;
+        }
+        bucket->Length = 0;
+        __atomic_store_n(&bucket->Moved, 1, __ATOMIC_RELEASE);
+        moved = 1;
+    }
+    pthread_mutex_unlock(&bucket->Lock);
+
+    if (moved && ((1U << From->Shift) == __atomic_add_fetch(&From->Migrated, 1, __ATOMIC_ACQ_REL)))
+    {
+        __atomic_store_n(&To->Previous, NULL, __ATOMIC_RELEASE);
+        readmap_epoch_retire(&From->RetireEntry, lookup_table_array_release);
+    }
+
+    return entries;
+}
+
+/*
+ * Returns the (locked) bucket for this hash in the current array, first doing our share of any
+ * resize that is under way.  The caller must be in an epoch critical section.
+ */
+static lookup_table_bucket_t *lookup_table_lock_bucket(lookup_table_t *Table, uint32_t Hash, lookup_table_array_t **Array)
+{
+    lookup_table_array_t *array;
+    lookup_table_array_t *previous;
+    lookup_table_bucket_t *bucket;
+    uint32_t index;
+    unsigned busy;
+
+    while (1)
+    {
+        array = __atomic_load_n(&Table->Current, __ATOMIC_ACQUIRE);
+        previous = __atomic_load_n(&array->Previous, __ATOMIC_ACQUIRE);
+
+        if (NULL != previous)
+        {
+            // ours has to be moved before we can look at the new array, and we help with the rest
+            (void)lookup_table_migrate_bucket(previous, array, lookup_table_index(previous, Hash));
+            busy = 0;
+            for (unsigned step = 0; (step < LOOKUP_TABLE_MIGRATE_EMPTY) && (busy < LOOKUP_TABLE_MIGRATE_STEP); step++)
+            {
+                index = __atomic_fetch_add(&previous->NextToMigrate, 1, __ATOMIC_RELAXED);
+                if (index >= (1U << previous->Shift))
+                {
+                    break;
+                }
+                busy += (0 != lookup_table_migrate_bucket(previous, array, index));
+            }
+        }
+
+        bucket = &array->Buckets[lookup_table_index(array, Hash)];
+        pthread_mutex_lock(&bucket->Lock);
+        if (!bucket->Moved)
+        {
+            *Array = array;
+            return bucket;
+        }
+
+        // the array we looked at has since been replaced
+        pthread_mutex_unlock(&bucket->Lock);
+    }
+}
+
+/*
+ * Start moving the table to a new array of 1 << Shift buckets, unless Array has already been
+ * replaced or is still being filled from its predecessor.  The caller must be in an epoch
+ * critical section.
+ */
+static void lookup_table_resize(lookup_table_t *Table, lookup_table_array_t *Array, unsigned char Shift)
+{
+    lookup_table_array_t *new_array;
+
+    if (0 != pthread_mutex_trylock(&Table->ResizeLock))
+    {
+        // someone else is on it
+        return;
+    }
+
+    while ((Array == __atomic_load_n(&Table->Current, __ATOMIC_ACQUIRE)) && (NULL == __atomic_load_n(&Array->Previous, __ATOMIC_ACQUIRE)) &&
+           (Shift != Array->Shift))
+    {
+        new_array = lookup_table_array_create(Shift);
+        if (NULL == new_array)
+        {
+            // we'll just carry on at this size
+            break;
+        }
+
+        new_array->Previous = Array;
+        __atomic_store_n(&Table->Current, new_array, __ATOMIC_RELEASE);
+        break;
+    }
+
+    pthread_mutex_unlock(&Table->ResizeLock);
+}
+
+lookup_table_t *lookup_table_create(unsigned int SizeHint, const char *Name, lookup_table_hash_t Hash, size_t KeySize)
+{
+    lookup_table_t *table = NULL;
+
+    table = aligned_alloc(__alignof__(lookup_table_t), sizeof(lookup_table_t));
+
+    while (NULL != table)
+    {
+        // the hint is only where we start
+        table->Current = lookup_table_array_create(lookup_table_fit(SizeHint));
+        if (NULL == table->Current)
+        {
+            free(table);
+            table = NULL;
+            break;
+        }
+
+        memset(table->Name, 0, sizeof(table->Name));
+        strncpy((char *)table->Name, Name, sizeof(table->Name) - 1);
+        table->Hash = Hash ? Hash : default_hash;
+        table->KeySize = KeySize;
+        pthread_mutex_init(&table->ResizeLock, NULL);
+        memset(table->Counts, 0, sizeof(table->Counts));
+        break;
+    }
+
+    return table;
+}
+
+/* No other operations may be in progress */
+void lookup_table_destroy(lookup_table_t *Table)
+{
+    lookup_table_array_t *arrays[2];
+    lookup_table_bucket_t *bucket;
+    lookup_table_entry_t *table_entry;
+
+    arrays[0] = Table->Current;
+    arrays[1] = arrays[0]->Previous;
+
+    for (unsigned array = 0; array < 2; array++)
+    {
+        if (NULL == arrays[array])
+        {
+            continue;
+        }
+
+        for (unsigned bucket_index = 0; bucket_index < (1U << arrays[array]->Shift); bucket_index++)
+        {
+            bucket = &arrays[array]->Buckets[bucket_index];
+            while (!list_is_empty(&bucket->Entries))
+            {
+                table_entry = container_of(list_head(&bucket->Entries), struct lookup_table_entry, ListEntry);
+                list_remove(&table_entry->ListEntry);
+                lookup_table_entry_destroy(table_entry, Table->KeySize);
+            }
+        }
+
+        lookup_table_array_destroy(arrays[array]);
+    }
+
+    pthread_mutex_destroy(&Table->ResizeLock);
+    free(Table);
+
+    return;
+}
+
+static struct lookup_table_entry *lookup_table_locked(lookup_table_t *Table, lookup_table_bucket_t *Bucket, void *Key)
+{
+    struct lookup_table_entry *table_entry = NULL;
+    struct list *le;
+
+    list_for_each(&Bucket->Entries, le)
+    {
+        table_entry = container_of(le, struct lookup_table_entry, ListEntry);
+        if (0 == memcmp(Key, table_entry->Key, Table->KeySize))
+        {
+            return table_entry;
+        }
+    }
+
+    return NULL;
+}
+
+int lookup_table_insert(lookup_table_t *Table, void *Key, void *Object)
+{
+    uint32_t hash = Table->Hash(Key, Table->KeySize);
+    lookup_table_entry_t *entry = lookup_table_entry_create(Key, Table->KeySize, hash, Object);
+    int status = ENOMEM;
+    lookup_table_array_t *array;
+    lookup_table_bucket_t *bucket;
+    unsigned length = 0;
+    uint32_t index;
+    int64_t count;
+
+    while (NULL != entry)
+    {
+        readmap_epoch_enter();
+        bucket = lookup_table_lock_bucket(Table, hash, &array);
+        index = lookup_table_index(array, hash);
+
+        if (lookup_table_locked(Table, bucket, Key))
+        {
+            status = EEXIST;
+        }
+        else
+        {
+            list_insert_tail(&bucket->Entries, &entry->ListEntry);
+            length = ++bucket->Length;
+            __atomic_add_fetch(&Table->Counts[index % LOOKUP_TABLE_COUNT_SLOTS].Count, 1, __ATOMIC_RELAXED);
+            status = 0;
+        }
+        pthread_mutex_unlock(&bucket->Lock);
+
+        if (length >= LOOKUP_TABLE_GROW_CHAIN)
+        {
+            count = lookup_table_count(Table);
+            if (count > ((int64_t)LOOKUP_TABLE_GROW_LOAD << array->Shift))
+            {
+                lookup_table_resize(Table, array, lookup_table_fit(count));
+            }
+        }
+        readmap_epoch_exit();
+
+        break;
+    }
+
+    if (0 != status)
+    {
+        if (NULL != entry)
+        {
+            lookup_table_entry_destroy(entry, Table->KeySize);
+            entry = NULL;
+        }
+    }
+
+    return status;
+}
+
+int lookup_table_lookup(lookup_table_t *Table, void *Key, void **Object)
+{
+    uint32_t hash = Table->Hash(Key, Table->KeySize);
+    struct lookup_table_entry *entry;
+    lookup_table_array_t *array;
+    lookup_table_bucket_t *bucket;
+
+    readmap_epoch_enter();
+    bucket = lookup_table_lock_bucket(Table, hash, &array);
+    entry = lookup_table_locked(Table, bucket, Key);
+
+    if (entry)
+    {
+        *Object = entry->Object;
+    }
+    else
+    {
+        *Object = NULL;
+    }
+    pthread_mutex_unlock(&bucket->Lock);
+    readmap_epoch_exit();
+
+    return NULL == entry ? ENODATA : 0;
+}
+
+int lookup_table_remove(lookup_table_t *Table, void *Key)
+{
+    uint32_t hash = Table->Hash(Key, Table->KeySize);
+    struct lookup_table_entry *entry;
+    lookup_table_array_t *array;
+    lookup_table_bucket_t *bucket;
+    unsigned length = 1;
+    int64_t count;
+    int status = ENODATA;
+
+    readmap_epoch_enter();
+    bucket = lookup_table_lock_bucket(Table, hash, &array);
+    entry = lookup_table_locked(Table, bucket, Key);
+
+    if (entry)
+    {
+        list_remove(&entry->ListEntry);
+        length = --bucket->Length;
+        __atomic_sub_fetch(&Table->Counts[lookup_table_index(array, hash) % LOOKUP_TABLE_COUNT_SLOTS].Count, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&bucket->Lock);
+
+    if ((0 == length) && (array->Shift > LOOKUP_TABLE_MIN_SHIFT))
+    {
+        count = lookup_table_count(Table);
+        if (count < ((int64_t)1 << array->Shift) / LOOKUP_TABLE_SHRINK_LOAD)
+        {
+            lookup_table_resize(Table, array, lookup_table_fit(count));
+        }
+    }
+    readmap_epoch_exit();
+
+    if (entry)
+    {
+        lookup_table_entry_destroy(entry, Table->KeySize);
+        status = 0;
+    }
+
+    return status;
+}
+
+unsigned lookup_table_bucket_count(lookup_table_t *Table)
+{
+    unsigned count;
+
+    readmap_epoch_enter();
+    count = 1U << __atomic_load_n(&Table->Current, __ATOMIC_ACQUIRE)->Shift;
+    readmap_epoch_exit();
+
+    return count;
+}
@@ -0,0 +1,23 @@
+/*
+ * (C) Copyright 2017 Tony Mason
+ * All Rights Reserved
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A simple generic hash table, keyed by a fixed size blob.  It is safe for concurrent use and
+ * resizes itself as entries come and go, so SizeHint is only the starting size.
+ */
+typedef uint32_t (*lookup_table_hash_t)(void *key, size_t length);
+typedef struct lookup_table lookup_table_t;
+
+lookup_table_t *lookup_table_create(unsigned int SizeHint, const char *Name, lookup_table_hash_t Hash, size_t KeySize);
+void lookup_table_destroy(lookup_table_t *Table);
+int lookup_table_insert(lookup_table_t *Table, void *Key, void *Object);
+int lookup_table_lookup(lookup_table_t *Table, void *Key, void **Object);
+int lookup_table_remove(lookup_table_t *Table, void *Key);
+unsigned lookup_table_bucket_count(lookup_table_t *Table);
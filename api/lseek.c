@@ -0,0 +1,266 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <pthread.h>
+#include "api-internal.h"
+
+static off_t fin_lseek(int fd, off_t offset, int whence)
+{
+    typedef off_t (*orig_lseek_t)(int fd, off_t offset, int whence);
+    static orig_lseek_t orig_lseek = NULL;
+
+    if (NULL == orig_lseek) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_lseek = (orig_lseek_t)dlsym(RTLD_NEXT, "lseek");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_lseek);
+    if (NULL == orig_lseek) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_lseek(fd, offset, whence);
+}
+
+/*
+ * The file offset.
+ *
+ * To read from the mapping at the file position, the library has to own the position: it asks
+ * the kernel where it is once (readmap_claim_offset) and from then on keeps it in
+ * file_state->offset, so read() and lseek() need no system call at all.  Claiming and releasing
+ * ownership are done under file_state->lock held for write.  While the offset is owned, it only
+ * moves under the shared lock, with compare-and-swap: a read reserves the range it is going to
+ * copy by swinging the offset past it, so concurrent reads on one descriptor each get their own
+ * range, as POSIX wants, without serializing on the lock.
+ *
+ * The kernel's idea of the position is only brought up to date when something else is going to
+ * look at it: a native call on the descriptor, SEEK_DATA/SEEK_HOLE, fcntl (locks are relative to
+ * the position), fork and close.  Once the open file description is shared with another
+ * descriptor in this process (dup) the position can be moved behind our back, so the offset is
+ * released for good (see readmap_share_offset.)  A fork only releases it: the child has it right,
+ * and our next read claims it again.  Usually the child execs or leaves the descriptor alone;
+ * one that moves the position while we are still reading is no different to a process that
+ * inherited the descriptor from us.
+ *
+ * fork() finds us through pthread_atfork(), but posix_spawn() and vfork() don't run the fork
+ * handlers, and system() and popen() use them within the C library.  So posix_spawn(),
+ * posix_spawnp(), system() and popen() are interposed as well (spawn.c), and release the offsets
+ * first.  vfork() can't be: the child borrows the caller's stack, so it can't be called from a
+ * wrapper that then returns.  A program that vforks and execs has to live with the child starting
+ * from wherever the kernel last had the position.
+ */
+static pthread_once_t offset_tracking_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Take ownership of the file offset away from the kernel.  Once we own it, reads served from
+ * the mapping only need to update file_state->offset.  Returns EBUSY if the open file description
+ * is shared.
+ *
+ * Caller must hold file_state->lock for write.
+ */
+int readmap_claim_offset(readmap_file_state_t *file_state)
+{
+    off_t offset;
+
+    if (file_state->offset_owned) {
+        return 0;
+    }
+
+    if (file_state->offset_shared) {
+        return EBUSY;
+    }
+
+    offset = fin_lseek(file_state->fd, 0, SEEK_CUR);
+
+    if (offset < 0) {
+        return errno;
+    }
+
+    file_state->offset       = offset;
+    file_state->offset_owned = 1;
+
+    return 0;
+}
+
+/*
+ * Hand the file offset back to the kernel.  This must be done before anything that relies
+ * upon the kernel's file position (a native read/write, lseek, etc.)
+ *
+ * Caller must hold file_state->lock for write.
+ */
+int readmap_release_offset(readmap_file_state_t *file_state)
+{
+    off_t offset;
+
+    if (!file_state->offset_owned) {
+        return 0;
+    }
+
+    offset = fin_lseek(file_state->fd, file_state->offset, SEEK_SET);
+
+    if (offset < 0) {
+        return errno;
+    }
+
+    file_state->offset_owned = 0;
+
+    return 0;
+}
+
+/*
+ * The open file description is (about to be) shared with another descriptor: hand the offset back
+ * to the kernel, and leave it there.  The other descriptor goes straight to the kernel, so it has
+ * to see where the file really ends as well.
+ *
+ * Caller must hold file_state->lock for write.
+ */
+int readmap_share_offset(readmap_file_state_t *file_state)
+{
+    int status = readmap_release_offset(file_state);
+
+    if (0 == status) {
+        file_state->offset_shared = 1;
+        status                    = readmap_trim_file(file_state);
+    }
+
+    return status;
+}
+
+static int offset_release_visit(readmap_file_state_t *file_state, void *context)
+{
+    (void)context;
+
+    pthread_rwlock_wrlock(&file_state->lock);
+    (void)readmap_release_offset(file_state);
+    pthread_rwlock_unlock(&file_state->lock);
+
+    return 0;
+}
+
+/*
+ * Hand every offset we own back to the kernel, as a new process is about to get all of the open
+ * file descriptions, and must find them where we left them.
+ */
+void readmap_release_offsets(void)
+{
+    readmap_visit_file_states(offset_release_visit, NULL);
+}
+
+static void offset_fork_prepare(void)
+{
+    readmap_release_offsets();
+}
+
+static void offset_tracking_init(void)
+{
+    int status = pthread_atfork(offset_fork_prepare, NULL, NULL);
+
+    assert(0 == status);
+    (void)status;
+}
+
+void readmap_init_offset_tracking(void)
+{
+    // fork handlers can't be removed, so this outlives readmap_shutdown()
+    pthread_once(&offset_tracking_once, offset_tracking_init);
+}
+
+/*
+ * Move the offset we own; returns the new offset, or -1 (with errno set.)  Only SEEK_SET,
+ * SEEK_CUR and SEEK_END are handled here.
+ *
+ * Caller must hold file_state->lock (shared is enough.)
+ */
+static off_t offset_seek(readmap_file_state_t *file_state, off_t offset, int whence, size_t size)
+{
+    off_t current = __atomic_load_n(&file_state->offset, __ATOMIC_RELAXED);
+    off_t base;
+    off_t target;
+
+    while (1) {
+        switch (whence) {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = current;
+            break;
+        default:
+            base = (off_t)size;
+            break;
+        }
+
+        if (__builtin_add_overflow(base, offset, &target)) {
+            errno = EOVERFLOW;
+            return -1;
+        }
+
+        if (target < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if (__atomic_compare_exchange_n(&file_state->offset, &current, target, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return target;
+        }
+    }
+}
+
+off_t readmap_lseek(int fd, off_t offset, int whence)
+{
+    readmap_file_state_t *file_state;
+    size_t                size   = 0;
+    off_t                 result = -1;
+    int                   status = 0;
+
+    file_state = readmap_lookup_file_state(fd);
+    if (NULL != file_state) {
+        if (SEEK_END == whence) {
+            status = readmap_get_size(file_state, &size);
+            if (0 != status) {
+                readmap_release_file_state(file_state);
+                if (ESTALE == status) {
+                    return fin_lseek(fd, offset, whence);
+                }
+                errno = status;
+                return -1;
+            }
+        }
+
+        // the common case: we already own the offset, so this never reaches the kernel
+        pthread_rwlock_rdlock(&file_state->lock);
+        if (file_state->offset_owned && ((SEEK_SET == whence) || (SEEK_CUR == whence) || (SEEK_END == whence))) {
+            result = offset_seek(file_state, offset, whence, size);
+            status = (result < 0) ? errno : 0;
+            pthread_rwlock_unlock(&file_state->lock);
+            readmap_release_file_state(file_state);
+
+            if (0 != status) {
+                errno = status;
+            }
+            return result;
+        }
+        pthread_rwlock_unlock(&file_state->lock);
+
+        pthread_rwlock_wrlock(&file_state->lock);
+        status = readmap_release_offset(file_state);
+        if ((0 == status) && (SEEK_SET != whence) && (SEEK_CUR != whence)) {
+            // the kernel is going to look at the end of the file
+            status = readmap_trim_file(file_state);
+        }
+        pthread_rwlock_unlock(&file_state->lock);
+        readmap_release_file_state(file_state);
+    }
+
+    if (0 != status) {
+        errno = status;
+        return -1;
+    }
+
+    return fin_lseek(fd, offset, whence);
+}
@@ -0,0 +1,468 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "api-internal.h"
+
+static int fin_ftruncate(int fd, off_t length)
+{
+    typedef int (*orig_ftruncate_t)(int fd, off_t length);
+    static orig_ftruncate_t orig_ftruncate = NULL;
+
+    if (NULL == orig_ftruncate) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_ftruncate = (orig_ftruncate_t)dlsym(RTLD_NEXT, "ftruncate");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_ftruncate);
+    if (NULL == orig_ftruncate) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_ftruncate(fd, length);
+}
+
+static int fin_fallocate(int fd, int mode, off_t offset, off_t length)
+{
+    typedef int (*orig_fallocate_t)(int fd, int mode, off_t offset, off_t length);
+    static orig_fallocate_t orig_fallocate = NULL;
+
+    if (NULL == orig_fallocate) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_fallocate = (orig_fallocate_t)dlsym(RTLD_NEXT, "fallocate");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_fallocate);
+    if (NULL == orig_fallocate) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_fallocate(fd, mode, offset, length);
+}
+
+static int fin_fstat(int fd, struct stat *buf)
+{
+    typedef int (*orig_fstat_t)(int fd, struct stat *buf);
+    static orig_fstat_t orig_fstat = NULL;
+
+    if (NULL == orig_fstat) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_fstat = (orig_fstat_t)dlsym(RTLD_NEXT, "fstat");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_fstat);
+    if (NULL == orig_fstat) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_fstat(fd, buf);
+}
+
+/* caller holds file_state->lock for write */
+static void map_attach(readmap_file_state_t *file_state, readmap_mapping_t *mapping)
+{
+    // nobody else can be using our view of the old one, since we hold the lock
+    readmap_unmap_file(file_state);
+
+    file_state->mapping      = mapping;
+    file_state->map_location = readmap_mapping_location(mapping);
+    file_state->map_offset   = readmap_mapping_offset(mapping);
+    file_state->map_length   = readmap_mapping_length(mapping);
+    file_state->mapped       = 1;
+}
+
+/*
+ * Make sure that at least size bytes of the file are mapped.  Mappings are attached lazily on
+ * first access, and replaced by a larger one when the file has been extended since they were
+ * made.  The mappings themselves come from the (per-inode) mapping cache.
+ *
+ * Caller must hold file_state->lock for write.
+ */
+int readmap_map_file(readmap_file_state_t *file_state, size_t size)
+{
+    readmap_mapping_t *mapping;
+    int                prot = PROT_READ;
+
+    if (0 == size) {
+        // can't map an empty file; callers treat this as EOF
+        return 0;
+    }
+
+    if (file_state->mapped && (0 == file_state->map_offset) && ((size_t)readmap_mapping_valid_end(file_state->mapping) >= size)) {
+        return 0;
+    }
+
+    if (O_RDWR == (file_state->flags & O_ACCMODE)) {
+        prot |= PROT_WRITE;
+    }
+
+    mapping = readmap_mapping_get(file_state->fd, file_state->dev, file_state->ino, READMAP_WHOLE_FILE, 0, size, prot);
+
+    if (NULL == mapping) {
+        return errno;
+    }
+
+    map_attach(file_state, mapping);
+
+    return 0;
+}
+
+/*
+ * Make sure that the window containing offset is mapped.  Windows are only used for reading, so
+ * the mapping is read-only.
+ *
+ * Caller must hold file_state->lock for write.
+ */
+static int map_window(readmap_file_state_t *file_state, off_t offset, size_t window_size)
+{
+    readmap_mapping_t *mapping;
+    uint64_t           window = (uint64_t)offset / window_size;
+
+    mapping = readmap_mapping_get(file_state->fd, file_state->dev, file_state->ino, window, window * window_size, window_size,
+                                  PROT_READ);
+
+    if (NULL == mapping) {
+        return errno;
+    }
+
+    map_attach(file_state, mapping);
+
+    return 0;
+}
+
+/*
+ * Make sure that the byte at offset is mapped, for a file that is size bytes long.  Large files
+ * that are only being read are mapped a window at a time; anything else is mapped whole.
+ *
+ * Caller must hold file_state->lock for write.
+ */
+int readmap_map_range(readmap_file_state_t *file_state, off_t offset, size_t size)
+{
+    size_t window_size = 0;
+
+    if (file_state->mapped && (offset >= file_state->map_offset) && (offset < readmap_mapping_valid_end(file_state->mapping))) {
+        return 0;
+    }
+
+    if (O_RDONLY == (file_state->flags & O_ACCMODE)) {
+        window_size = readmap_mapping_window_size(size);
+    }
+
+    if (0 != window_size) {
+        return map_window(file_state, offset, window_size);
+    }
+
+    return readmap_map_file(file_state, size);
+}
+
+/*
+ * Caller must hold file_state->lock for write (or be the last user of the state).
+ */
+void readmap_unmap_file(readmap_file_state_t *file_state)
+{
+    if (!file_state->mapped) {
+        return;
+    }
+
+    readmap_mapping_put(file_state->mapping);
+
+    file_state->mapping      = NULL;
+    file_state->map_location = NULL;
+    file_state->map_offset   = 0;
+    file_state->map_length   = 0;
+    file_state->mapped       = 0;
+}
+
+/*
+ * Grow the file, for every file state on the inode; returns 0 or an errno value.
+ *
+ * Caller must hold file_state->lock and inode->lock for write.
+ */
+static int inode_grow(readmap_file_state_t *file_state, size_t size)
+{
+    readmap_inode_t *inode = file_state->inode;
+    size_t           step;
+    size_t           new_size;
+    int              status;
+
+    step = inode->allocated_size;
+    if (step < READMAP_GROW_MIN) {
+        step = READMAP_GROW_MIN;
+    }
+    if (step > READMAP_GROW_MAX_STEP) {
+        step = READMAP_GROW_MAX_STEP;
+    }
+
+    new_size = inode->allocated_size + step;
+    if (new_size < size) {
+        new_size = size;
+    }
+    new_size = (new_size + READMAP_GROW_MIN - 1) & ~((size_t)READMAP_GROW_MIN - 1);
+
+    status = fin_fallocate(file_state->fd, 0, inode->allocated_size, new_size - inode->allocated_size);
+
+    if ((0 != status) && ((EOPNOTSUPP == errno) || (ENOSYS == errno))) {
+        // not every file system can do this; a sparse extension is good enough
+        status = fin_ftruncate(file_state->fd, new_size);
+    }
+
+    if (0 != status) {
+        return errno;
+    }
+
+    inode->allocated_size = new_size;
+    inode->extended       = 1;
+
+    if (!file_state->extending) {
+        file_state->extending     = 1;
+        file_state->next_extender = inode->extenders;
+        inode->extenders          = file_state;
+    }
+
+    return 0;
+}
+
+/*
+ * Put the logical size of the file back on disk, discarding the space that was added by
+ * inode_grow() but never written.  Anything still mapped beyond the new end is harmless, as
+ * nobody reads beyond the logical size, and writes grow the file again before they store.
+ *
+ * Caller must hold inode->lock for write.
+ */
+static int inode_trim(readmap_inode_t *inode, int fd)
+{
+    size_t size = __atomic_load_n(&inode->size, __ATOMIC_RELAXED);
+
+    if (!inode->extended) {
+        return 0;
+    }
+
+    if (0 != fin_ftruncate(fd, size)) {
+        return errno;
+    }
+
+    inode->allocated_size = size;
+    inode->extended       = 0;
+
+    return 0;
+}
+
+/*
+ * Make sure the file (and the mapping) can hold at least size bytes, growing it if need be.  We
+ * grow well past what was asked for so that a stream of small appending writes only rarely has
+ * to; the logical size is left alone, the caller advances it as data is stored.
+ *
+ * On success this returns with file_state->inode->lock held for read, so the file can't be
+ * trimmed until the caller has stored its data and let go of it.
+ *
+ * Caller must hold file_state->lock for write.
+ */
+int readmap_extend_file(readmap_file_state_t *file_state, size_t size)
+{
+    readmap_inode_t *inode = file_state->inode;
+    int              status;
+
+    while (1) {
+        pthread_rwlock_rdlock(&inode->lock);
+        if (size <= inode->allocated_size) {
+            status = readmap_map_file(file_state, inode->allocated_size);
+            if (0 != status) {
+                pthread_rwlock_unlock(&inode->lock);
+            }
+            return status;
+        }
+        pthread_rwlock_unlock(&inode->lock);
+
+        pthread_rwlock_wrlock(&inode->lock);
+        status = (size <= inode->allocated_size) ? 0 : inode_grow(file_state, size);
+        pthread_rwlock_unlock(&inode->lock);
+
+        if (0 != status) {
+            return status;
+        }
+        // and look again, as it may have been trimmed in the meantime
+    }
+}
+
+/*
+ * Put the real (logical) size of the file back on disk now, because something outside the
+ * library is about to look at the end of it.
+ *
+ * Caller must hold file_state->lock for write.
+ */
+int readmap_trim_file(readmap_file_state_t *file_state)
+{
+    readmap_inode_t *inode = file_state->inode;
+    int              status;
+
+    if (__atomic_load_n(&file_state->dead, __ATOMIC_SEQ_CST)) {
+        // its descriptor may have been closed, and be some other file by now
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&inode->lock);
+    // this descriptor may not be open for writing, but those of the states that grew the file are
+    status = inode_trim(inode, (NULL != inode->extenders) ? inode->extenders->fd : file_state->fd);
+    pthread_rwlock_unlock(&inode->lock);
+
+    return status;
+}
+
+/*
+ * The file state is going away (its descriptor is about to be closed.)  If it is the last of those
+ * that grew the file and trim is set, put the real size back; trim is clear when the descriptor
+ * was closed without our seeing it, so it may now be some other file.
+ *
+ * Caller must hold file_state->lock for write (or be the last user of the state.)
+ */
+int readmap_stop_extending(readmap_file_state_t *file_state, int trim)
+{
+    readmap_inode_t *      inode  = file_state->inode;
+    readmap_file_state_t **link;
+    int                    status = 0;
+
+    if (!file_state->extending) {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&inode->lock);
+    for (link = &inode->extenders; *link != file_state; link = &(*link)->next_extender) {
+        assert(NULL != *link);
+    }
+    *link = file_state->next_extender;
+    file_state->next_extender = NULL;
+    file_state->extending     = 0;
+
+    if (trim && (NULL == inode->extenders)) {
+        status = inode_trim(inode, file_state->fd);
+    }
+    pthread_rwlock_unlock(&inode->lock);
+
+    return status;
+}
+
+/*
+ * ftruncate() on a file we have mapped: the new size becomes ours (and that of every other file
+ * state for it) as well.  If it cuts the file short, every mapping of it is cut short first (see
+ * readmap_mapping_invalidate()), so that a read that is under way doesn't fault.
+ */
+int readmap_ftruncate(int fd, off_t length)
+{
+    readmap_file_state_t *file_state;
+    readmap_inode_t *     inode;
+    size_t                size;
+    int                   status = 0;
+
+    file_state = readmap_lookup_file_state(fd);
+    if ((NULL == file_state) || (length < 0)) {
+        if (NULL != file_state) {
+            readmap_release_file_state(file_state);
+        }
+        return fin_ftruncate(fd, length);
+    }
+
+    inode = file_state->inode;
+    pthread_rwlock_wrlock(&file_state->lock);
+    pthread_rwlock_wrlock(&inode->lock);
+    size = __atomic_load_n(&inode->size, __ATOMIC_RELAXED);
+    if ((size_t)length < inode->allocated_size) {
+        // nothing is read beyond the new end from here on
+        if ((size_t)length < size) {
+            __atomic_store_n(&inode->size, length, __ATOMIC_RELEASE);
+        }
+        readmap_mapping_invalidate(file_state->dev, file_state->ino, length);
+    }
+
+    if (0 == fin_ftruncate(fd, length)) {
+        // the new size is everyone's
+        __atomic_store_n(&inode->size, length, __ATOMIC_RELEASE);
+        inode->allocated_size = length;
+        inode->extended       = 0;
+    }
+    else {
+        status = errno;
+        __atomic_store_n(&inode->size, size, __ATOMIC_RELEASE);
+    }
+    pthread_rwlock_unlock(&inode->lock);
+    pthread_rwlock_unlock(&file_state->lock);
+
+    readmap_release_file_state(file_state);
+
+    if (0 != status) {
+        errno = status;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * fallocate() on a file we have mapped.  The kernel has to see the real end of the file first,
+ * and whatever the call does to the size is then everyone's.  Anything other than plain
+ * allocation can move data about or cut the file short, so the mappings are cut short from offset
+ * first (as for ftruncate().)
+ */
+int readmap_fallocate(int fd, int mode, off_t offset, off_t length)
+{
+    readmap_file_state_t *file_state;
+    readmap_inode_t *     inode;
+    struct stat           st;
+    int                   status;
+
+    file_state = readmap_lookup_file_state(fd);
+    if (NULL == file_state) {
+        return fin_fallocate(fd, mode, offset, length);
+    }
+
+    inode = file_state->inode;
+    pthread_rwlock_wrlock(&file_state->lock);
+    pthread_rwlock_wrlock(&inode->lock);
+    while (1) {
+        // (as readmap_trim_file(), but nobody may grow the file again until we are done)
+        status = inode_trim(inode, (NULL != inode->extenders) ? inode->extenders->fd : fd);
+        if (0 != status) {
+            break;
+        }
+
+        if ((0 != (mode & ~FALLOC_FL_KEEP_SIZE)) && (offset >= 0)) {
+            readmap_mapping_invalidate(file_state->dev, file_state->ino, offset);
+        }
+
+        if (0 != fin_fallocate(fd, mode, offset, length)) {
+            status = errno;
+            break;
+        }
+
+        if (0 == fin_fstat(fd, &st)) {
+            __atomic_store_n(&inode->size, st.st_size, __ATOMIC_RELEASE);
+            inode->allocated_size = st.st_size;
+        }
+        // (and the rest of what fstat() says)
+        __atomic_store_n(&file_state->check_size, 1, __ATOMIC_RELAXED);
+        break;
+    }
+    pthread_rwlock_unlock(&inode->lock);
+    pthread_rwlock_unlock(&file_state->lock);
+
+    readmap_release_file_state(file_state);
+
+    if (0 != status) {
+        errno = status;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,659 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <linux/magic.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/vfs.h>
+#include "api-internal.h"
+#include "list.h"
+#include "lookuptable.h"
+
+#if !defined(container_of)
+#define container_of(ptr, type, member) (type *)((char *)(ptr)-offsetof(type, member))
+#endif  // container_of
+
+/*
+ * The mapping cache keeps one mapping per inode, shared by every file descriptor that refers to
+ * it, so that opening the same file repeatedly doesn't mmap/munmap it each time.
+ *
+ * A mapping object is immutable once created: when someone needs a larger mapping (or a writable
+ * one) a new mapping replaces the old one in the cache, and the old one is unmapped once the
+ * last file state using it lets go.  Thus, a file state only has to protect its own pointer to
+ * the mapping, not the mapping itself.
+ *
+ * Files of at least READMAP_WINDOW_THRESHOLD bytes that are only being read aren't mapped whole;
+ * instead they are mapped in aligned windows of READMAP_WINDOW_SIZE bytes (both can be overridden
+ * by the environment variables of the same names), which are cached just like whole file
+ * mappings.  Each file state holds on to the last window it used; any others are idle, so they
+ * are the first to go when we're over budget.  This lets us serve files far larger than the
+ * address space (or vm.max_map_count) would otherwise allow.
+ *
+ * The limit (READMAP_MAPPING_CACHE_LIMIT, or the environment variable of the same name, in bytes)
+ * is our budget for mapped bytes: once the cached mappings add up to more than this, mappings that
+ * no file state is using are released (in LRU order.)  Mappings that are in use can't be released,
+ * so the budget can be exceeded by however much is actively in use.
+ *
+ * Big files are scanned a lot, so if READMAP_HUGEPAGE is set in the environment, mappings of at
+ * least READMAP_HUGEPAGE_THRESHOLD bytes (or the environment variable of the same name) are set up
+ * to use large pages, cutting down on TLB misses:
+ *   - files on hugetlbfs are always mapped with huge pages; all we have to do is round the length
+ *     up to the file system's page size (the mapping is made with MAP_HUGETLB to say so.)
+ *   - files on tmpfs get madvise(MADV_HUGEPAGE), which the kernel honors if shmem_enabled is
+ *     "advise" (or better.)
+ *   - anything else only gets MADV_HUGEPAGE if READMAP_HUGEPAGE is "always"; this only helps
+ *     read-only mappings on kernels built with CONFIG_READ_ONLY_THP_FOR_FS.
+ * The page size a mapping was set up with is reported by readmap_get_page_size().
+ *
+ * When we cut a file short (ftruncate() or fallocate()), readmap_mapping_invalidate() deals with
+ * every mapping of it, cached or not: see there.
+ *
+ * The cache also keeps the per-inode records (readmap_inode_t) through which the file states for
+ * a file share its size; those live exactly as long as some file state refers to them.
+ */
+
+typedef struct readmap_mapping_key
+{
+    dev_t dev;
+    ino_t ino;
+    uint64_t window;  // READMAP_WHOLE_FILE for a mapping of the whole file
+} readmap_mapping_key_t;
+
+struct readmap_mapping
+{
+    readmap_mapping_key_t key;
+    void *map_location;
+    off_t map_offset;
+    size_t map_length;
+    int prot;
+    int flags;
+    size_t page_size;
+    off_t valid_end;       // the file is mapped up to here (atomic); past it is what was cut off
+    unsigned refcount;     // protected by cache_lock
+    unsigned char cached;  // still in the table
+    struct list lru_entry; // only while unreferenced (and cached)
+    struct list live_entry; // on mapping_live until it is destroyed (cache_lock)
+};
+
+typedef struct readmap_inode_key
+{
+    dev_t dev;
+    ino_t ino;
+} readmap_inode_key_t;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static lookup_table_t *mapping_table;
+static lookup_table_t *inode_table;
+static struct list mapping_lru = {.prv = &mapping_lru, .nxt = &mapping_lru};
+static struct list mapping_live = {.prv = &mapping_live, .nxt = &mapping_live};
+static size_t mapping_bytes;
+static size_t mapping_limit = READMAP_MAPPING_CACHE_LIMIT;
+static int hugepage_mode;  // 0 = off, 1 = hugetlbfs and tmpfs, 2 = everywhere
+static size_t hugepage_threshold = READMAP_HUGEPAGE_THRESHOLD;
+static size_t base_page_size;
+static size_t thp_page_size;
+static size_t window_size = READMAP_WINDOW_SIZE;
+static size_t window_threshold = READMAP_WINDOW_THRESHOLD;
+
+/* the transparent huge page size (usually the PMD size), falling back to 2MB */
+static size_t mapping_thp_size(void)
+{
+    unsigned long size = 0;
+    FILE *        file;
+
+    file = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+    if (NULL != file) {
+        if (1 != fscanf(file, "%lu", &size)) {
+            size = 0;
+        }
+        fclose(file);
+    }
+
+    return size ? size : (2 * 1024 * 1024);
+}
+
+/*
+ * Decide how (and whether) to use large pages for a mapping of map_length bytes of fd.  On return,
+ * *map_length has been rounded up to the page size that will be used, and the return value is
+ * that page size.  *advise is set if the mapping should be madvise()d.
+ */
+static size_t mapping_page_size(int fd, off_t offset, size_t *map_length, int *flags, int *advise)
+{
+    struct statfs sfs;
+
+    *advise = 0;
+
+    if ((0 == hugepage_mode) || (*map_length < hugepage_threshold) || (0 != fstatfs(fd, &sfs))) {
+        return base_page_size;
+    }
+
+    if ((HUGETLBFS_MAGIC == sfs.f_type) && (sfs.f_bsize > 0) && (0 == (offset % sfs.f_bsize))) {
+        *map_length = (*map_length + sfs.f_bsize - 1) & ~((size_t)sfs.f_bsize - 1);
+        *flags |= MAP_HUGETLB;
+        return sfs.f_bsize;
+    }
+
+    if (((TMPFS_MAGIC == sfs.f_type) || (2 == hugepage_mode)) && (0 == (offset % thp_page_size))) {
+        *map_length = (*map_length + thp_page_size - 1) & ~(thp_page_size - 1);
+        *advise     = 1;
+        return thp_page_size;
+    }
+
+    return base_page_size;
+}
+
+static void mapping_destroy(readmap_mapping_t *mapping)
+{
+    int status;
+
+    // once it is off the list readmap_mapping_invalidate() can't touch it
+    pthread_mutex_lock(&cache_lock);
+    list_remove(&mapping->live_entry);
+    pthread_mutex_unlock(&cache_lock);
+
+    status = munmap(mapping->map_location, mapping->map_length);
+    assert(0 == status);
+    (void)status;
+
+    free(mapping);
+}
+
+/* remove the mapping from the table; caller holds cache_lock */
+static void mapping_uncache(readmap_mapping_t *mapping)
+{
+    int status;
+
+    assert(mapping->cached);
+    if (NULL != mapping_table) {
+        status = lookup_table_remove(mapping_table, &mapping->key);
+        assert(0 == status);
+        (void)status;
+    }
+
+    mapping->cached = 0;
+    mapping_bytes -= mapping->map_length;
+}
+
+/*
+ * Evict unused mappings until we're under the limit.  Returns the list of mappings to be destroyed
+ * (after cache_lock is dropped), which is added to victims.  Caller holds cache_lock.
+ */
+static readmap_mapping_t *mapping_trim_cache(readmap_mapping_t *victims)
+{
+    readmap_mapping_t *mapping;
+
+    while ((mapping_bytes > mapping_limit) && !list_is_empty(&mapping_lru)) {
+        mapping = container_of(list_head(&mapping_lru), readmap_mapping_t, lru_entry);
+        list_remove(&mapping->lru_entry);
+        mapping_uncache(mapping);
+
+        // reuse the lru linkage to chain the victims
+        mapping->lru_entry.nxt = victims ? &victims->lru_entry : NULL;
+        victims                = mapping;
+    }
+
+    return victims;
+}
+
+static void mapping_destroy_list(readmap_mapping_t *victims)
+{
+    readmap_mapping_t *mapping;
+
+    while (NULL != victims) {
+        mapping = victims;
+        victims = mapping->lru_entry.nxt ? container_of(mapping->lru_entry.nxt, readmap_mapping_t, lru_entry) : NULL;
+        mapping_destroy(mapping);
+    }
+}
+
+/*
+ * Return a (referenced) mapping of at least size bytes of the file open on fd, starting at offset,
+ * with at least the given protection.  window identifies the mapping: READMAP_WHOLE_FILE (with
+ * an offset of zero) or the window number (see readmap_mapping_window_size.)  Returns NULL (with
+ * errno set) on failure.
+ */
+readmap_mapping_t *readmap_mapping_get(int fd, dev_t dev, ino_t ino, uint64_t window, off_t offset, size_t size, int prot)
+{
+    readmap_mapping_key_t key;
+    readmap_mapping_t *   mapping  = NULL;
+    readmap_mapping_t *   previous = NULL;
+    readmap_mapping_t *   victims  = NULL;
+    void *                map_location;
+    size_t                map_length;
+    size_t                page_size;
+    int                   flags = MAP_SHARED;
+    int                   advise;
+
+    memset(&key, 0, sizeof(key));  // the key is hashed (and compared) as a blob
+    key.dev    = dev;
+    key.ino    = ino;
+    key.window = window;
+
+    pthread_mutex_lock(&cache_lock);
+    if ((NULL != mapping_table) && (0 == lookup_table_lookup(mapping_table, &key, (void **)&previous))) {
+        if ((previous->map_length >= size) && ((previous->prot & prot) == prot)) {
+            if (0 == previous->refcount++) {
+                list_remove(&previous->lru_entry);
+            }
+            pthread_mutex_unlock(&cache_lock);
+            return previous;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    // Nothing suitable, so make a new mapping.  Round up, so a growing file doesn't need a new
+    // mapping for every bit of growth (we never touch anything past the end of the file.)
+    // (the protection can't be widened to cover the previous mapping's, since this fd may not
+    // be open for write.)
+    map_length = (size + READMAP_GROW_MIN - 1) & ~((size_t)READMAP_GROW_MIN - 1);
+    page_size  = mapping_page_size(fd, offset, &map_length, &flags, &advise);
+
+    map_location = mmap(NULL, map_length, prot, flags, fd, offset);
+    if ((MAP_FAILED == map_location) && (flags & MAP_HUGETLB)) {
+        // let the kernel decide
+        flags &= ~MAP_HUGETLB;
+        map_location = mmap(NULL, map_length, prot, flags, fd, offset);
+    }
+    if (MAP_FAILED == map_location) {
+        return NULL;
+    }
+
+    if (advise && (0 != madvise(map_location, map_length, MADV_HUGEPAGE))) {
+        // not supported here; it's only a hint
+        page_size = base_page_size;
+    }
+
+    mapping = malloc(sizeof(readmap_mapping_t));
+    if (NULL == mapping) {
+        munmap(map_location, map_length);
+        errno = ENOMEM;
+        return NULL;
+    }
+    mapping->key          = key;
+    mapping->map_location = map_location;
+    mapping->map_offset   = offset;
+    mapping->map_length   = map_length;
+    mapping->prot         = prot;
+    mapping->flags        = flags;
+    mapping->page_size    = page_size;
+    mapping->valid_end    = offset + map_length;
+    mapping->refcount     = 1;
+    mapping->cached       = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    list_insert_tail(&mapping_live, &mapping->live_entry);
+    while (NULL != mapping_table) {
+        // replace whatever is there now (which may not be what we saw earlier)
+        if (0 == lookup_table_lookup(mapping_table, &key, (void **)&previous)) {
+            mapping_uncache(previous);
+            if (0 == previous->refcount) {
+                list_remove(&previous->lru_entry);
+                previous->lru_entry.nxt = NULL;
+                victims                 = previous;
+            }
+            // otherwise, it goes away when the last user is done with it
+        }
+
+        if (0 == lookup_table_insert(mapping_table, &mapping->key, mapping)) {
+            mapping->cached = 1;
+            mapping_bytes += map_length;
+        }
+
+        // make room for it
+        victims = mapping_trim_cache(victims);
+        break;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    mapping_destroy_list(victims);
+
+    return mapping;
+}
+
+/*
+ * Take another reference to a mapping the caller already holds a reference to.
+ */
+void readmap_mapping_hold(readmap_mapping_t *mapping)
+{
+    pthread_mutex_lock(&cache_lock);
+    assert(mapping->refcount > 0);
+    mapping->refcount++;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Drop a reference to a mapping obtained from readmap_mapping_get().
+ */
+void readmap_mapping_put(readmap_mapping_t *mapping)
+{
+    readmap_mapping_t *victims = NULL;
+    int                destroy = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    assert(mapping->refcount > 0);
+    if (0 == --mapping->refcount) {
+        if (mapping->cached && (NULL == mapping_table)) {
+            // the cache was torn down while this was in use
+            mapping->cached = 0;
+            mapping_bytes -= mapping->map_length;
+        }
+
+        if (mapping->cached) {
+            list_insert_tail(&mapping_lru, &mapping->lru_entry);
+            victims = mapping_trim_cache(NULL);
+        }
+        else {
+            destroy = 1;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (destroy) {
+        mapping_destroy(mapping);
+    }
+    mapping_destroy_list(victims);
+}
+
+/*
+ * The file has been cut short at offset: what its mappings hold beyond that is gone.  They come
+ * out of the cache, so that if the file grows again it gets new ones, and the part of those still
+ * in use that is now past the end of the file (whole pages of it) is replaced with zeros.  Thus a
+ * read already under way, which saw the old size, gets zeros rather than SIGBUS, and nothing is
+ * read through them past valid_end (readmap_mapping_valid_end()) from now on.
+ *
+ * Caller holds the inode's lock for write, so nothing is being written through them.
+ */
+void readmap_mapping_invalidate(dev_t dev, ino_t ino, off_t offset)
+{
+    readmap_mapping_t *mapping;
+    readmap_mapping_t *victims = NULL;
+    struct list *      entry;
+    off_t              start;
+    off_t              end;
+    size_t             align;
+    void *             location;
+
+    pthread_mutex_lock(&cache_lock);
+    for (entry = list_head(&mapping_live); entry != &mapping_live; entry = entry->nxt) {
+        mapping = container_of(entry, readmap_mapping_t, live_entry);
+        if ((mapping->key.dev != dev) || (mapping->key.ino != ino)) {
+            continue;
+        }
+
+        end = mapping->map_offset + mapping->map_length;
+        if (end <= offset) {
+            continue;
+        }
+
+        // the page holding the new end of the file is still good (the rest of it reads as zeros)
+        align = (mapping->flags & MAP_HUGETLB) ? mapping->page_size : base_page_size;
+        start = (offset > mapping->map_offset) ? offset : mapping->map_offset;
+        start = mapping->map_offset + (off_t)((start - mapping->map_offset + align - 1) & ~(align - 1));
+
+        if (start < __atomic_load_n(&mapping->valid_end, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&mapping->valid_end, start, __ATOMIC_RELEASE);
+            if (start < end) {
+                location = mmap((char *)mapping->map_location + (start - mapping->map_offset), end - start, PROT_READ,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+                assert(MAP_FAILED != location);
+                (void)location;
+            }
+        }
+
+        if (mapping->cached) {
+            mapping_uncache(mapping);
+            if (0 == mapping->refcount) {
+                list_remove(&mapping->lru_entry);
+                mapping->lru_entry.nxt = victims ? &victims->lru_entry : NULL;
+                victims                = mapping;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    mapping_destroy_list(victims);
+}
+
+/*
+ * Find (or create) the shared record for an inode, returning it referenced; NULL (with errno set)
+ * if it can't be allocated.
+ */
+readmap_inode_t *readmap_inode_get(dev_t dev, ino_t ino)
+{
+    readmap_inode_key_t key;
+    readmap_inode_t *   inode = NULL;
+
+    memset(&key, 0, sizeof(key));
+    key.dev = dev;
+    key.ino = ino;
+
+    pthread_mutex_lock(&cache_lock);
+    while (1) {
+        if ((NULL != inode_table) && (0 == lookup_table_lookup(inode_table, &key, (void **)&inode))) {
+            inode->refcount++;
+            break;
+        }
+
+        inode = malloc(sizeof(readmap_inode_t));
+        if (NULL == inode) {
+            errno = ENOMEM;
+            break;
+        }
+
+        memset(inode, 0, sizeof(readmap_inode_t));
+        inode->dev      = dev;
+        inode->ino      = ino;
+        inode->refcount = 1;
+        pthread_rwlock_init(&inode->lock, NULL);
+        // if it can't go in the table, this file state just won't share it
+        inode->cached = (NULL != inode_table) && (0 == lookup_table_insert(inode_table, &key, inode));
+        break;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return inode;
+}
+
+/*
+ * Drop a reference obtained from readmap_inode_get().
+ */
+void readmap_inode_put(readmap_inode_t *inode)
+{
+    readmap_inode_key_t key;
+    readmap_inode_t *   found;
+    int                 destroy = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    assert(inode->refcount > 0);
+    if (0 == --inode->refcount) {
+        memset(&key, 0, sizeof(key));
+        key.dev = inode->dev;
+        key.ino = inode->ino;
+        // (the table it went into may have been torn down and replaced since)
+        if (inode->cached && (NULL != inode_table) && (0 == lookup_table_lookup(inode_table, &key, (void **)&found)) &&
+            (found == inode)) {
+            (void)lookup_table_remove(inode_table, &key);
+        }
+        destroy = 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (destroy) {
+        assert(NULL == inode->extenders);
+        pthread_rwlock_destroy(&inode->lock);
+        free(inode);
+    }
+}
+
+void *readmap_mapping_location(readmap_mapping_t *mapping)
+{
+    return mapping->map_location;
+}
+
+off_t readmap_mapping_offset(readmap_mapping_t *mapping)
+{
+    return mapping->map_offset;
+}
+
+size_t readmap_mapping_length(readmap_mapping_t *mapping)
+{
+    return mapping->map_length;
+}
+
+/*
+ * Returns the window size to use for a file of the given size, or zero if it should be mapped
+ * whole.
+ */
+size_t readmap_mapping_window_size(size_t file_size)
+{
+    if ((0 == window_size) || (file_size < window_threshold)) {
+        return 0;
+    }
+
+    return window_size;
+}
+
+size_t readmap_mapping_page_size(readmap_mapping_t *mapping)
+{
+    return mapping->page_size;
+}
+
+/*
+ * The end (as an offset in the file) of what the mapping still maps; less than its offset plus
+ * length if the file was cut short while it was in use.
+ */
+off_t readmap_mapping_valid_end(readmap_mapping_t *mapping)
+{
+    return __atomic_load_n(&mapping->valid_end, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * The total size of the mappings in the cache (in use or idle.)
+ */
+size_t readmap_mapping_bytes(void)
+{
+    size_t bytes;
+
+    pthread_mutex_lock(&cache_lock);
+    bytes = mapping_bytes;
+    pthread_mutex_unlock(&cache_lock);
+
+    return bytes;
+}
+
+long readmap_get_page_size(int fd)
+{
+    readmap_file_state_t *file_state;
+    long                  page_size;
+
+    file_state = readmap_lookup_file_state(fd);
+    if (NULL == file_state) {
+        errno = EBADF;
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&file_state->lock);
+    page_size = file_state->mapped ? (long)readmap_mapping_page_size(file_state->mapping) : (long)base_page_size;
+    pthread_rwlock_unlock(&file_state->lock);
+
+    readmap_release_file_state(file_state);
+
+    return page_size;
+}
+
+int readmap_init_mapping_cache(void)
+{
+    const char *limit     = getenv("READMAP_MAPPING_CACHE_LIMIT");
+    const char *hugepage  = getenv("READMAP_HUGEPAGE");
+    const char *threshold = getenv("READMAP_HUGEPAGE_THRESHOLD");
+    const char *window    = getenv("READMAP_WINDOW_SIZE");
+    const char *wthresh   = getenv("READMAP_WINDOW_THRESHOLD");
+    int         status    = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    while (NULL == mapping_table) {
+        if (NULL != limit) {
+            mapping_limit = strtoull(limit, NULL, 0);
+        }
+
+        base_page_size = sysconf(_SC_PAGESIZE);
+        thp_page_size  = mapping_thp_size();
+        hugepage_mode  = 0;
+        if (NULL != hugepage) {
+            hugepage_mode = (0 == strcmp(hugepage, "always")) ? 2 : (0 != strcmp(hugepage, "0"));
+        }
+        hugepage_threshold = READMAP_HUGEPAGE_THRESHOLD;
+        if (NULL != threshold) {
+            hugepage_threshold = strtoull(threshold, NULL, 0);
+        }
+
+        // windows are a power of two, and at least READMAP_GROW_MIN (zero turns them off)
+        window_size = READMAP_WINDOW_SIZE;
+        if (NULL != window) {
+            window_size = strtoull(window, NULL, 0);
+            if (0 != window_size) {
+                size_t size = READMAP_GROW_MIN;
+
+                while (size < window_size) {
+                    size <<= 1;
+                }
+                window_size = size;
+            }
+        }
+        window_threshold = READMAP_WINDOW_THRESHOLD;
+        if (NULL != wthresh) {
+            window_threshold = strtoull(wthresh, NULL, 0);
+        }
+
+        mapping_table = lookup_table_create(1024, "readmapM", NULL, sizeof(readmap_mapping_key_t));
+        if (NULL == mapping_table) {
+            status = ENOMEM;
+            break;
+        }
+
+        inode_table = lookup_table_create(1024, "readmapI", NULL, sizeof(readmap_inode_key_t));
+        if (NULL == inode_table) {
+            lookup_table_destroy(mapping_table);
+            mapping_table = NULL;
+            status        = ENOMEM;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return status;
+}
+
+/*
+ * Release all the unused mappings.  Any that are still in use are released when their last
+ * user lets go.
+ */
+void readmap_terminate_mapping_cache(void)
+{
+    readmap_mapping_t *victims;
+    lookup_table_t *   table;
+    lookup_table_t *   inodes;
+
+    pthread_mutex_lock(&cache_lock);
+    mapping_limit = 0;
+    victims       = mapping_trim_cache(NULL);
+    mapping_limit = READMAP_MAPPING_CACHE_LIMIT;
+    table         = mapping_table;
+    mapping_table = NULL;
+    // any inode records still referenced are freed by their last readmap_inode_put()
+    inodes        = inode_table;
+    inode_table   = NULL;
+    pthread_mutex_unlock(&cache_lock);
+
+    mapping_destroy_list(victims);
+
+    if (NULL != table) {
+        lookup_table_destroy(table);
+    }
+    if (NULL != inodes) {
+        lookup_table_destroy(inodes);
+    }
+}
@@ -172,19 +172,22 @@ int readmap_close(int fd)
     readmap_file_state_t *file_state = NULL;
     int status = 0;
 
-    status = fin_close(fd);
+    // The state has to go first: putting the real file size back (if we
+    // extended the file) requires the file descriptor.
+    file_state = readmap_lookup_file_state(fd);
 
-    if (0 != status)
+    if (NULL != file_state)
     {
-        // call failed
-        return status;
+        readmap_delete_file_state(file_state);
+        readmap_release_file_state(file_state);
     }
 
-    file_state = readmap_lookup_file_state(fd);
+    status = fin_close(fd);
 
-    if (NULL != file_state)
+    if (0 != status)
     {
-        readmap_delete_file_state(file_state);
+        // call failed
+        return status;
     }
 
     return 0;
@@ -343,11 +346,12 @@ FILE *readmap_fopen(const char *pathname, const char *mode)
     }
 
     // Open + lookup both worked, so we need to track the file descriptor
-    // to uuid mapping.
+    // to uuid mapping.  (Files we can't map, and those opened before we are
+    // initialized, don't get a state: they are left to the kernel.)
     rms = readmap_create_file_state(fileno(file), pathname, flags);
-    assert(NULL != rms); // if it failed, we'd need to release the name map
+    (void)rms;
 
-    return fin_fopen(pathname, mode);
+    return file;
 }
 
 FILE *readmap_fdopen(int fd, const char *mode)
@@ -395,6 +399,7 @@ static FILE *internal_freopen(const char *pathname, const char *mode, FILE *stre
 
     // we have to tear this down
     readmap_delete_file_state(rms);
+    readmap_release_file_state(rms);
     rms = NULL;
 
     // invoke the underlying library implementation
@@ -404,7 +409,7 @@ static FILE *internal_freopen(const char *pathname, const char *mode, FILE *stre
     {
         // create state for this file
         rms = readmap_create_file_state(fileno(file), pathname, flags);
-        assert(NULL != rms); // if it failed, we'd need to release the name map
+        (void)rms; // if it failed, the file is left to the kernel
     }
 
     return file;
@@ -414,3 +419,46 @@ FILE *readmap_freopen(const char *pathname, const char *mode, FILE *stream)
 {
     return internal_freopen(pathname, mode, stream);
 }
+
+static int fin_fclose(FILE *stream)
+{
+    typedef int (*orig_fclose_t)(FILE *stream);
+    static orig_fclose_t orig_fclose = NULL;
+
+    if (NULL == orig_fclose)
+    {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_fclose = (orig_fclose_t)dlsym(RTLD_NEXT, "fclose");
+#pragma GCC diagnostic pop
+
+        assert(NULL != orig_fclose);
+        if (NULL == orig_fclose)
+        {
+            errno = EACCES;
+            return EOF;
+        }
+    }
+
+    return orig_fclose(stream);
+}
+
+int readmap_fclose(FILE *stream)
+{
+    readmap_file_state_t *file_state = NULL;
+
+    // As with close, the state goes first; otherwise it would outlive the file descriptor and
+    // whatever reuses that number would be read through the old file's mapping.
+    if (NULL != stream)
+    {
+        file_state = readmap_lookup_file_state(fileno(stream));
+    }
+
+    if (NULL != file_state)
+    {
+        readmap_delete_file_state(file_state);
+        readmap_release_file_state(file_state);
+    }
+
+    return fin_fclose(stream);
+}
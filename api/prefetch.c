@@ -0,0 +1,280 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <semaphore.h>
+#include <string.h>
+#include "api-internal.h"
+
+/*
+ * Prefetching.
+ *
+ * MADV_WILLNEED gets the data into the page cache, but the first touch of each page still faults
+ * (to map it), and that happens on the thread doing the read.  When READMAP_PREFETCH_THREADS is
+ * set in the environment, a pool of that many threads pre-faults the pages ahead of sequential
+ * readers instead (see access.c), with MADV_POPULATE_READ where the kernel has it, or by touching
+ * each page where it doesn't.
+ *
+ * Work is posted to a bounded lock-free queue (Vyukov's MPMC ring); if it is full the request is
+ * dropped and the caller falls back to a plain hint.  Each request holds a reference to its
+ * mapping, so the mapping can't go away while a worker is faulting it in.
+ */
+
+#if !defined(MADV_POPULATE_READ)
+#define MADV_POPULATE_READ 22
+#endif  // MADV_POPULATE_READ
+
+#define PREFETCH_QUEUE_SIZE 256  // must be a power of 2
+#define PREFETCH_MAX_THREADS 64
+
+typedef struct prefetch_cell
+{
+    uint64_t           sequence;
+    readmap_mapping_t *mapping;
+    size_t             offset;  // within the mapping
+    size_t             length;
+} prefetch_cell_t;
+
+static struct
+{
+    prefetch_cell_t cells[PREFETCH_QUEUE_SIZE];
+    uint64_t        enqueue_position __attribute__((aligned(64)));
+    uint64_t        dequeue_position __attribute__((aligned(64)));
+} prefetch_queue __attribute__((aligned(64)));
+
+static sem_t     prefetch_ready;
+static pthread_t prefetch_threads[PREFETCH_MAX_THREADS];
+static unsigned  prefetch_thread_count;
+static int       prefetch_stop;
+static int       prefetch_populate = 1;  // cleared if the kernel doesn't have MADV_POPULATE_READ
+static size_t    prefetch_page_size;
+
+static int prefetch_enqueue(readmap_mapping_t *mapping, size_t offset, size_t length)
+{
+    prefetch_cell_t *cell;
+    uint64_t         position = __atomic_load_n(&prefetch_queue.enqueue_position, __ATOMIC_RELAXED);
+    uint64_t         sequence;
+    int64_t          difference;
+
+    while (1) {
+        cell       = &prefetch_queue.cells[position & (PREFETCH_QUEUE_SIZE - 1)];
+        sequence   = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        difference = (int64_t)sequence - (int64_t)position;
+
+        if (0 == difference) {
+            if (__atomic_compare_exchange_n(&prefetch_queue.enqueue_position, &position, position + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+            // position was updated
+        }
+        else if (difference < 0) {
+            // full
+            return ENOSPC;
+        }
+        else {
+            position = __atomic_load_n(&prefetch_queue.enqueue_position, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->mapping = mapping;
+    cell->offset  = offset;
+    cell->length  = length;
+    __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static int prefetch_dequeue(readmap_mapping_t **mapping, size_t *offset, size_t *length)
+{
+    prefetch_cell_t *cell;
+    uint64_t         position = __atomic_load_n(&prefetch_queue.dequeue_position, __ATOMIC_RELAXED);
+    uint64_t         sequence;
+    int64_t          difference;
+
+    while (1) {
+        cell       = &prefetch_queue.cells[position & (PREFETCH_QUEUE_SIZE - 1)];
+        sequence   = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        difference = (int64_t)sequence - (int64_t)(position + 1);
+
+        if (0 == difference) {
+            if (__atomic_compare_exchange_n(&prefetch_queue.dequeue_position, &position, position + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (difference < 0) {
+            // empty
+            return ENOENT;
+        }
+        else {
+            position = __atomic_load_n(&prefetch_queue.dequeue_position, __ATOMIC_RELAXED);
+        }
+    }
+
+    *mapping = cell->mapping;
+    *offset  = cell->offset;
+    *length  = cell->length;
+    __atomic_store_n(&cell->sequence, position + PREFETCH_QUEUE_SIZE, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static void prefetch_fault(readmap_mapping_t *mapping, size_t offset, size_t length)
+{
+    volatile const char *location = (const char *)readmap_mapping_location(mapping) + offset;
+
+    if (__atomic_load_n(&prefetch_populate, __ATOMIC_RELAXED)) {
+        if ((0 == madvise((void *)(uintptr_t)location, length, MADV_POPULATE_READ)) || (EINVAL != errno)) {
+            // done (or the file shrank, which isn't our problem)
+            return;
+        }
+        __atomic_store_n(&prefetch_populate, 0, __ATOMIC_RELAXED);
+    }
+
+    // the requests are clipped to the end of the file, so this is safe unless it's truncated
+    for (size_t index = 0; index < length; index += prefetch_page_size) {
+        (void)location[index];
+    }
+}
+
+static void *prefetch_worker(void *arg)
+{
+    readmap_mapping_t *mapping;
+    size_t             offset;
+    size_t             length;
+
+    (void)arg;
+
+    while (1) {
+        while (0 != sem_wait(&prefetch_ready)) {
+            // EINTR
+        }
+
+        // A post doesn't mean the next cell is ready: an enqueue that claimed it first may not have
+        // filled it in yet, while the later one we were woken for has.  So take everything that is
+        // there; whatever isn't yet comes with a post of its own.
+        while (0 == prefetch_dequeue(&mapping, &offset, &length)) {
+            prefetch_fault(mapping, offset, length);
+            readmap_mapping_put(mapping);
+        }
+
+        if (__atomic_load_n(&prefetch_stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Ask for length bytes of the file state's mapping, starting at offset (a file offset, which must
+ * lie within the mapping, as must the whole range), to be faulted in.  Returns zero if the request
+ * was queued, otherwise an error (and the caller might want to give a hint instead.)
+ *
+ * Caller must hold file_state->lock.
+ */
+int readmap_prefetch(readmap_file_state_t *file_state, off_t offset, size_t length)
+{
+    size_t start;
+    size_t end;
+
+    if ((0 == __atomic_load_n(&prefetch_thread_count, __ATOMIC_RELAXED)) || !file_state->mapped) {
+        return ENOTSUP;
+    }
+
+    if (offset < file_state->map_offset) {
+        return EINVAL;
+    }
+
+    start = offset - file_state->map_offset;
+    end   = start + length;
+    start -= start % prefetch_page_size;
+    if (end > file_state->map_length) {
+        return EINVAL;
+    }
+
+    readmap_mapping_hold(file_state->mapping);
+
+    if (0 != prefetch_enqueue(file_state->mapping, start, end - start)) {
+        readmap_mapping_put(file_state->mapping);
+        return ENOSPC;
+    }
+
+    sem_post(&prefetch_ready);
+
+    return 0;
+}
+
+int readmap_init_prefetch(void)
+{
+    const char *threads = getenv("READMAP_PREFETCH_THREADS");
+    unsigned    count   = 0;
+    int         status  = 0;
+
+    prefetch_page_size = sysconf(_SC_PAGESIZE);
+
+    if (NULL != threads) {
+        count = strtoul(threads, NULL, 0);
+    }
+    if (count > PREFETCH_MAX_THREADS) {
+        count = PREFETCH_MAX_THREADS;
+    }
+    if (0 == count) {
+        return 0;
+    }
+
+    for (unsigned index = 0; index < PREFETCH_QUEUE_SIZE; index++) {
+        prefetch_queue.cells[index].sequence = index;
+    }
+    prefetch_queue.enqueue_position = 0;
+    prefetch_queue.dequeue_position = 0;
+    prefetch_stop                   = 0;
+
+    if (0 != sem_init(&prefetch_ready, 0, 0)) {
+        return errno;
+    }
+
+    for (prefetch_thread_count = 0; prefetch_thread_count < count; prefetch_thread_count++) {
+        status = pthread_create(&prefetch_threads[prefetch_thread_count], NULL, prefetch_worker, NULL);
+        if (0 != status) {
+            // run with what we have
+            break;
+        }
+    }
+
+    return prefetch_thread_count ? 0 : status;
+}
+
+/*
+ * Stop the workers, discarding anything that is still queued.
+ */
+void readmap_terminate_prefetch(void)
+{
+    readmap_mapping_t *mapping;
+    size_t             offset;
+    size_t             length;
+    unsigned           count = prefetch_thread_count;
+
+    if (0 == count) {
+        return;
+    }
+
+    __atomic_store_n(&prefetch_thread_count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&prefetch_stop, 1, __ATOMIC_RELEASE);
+
+    for (unsigned index = 0; index < count; index++) {
+        sem_post(&prefetch_ready);
+    }
+
+    for (unsigned index = 0; index < count; index++) {
+        pthread_join(prefetch_threads[index], NULL);
+    }
+
+    while (0 == prefetch_dequeue(&mapping, &offset, &length)) {
+        readmap_mapping_put(mapping);
+    }
+
+    sem_destroy(&prefetch_ready);
+}
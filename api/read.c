@@ -1,14 +1,17 @@
 /*
- * (C) Copyright 2017-2020 Tony Mason
+ * (C) Copyright 2017-2021 Tony Mason
  * All Rights Reserved
  */
 
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
 #include "api-internal.h"
 #include "callstats.h"
 
-static int fin_read(int fd, void *buffer, size_t length)
+static ssize_t fin_read(int fd, void *buffer, size_t length)
 {
-    typedef int (*orig_read_t)(int fd, void *buffer, size_t length);
+    typedef ssize_t (*orig_read_t)(int fd, void *buffer, size_t length);
     static orig_read_t orig_read = NULL;
 
     if (NULL == orig_read) {
@@ -27,12 +30,319 @@ static int fin_read(int fd, void *buffer, size_t length)
     return orig_read(fd, buffer, length);
 }
 
-static int internal_read(int fd, void *buffer, size_t length)
+static ssize_t fin_pread(int fd, void *buffer, size_t length, off_t offset)
 {
-    int status;
+    typedef ssize_t (*orig_pread_t)(int fd, void *buffer, size_t length, off_t offset);
+    static orig_pread_t orig_pread = NULL;
+
+    if (NULL == orig_pread) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_pread = (orig_pread_t)dlsym(RTLD_NEXT, "pread");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_pread);
+    if (NULL == orig_pread) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_pread(fd, buffer, length, offset);
+}
+
+static ssize_t fin_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    typedef ssize_t (*orig_readv_t)(int fd, const struct iovec *iov, int iovcnt);
+    static orig_readv_t orig_readv = NULL;
+
+    if (NULL == orig_readv) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_readv = (orig_readv_t)dlsym(RTLD_NEXT, "readv");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_readv);
+    if (NULL == orig_readv) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_readv(fd, iov, iovcnt);
+}
+
+static ssize_t fin_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    typedef ssize_t (*orig_preadv_t)(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+    static orig_preadv_t orig_preadv = NULL;
+
+    if (NULL == orig_preadv) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_preadv = (orig_preadv_t)dlsym(RTLD_NEXT, "preadv");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_preadv);
+    if (NULL == orig_preadv) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_preadv(fd, iov, iovcnt, offset);
+}
+
+/*
+ * Copy from the mapping into the caller's buffers, picking up done bytes into the request (which
+ * starts at offset), and stopping at the end of the mapping or the end of the file (size.)
+ * Returns the number of bytes of the request that have now been done.
+ *
+ * Caller must hold file_state->lock.
+ */
+size_t readmap_copy_from_map(readmap_file_state_t *file_state, const struct iovec *iov, int iovcnt, off_t offset, size_t size, size_t done)
+{
+    size_t position = offset + done;
+    size_t skip     = done;
+    size_t end;
+    size_t length;
+
+    if (!file_state->mapped || (position < (size_t)file_state->map_offset)) {
+        return done;
+    }
+
+    // (short of the end of the mapping if the file was cut short under it; see mapcache.c)
+    end = readmap_mapping_valid_end(file_state->mapping);
+    if (end > size) {
+        end = size;
+    }
+
+    for (int index = 0; (index < iovcnt) && (position < end); index++) {
+        length = iov[index].iov_len;
+
+        if (skip >= length) {
+            skip -= length;
+            continue;
+        }
+        length -= skip;
+
+        if (length > end - position) {
+            length = end - position;
+        }
+
+        readmap_copy((char *)iov[index].iov_base + skip, (char *)file_state->map_location + (position - file_state->map_offset), length);
+        position += length;
+        done += length;
+        skip = 0;
+    }
+
+    return done;
+}
+
+/*
+ * Read at the file position, which we already own, from the mapping as it stands.  The range is
+ * reserved by moving the offset past it before copying, so concurrent reads each get their own.
+ * Returns -1 if the read needs the exclusive lock (we don't own the offset, or the range isn't
+ * all mapped.)
+ *
+ * Caller must hold file_state->lock (shared is enough.)
+ */
+static ssize_t reserved_read(readmap_file_state_t *file_state, const struct iovec *iov, int iovcnt, size_t wanted, size_t size)
+{
+    off_t  offset;
+    size_t end;
+    size_t done;
+
+    if (!file_state->offset_owned || !file_state->mapped) {
+        return -1;
+    }
+
+    offset = __atomic_load_n(&file_state->offset, __ATOMIC_RELAXED);
+    do {
+        if ((size_t)offset >= size) {
+            return 0;
+        }
+
+        end = (wanted > size - offset) ? size : offset + wanted;
+        if ((offset < file_state->map_offset) || (end > (size_t)readmap_mapping_valid_end(file_state->mapping))) {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&file_state->offset, &offset, (off_t)end, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    done = readmap_copy_from_map(file_state, iov, iovcnt, offset, size, 0);
+    readmap_access_note(file_state, offset, done, size);
+
+    return done;
+}
+
+/*
+ * Serve the read from the mapping.  If positional is set, the read is at offset and the file
+ * position is neither used nor changed; otherwise, the read is at (and advances) the file
+ * position.  A read may span several windows of a large file, in which case it is done a window
+ * at a time.
+ *
+ * Returns -1 (without setting errno) if this request can't be handled here and needs to go
+ * to the native call.
+ */
+static ssize_t mapped_readv(readmap_file_state_t *file_state, const struct iovec *iov, int iovcnt, off_t offset, int positional)
+{
+    size_t  size;
+    size_t  wanted = 0;
+    size_t  done   = 0;
+    size_t  progress;
+    ssize_t result = -1;
+
+    if (O_WRONLY == (file_state->flags & O_ACCMODE)) {
+        // let the kernel return the error
+        return -1;
+    }
+
+    for (int index = 0; index < iovcnt; index++) {
+        if (iov[index].iov_len > SSIZE_MAX - wanted) {
+            // let the kernel return the error
+            return -1;
+        }
+        wanted += iov[index].iov_len;
+    }
+
+    if (0 != readmap_get_size(file_state, &size)) {
+        // let the kernel return the error
+        return -1;
+    }
+
+    if (positional) {
+        // The common case: the file position isn't involved and the mapping is already in place,
+        // so a shared lock is enough.
+        if ((size_t)offset >= size) {
+            return 0;
+        }
+
+        if (wanted > size - offset) {
+            wanted = size - offset;
+        }
+
+        readmap_stats_rdlock(file_state);
+        done = readmap_copy_from_map(file_state, iov, iovcnt, offset, size, 0);
+        if (done == wanted) {
+            readmap_access_note(file_state, offset, done, size);
+        }
+        pthread_rwlock_unlock(&file_state->lock);
+
+        if (done == wanted) {
+            return done;
+        }
+    } else {
+        // Once we own the file position, reads at it need no more than the shared lock either.
+        readmap_stats_rdlock(file_state);
+        result = reserved_read(file_state, iov, iovcnt, wanted, size);
+        pthread_rwlock_unlock(&file_state->lock);
+
+        if (result >= 0) {
+            return result;
+        }
+    }
+
+    readmap_stats_wrlock(file_state);
+    while (1) {
+        if (!positional) {
+            if (0 != readmap_claim_offset(file_state)) {
+                break;
+            }
+            offset = file_state->offset;
+        }
+
+        while ((done < wanted) && ((size_t)offset + done < size)) {
+            if (0 != readmap_map_range(file_state, offset + done, size)) {
+                break;
+            }
+
+            progress = readmap_copy_from_map(file_state, iov, iovcnt, offset, size, done);
+            if (progress == done) {
+                break;
+            }
+            done = progress;
+        }
+
+        if ((done < wanted) && ((size_t)offset + done < size) && (0 == done)) {
+            // couldn't map anything
+            if (!positional) {
+                (void)readmap_release_offset(file_state);
+            }
+            break;
+        }
+
+        readmap_access_note(file_state, offset, done, size);
+
+        if (!positional) {
+            file_state->offset += done;
+        }
+        result = done;
+        break;
+    }
+    pthread_rwlock_unlock(&file_state->lock);
+
+    return result;
+}
+
+/*
+ * Try to satisfy the read from the mapping.  Returns non-zero if the request was handled (the
+ * outcome is in *result, with errno set if that is -1), or zero if the native call should be
+ * used.
+ */
+static int try_mapped_read(int fd, const struct iovec *iov, int iovcnt, off_t offset, int positional, ssize_t *result)
+{
+    readmap_file_state_t *file_state;
+    int                   handled = 0;
+    int                   status;
+
+    file_state = readmap_lookup_file_state(fd);
+
+    while (NULL != file_state) {
+        if ((iovcnt >= 0) && (iovcnt <= IOV_MAX) && (!positional || (offset >= 0))) {
+            *result = mapped_readv(file_state, iov, iovcnt, offset, positional);
+            if (*result >= 0) {
+                readmap_stats_served(file_state, *result);
+                handled = 1;
+                break;
+            }
+        }
+
+        // the kernel needs to know where the file ends, and (unless this is positional) where we are
+        readmap_stats_wrlock(file_state);
+        status = positional ? 0 : readmap_release_offset(file_state);
+        if (0 == status) {
+            status = readmap_trim_file(file_state);
+        }
+        pthread_rwlock_unlock(&file_state->lock);
+
+        if (0 != status) {
+            errno   = status;
+            *result = -1;
+            handled = 1;
+        }
+        break;
+    }
+
+    if (NULL != file_state) {
+        readmap_release_file_state(file_state);
+    }
+
+    return handled;
+}
+
+static ssize_t internal_read(int fd, void *buffer, size_t length)
+{
+    struct iovec iov = {.iov_base = buffer, .iov_len = length};
+    ssize_t      status;
 
     DECLARE_TIME(FINESSE_API_CALL_READ)
 
+    START_TIME
+    if (try_mapped_read(fd, &iov, 1, 0, 0, &status)) {
+        STOP_MAPPED_TIME;
+        return status;
+    }
+
     START_TIME
     status = fin_read(fd, buffer, length);
     STOP_NATIVE_TIME;
@@ -40,12 +350,99 @@ static int internal_read(int fd, void *buffer, size_t length)
     return status;
 }
 
+ssize_t readmap_read(int fd, void *buffer, size_t length)
+{
+    ssize_t status = internal_read(fd, buffer, length);
+
+    FinesseApiCountCall(FINESSE_API_CALL_READ, !(status < 0));  // number of bytes, -1 on error
+    return status;
+}
+
 int finesse_read(int fd, void *buffer, size_t length);
 
 int finesse_read(int fd, void *buffer, size_t length)
 {
-    int status = internal_read(fd, buffer, length);
+    return readmap_read(fd, buffer, length);
+}
 
-    FinesseApiCountCall(FINESSE_API_CALL_READ, !(status < 0));  // number of bytes, -1 on error
+static ssize_t internal_pread(int fd, void *buffer, size_t length, off_t offset)
+{
+    struct iovec iov = {.iov_base = buffer, .iov_len = length};
+    ssize_t      status;
+
+    DECLARE_TIME(FINESSE_API_CALL_PREAD)
+
+    START_TIME
+    if (try_mapped_read(fd, &iov, 1, offset, 1, &status)) {
+        STOP_MAPPED_TIME;
+        return status;
+    }
+
+    START_TIME
+    status = fin_pread(fd, buffer, length, offset);
+    STOP_NATIVE_TIME;
+
+    return status;
+}
+
+ssize_t readmap_pread(int fd, void *buffer, size_t length, off_t offset)
+{
+    ssize_t status = internal_pread(fd, buffer, length, offset);
+
+    FinesseApiCountCall(FINESSE_API_CALL_PREAD, !(status < 0));
+    return status;
+}
+
+static ssize_t internal_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t status;
+
+    DECLARE_TIME(FINESSE_API_CALL_READV)
+
+    START_TIME
+    if (try_mapped_read(fd, iov, iovcnt, 0, 0, &status)) {
+        STOP_MAPPED_TIME;
+        return status;
+    }
+
+    START_TIME
+    status = fin_readv(fd, iov, iovcnt);
+    STOP_NATIVE_TIME;
+
+    return status;
+}
+
+ssize_t readmap_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t status = internal_readv(fd, iov, iovcnt);
+
+    FinesseApiCountCall(FINESSE_API_CALL_READV, !(status < 0));
+    return status;
+}
+
+static ssize_t internal_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    ssize_t status;
+
+    DECLARE_TIME(FINESSE_API_CALL_PREADV)
+
+    START_TIME
+    if (try_mapped_read(fd, iov, iovcnt, offset, 1, &status)) {
+        STOP_MAPPED_TIME;
+        return status;
+    }
+
+    START_TIME
+    status = fin_preadv(fd, iov, iovcnt, offset);
+    STOP_NATIVE_TIME;
+
+    return status;
+}
+
+ssize_t readmap_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    ssize_t status = internal_preadv(fd, iov, iovcnt, offset);
+
+    FinesseApiCountCall(FINESSE_API_CALL_PREADV, !(status < 0));
     return status;
 }
@@ -0,0 +1,250 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "api-internal.h"
+#include "callstats.h"
+#include "readmapshm.h"
+
+/*
+ * Publishing statistics in shared memory.
+ *
+ * Statistics collected inside a preloaded process are hard to get at without the application's
+ * help, so when READMAP_STATS_SHM is set (to anything other than 0) in the environment, a thread
+ * copies them (along with the process' page fault counts, the size of the mapping cache and a
+ * list of the files we're tracking) into a shared memory segment every
+ * READMAP_STATS_SHM_INTERVAL_MS milliseconds, for tools like readmap-top to read.  Setting it
+ * turns on statistics collection.  The layout (and the seqlock protocol readers use) is in
+ * readmapshm.h.
+ */
+
+_Static_assert(READMAP_SHM_CALLS == READMAP_CALL_COUNT, "readmapshm.h is out of date");
+_Static_assert(READMAP_SHM_PATHS == READMAP_PATH_COUNT, "readmapshm.h is out of date");
+
+#define SHM_BODY offsetof(readmap_shm_stats_t, updated_ns)  // what the sequence protects
+
+static readmap_shm_stats_t *shm_segment;
+static readmap_shm_stats_t *shm_snapshot;  // built here, then copied in
+static readmap_stats_t *    shm_stats;
+static char                shm_name[32];
+static uint64_t            shm_interval = READMAP_STATS_SHM_INTERVAL;
+static pthread_t           shm_thread;
+static pthread_mutex_t     shm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t      shm_wakeup;
+static int                 shm_stop;
+
+static int shm_visit_file(readmap_file_state_t *file_state, void *context)
+{
+    readmap_shm_stats_t *snapshot = (readmap_shm_stats_t *)context;
+    readmap_shm_file_t * file;
+
+    if (snapshot->file_count == READMAP_SHM_FILES) {
+        snapshot->files_omitted++;
+        return 0;
+    }
+
+    file                 = &snapshot->files[snapshot->file_count++];
+    file->fd             = file_state->fd;
+    file->access_pattern = __atomic_load_n(&file_state->access.pattern, __ATOMIC_RELAXED);
+    file->dev            = file_state->dev;
+    file->ino            = file_state->ino;
+    file->served_calls   = __atomic_load_n(&file_state->served_calls, __ATOMIC_RELAXED);
+    file->served_bytes   = __atomic_load_n(&file_state->served_bytes, __ATOMIC_RELAXED);
+
+    pthread_rwlock_rdlock(&file_state->lock);
+    file->size         = __atomic_load_n(&file_state->inode->size, __ATOMIC_RELAXED);
+    file->mapped_bytes = file_state->mapped ? file_state->map_length : 0;
+    pthread_rwlock_unlock(&file_state->lock);
+
+    return 0;
+}
+
+static void shm_publish(void)
+{
+    readmap_shm_stats_t * snapshot = shm_snapshot;
+    readmap_call_stats_t *from;
+    readmap_shm_call_t *  to;
+    struct rusage         usage;
+    struct timespec       now;
+    uint64_t              sequence;
+
+    // gather everything first, so that readers only have to wait for the copy
+    memset(snapshot, 0, sizeof(readmap_shm_stats_t));
+    (void)readmap_get_stats(shm_stats);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    snapshot->updated_ns   = ((uint64_t)now.tv_sec * 1000 * 1000 * 1000) + now.tv_nsec;
+    snapshot->interval_ns  = shm_interval;
+    snapshot->bytes_mapped = readmap_mapping_bytes();
+    snapshot->lock_waits   = shm_stats->lock_waits;
+    snapshot->lock_wait_ns = shm_stats->lock_wait_ns;
+    if (0 == getrusage(RUSAGE_SELF, &usage)) {
+        snapshot->minor_faults = usage.ru_minflt;
+        snapshot->major_faults = usage.ru_majflt;
+    }
+
+    for (unsigned call = 0; call < READMAP_CALL_COUNT; call++) {
+        from = &shm_stats->calls[call];
+        to   = &snapshot->calls[call];
+
+        to->calls    = from->calls;
+        to->failures = from->failures;
+        for (unsigned path = 0; path < READMAP_PATH_COUNT; path++) {
+            to->count[path]    = from->count[path];
+            to->total_ns[path] = from->total_ns[path];
+            to->max_ns[path]   = from->max_ns[path];
+            to->p50_ns[path]   = readmap_stats_percentile(from->histogram[path], 50);
+            to->p99_ns[path]   = readmap_stats_percentile(from->histogram[path], 99);
+        }
+    }
+
+    readmap_visit_file_states(shm_visit_file, snapshot);
+
+    sequence = shm_segment->sequence;
+    __atomic_store_n(&shm_segment->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *)shm_segment + SHM_BODY, (char *)snapshot + SHM_BODY, sizeof(readmap_shm_stats_t) - SHM_BODY);
+    __atomic_store_n(&shm_segment->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+static void *shm_publisher(void *arg)
+{
+    struct timespec deadline;
+    uint64_t        next;
+
+    (void)arg;
+
+    pthread_mutex_lock(&shm_lock);
+    while (!shm_stop) {
+        pthread_mutex_unlock(&shm_lock);
+        shm_publish();
+        pthread_mutex_lock(&shm_lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        next             = ((uint64_t)deadline.tv_sec * 1000 * 1000 * 1000) + deadline.tv_nsec + shm_interval;
+        deadline.tv_sec  = next / (1000 * 1000 * 1000);
+        deadline.tv_nsec = next % (1000 * 1000 * 1000);
+        while (!shm_stop && (ETIMEDOUT != pthread_cond_timedwait(&shm_wakeup, &shm_lock, &deadline))) {
+            // woken early
+        }
+    }
+    pthread_mutex_unlock(&shm_lock);
+
+    return NULL;
+}
+
+int readmap_init_shm_stats(void)
+{
+    const char *       enabled  = getenv("READMAP_STATS_SHM");
+    const char *       interval = getenv("READMAP_STATS_SHM_INTERVAL_MS");
+    pthread_condattr_t attributes;
+    int                fd     = -1;
+    int                status = 0;
+
+    if ((NULL == enabled) || (0 == strtoul(enabled, NULL, 0)) || (NULL != shm_segment)) {
+        return 0;
+    }
+
+    shm_interval = READMAP_STATS_SHM_INTERVAL;
+    if ((NULL != interval) && (0 != strtoull(interval, NULL, 0))) {
+        shm_interval = strtoull(interval, NULL, 0) * 1000 * 1000;
+    }
+
+    // there's nothing to publish unless we collect it
+    __atomic_store_n(&readmap_stats_enabled, 1, __ATOMIC_RELAXED);
+
+    while (1) {
+        shm_snapshot = malloc(sizeof(readmap_shm_stats_t));
+        shm_stats    = malloc(sizeof(readmap_stats_t));
+        if ((NULL == shm_snapshot) || (NULL == shm_stats)) {
+            status = ENOMEM;
+            break;
+        }
+
+        snprintf(shm_name, sizeof(shm_name), "%s%d", READMAP_SHM_PREFIX, (int)getpid());
+        fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            status = errno;
+            break;
+        }
+
+        if (0 != ftruncate(fd, sizeof(readmap_shm_stats_t))) {
+            status = errno;
+            break;
+        }
+
+        shm_segment = mmap(NULL, sizeof(readmap_shm_stats_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (MAP_FAILED == shm_segment) {
+            shm_segment = NULL;
+            status      = errno;
+            break;
+        }
+
+        shm_segment->magic   = READMAP_SHM_MAGIC;
+        shm_segment->version = READMAP_SHM_VERSION;
+        shm_segment->size    = sizeof(readmap_shm_stats_t);
+        shm_segment->pid     = getpid();
+
+        pthread_condattr_init(&attributes);
+        pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+        pthread_cond_init(&shm_wakeup, &attributes);
+        pthread_condattr_destroy(&attributes);
+
+        shm_stop = 0;
+        status   = pthread_create(&shm_thread, NULL, shm_publisher, NULL);
+        if (0 != status) {
+            pthread_cond_destroy(&shm_wakeup);
+        }
+        break;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (0 != status) {
+        if (NULL != shm_segment) {
+            munmap(shm_segment, sizeof(readmap_shm_stats_t));
+            shm_segment = NULL;
+        }
+        if ('\0' != shm_name[0]) {
+            shm_unlink(shm_name);
+            shm_name[0] = '\0';
+        }
+        free(shm_snapshot);
+        free(shm_stats);
+        shm_snapshot = NULL;
+        shm_stats    = NULL;
+    }
+
+    return status;
+}
+
+void readmap_terminate_shm_stats(void)
+{
+    if (NULL == shm_segment) {
+        return;
+    }
+
+    pthread_mutex_lock(&shm_lock);
+    shm_stop = 1;
+    pthread_cond_signal(&shm_wakeup);
+    pthread_mutex_unlock(&shm_lock);
+    pthread_join(shm_thread, NULL);
+    pthread_cond_destroy(&shm_wakeup);
+
+    munmap(shm_segment, sizeof(readmap_shm_stats_t));
+    shm_unlink(shm_name);
+    shm_segment = NULL;
+    shm_name[0] = '\0';
+    free(shm_snapshot);
+    free(shm_stats);
+    shm_snapshot = NULL;
+    shm_stats    = NULL;
+}
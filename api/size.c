@@ -0,0 +1,450 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include "api-internal.h"
+#include "lookuptable.h"
+
+/*
+ * Size tracking.
+ *
+ * Every read needs the size of the file (to find end of file), so this has to be cheap.  Writes
+ * made through the library update the cached size directly; what we need to catch are changes
+ * made by someone else (another process, or a native call we didn't see.)
+ *
+ * By default the size is revalidated (with fstat) once the file's revalidation interval has
+ * passed; the interval can be set per file (readmap_set_size_interval) and the default comes from
+ * READMAP_SIZE_INTERVAL_MS.  Time is taken from CLOCK_MONOTONIC_COARSE, which is serviced by the
+ * vDSO, so checking the deadline costs no system call.
+ *
+ * If READMAP_SIZE_WATCH is set in the environment, a background thread watches the open files
+ * with inotify instead.  Each watch counts the change events for its inode; a file state only
+ * revalidates when that count has moved, so the read path never has to stat.  Anything we can't
+ * watch falls back to the interval.
+ *
+ * fstat() is answered from the same revalidation (readmap_fstat), with our own idea of the size,
+ * so callers that stat the file for every record don't pay for a system call either.
+ */
+
+struct readmap_size_watch
+{
+    int      wd;         // -1 once the kernel has dropped the watch
+    unsigned refcount;   // protected by watch_lock
+    uint64_t changes;    // bumped (atomically) for each change event
+};
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static lookup_table_t *watch_table;
+static int             watch_fd     = -1;
+static int             watch_stopfd = -1;
+static pthread_t       watch_thread;
+static int             watching;
+static uint64_t        default_interval = READMAP_SIZE_INTERVAL_DEFAULT;
+
+static int fin_fstat(int fd, struct stat *buf)
+{
+    typedef int (*orig_fstat_t)(int fd, struct stat *buf);
+    static orig_fstat_t orig_fstat = NULL;
+
+    if (NULL == orig_fstat) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_fstat = (orig_fstat_t)dlsym(RTLD_NEXT, "fstat");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_fstat);
+    if (NULL == orig_fstat) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_fstat(fd, buf);
+}
+
+static inline uint64_t size_clock_now(void)
+{
+    struct timespec now;
+    int             status;
+
+    status = clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    assert(0 == status);
+    (void)status;
+
+    return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+static void *size_watch_thread(void *arg)
+{
+    char                        buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    struct pollfd               fds[2];
+    readmap_size_watch_t *      watch;
+    ssize_t                     length;
+    int                         wd;
+
+    (void)arg;
+
+    fds[0].fd     = watch_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd     = watch_stopfd;
+    fds[1].events = POLLIN;
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            break;
+        }
+
+        if (fds[1].revents) {
+            // shutdown
+            break;
+        }
+
+        length = read(watch_fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&watch_lock);
+        for (char *next = buffer; next < buffer + length; next += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)next;
+            wd    = event->wd;
+            watch = NULL;
+
+            if ((NULL == watch_table) || (0 != lookup_table_lookup(watch_table, &wd, (void **)&watch))) {
+                continue;
+            }
+
+            if (event->mask & IN_IGNORED) {
+                // the file is gone (or the watch was removed); users go back to polling
+                (void)lookup_table_remove(watch_table, &wd);
+                __atomic_store_n(&watch->wd, -1, __ATOMIC_RELEASE);
+            }
+            __atomic_add_fetch(&watch->changes, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&watch_lock);
+    }
+
+    return NULL;
+}
+
+/* get a (referenced) watch on the file open on fd, or NULL if we aren't watching */
+static readmap_size_watch_t *size_watch_get(int fd)
+{
+    readmap_size_watch_t *watch = NULL;
+    char                  path[64];
+    int                   wd;
+
+    pthread_mutex_lock(&watch_lock);
+    while (NULL != watch_table) {
+        // inotify wants a name; this one refers to the open file, whatever it is called now
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        wd = inotify_add_watch(watch_fd, path, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE);
+        if (wd < 0) {
+            break;
+        }
+
+        // the kernel hands back the same descriptor for every watch on an inode
+        if (0 == lookup_table_lookup(watch_table, &wd, (void **)&watch)) {
+            watch->refcount++;
+            break;
+        }
+
+        watch = malloc(sizeof(readmap_size_watch_t));
+        if (NULL == watch) {
+            break;
+        }
+        watch->wd       = wd;
+        watch->refcount = 1;
+        watch->changes  = 0;
+
+        if (0 != lookup_table_insert(watch_table, &watch->wd, watch)) {
+            free(watch);
+            watch = NULL;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&watch_lock);
+
+    return watch;
+}
+
+static void size_watch_put(readmap_size_watch_t *watch)
+{
+    int wd;
+
+    pthread_mutex_lock(&watch_lock);
+    assert(watch->refcount > 0);
+    if (0 == --watch->refcount) {
+        wd = __atomic_load_n(&watch->wd, __ATOMIC_ACQUIRE);
+        if ((wd >= 0) && (NULL != watch_table)) {
+            (void)lookup_table_remove(watch_table, &wd);
+            (void)inotify_rm_watch(watch_fd, wd);
+        }
+        free(watch);
+    }
+    pthread_mutex_unlock(&watch_lock);
+}
+
+static inline int size_is_stale(readmap_file_state_t *file_state)
+{
+    readmap_size_watch_t *watch = file_state->size_watch;
+
+    if (__atomic_load_n(&file_state->check_size, __ATOMIC_RELAXED)) {
+        return 1;
+    }
+
+    if ((NULL != watch) && __atomic_load_n(&watching, __ATOMIC_RELAXED) && (__atomic_load_n(&watch->wd, __ATOMIC_ACQUIRE) >= 0)) {
+        return __atomic_load_n(&watch->changes, __ATOMIC_ACQUIRE) != __atomic_load_n(&file_state->size_changes, __ATOMIC_RELAXED);
+    }
+
+    return size_clock_now() >= __atomic_load_n(&file_state->size_deadline, __ATOMIC_RELAXED);
+}
+
+/*
+ * Refresh the cached size from the file system.
+ *
+ * Caller must hold file_state->lock for write.
+ */
+static int size_revalidate(readmap_file_state_t *file_state)
+{
+    readmap_inode_t *inode = file_state->inode;
+    struct stat      st;
+    int              status;
+
+    assert(S_ISREG(file_state->mode));  // shouldn't be handling anything but files
+
+    // note what we have seen before we look, so a change that races with the fstat isn't lost
+    __atomic_store_n(&file_state->check_size, 0, __ATOMIC_RELAXED);
+    if (NULL != file_state->size_watch) {
+        __atomic_store_n(&file_state->size_changes, __atomic_load_n(&file_state->size_watch->changes, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELAXED);
+    }
+
+    status = fin_fstat(file_state->fd, &st);
+    if (0 != status) {
+        // keep what we knew, and look again next time
+        status = errno;
+        __atomic_store_n(&file_state->check_size, 1, __ATOMIC_RELAXED);
+        return status;
+    }
+
+    if ((st.st_dev != file_state->dev) || (st.st_ino != file_state->ino)) {
+        // The descriptor was closed behind our back (by something we don't interpose) and its
+        // number reused for another file: this state (its offset, the padding it added) must not
+        // be applied to that one.
+        file_state->offset_owned = 0;
+        (void)readmap_stop_extending(file_state, 0);
+        (void)readmap_forget_file_state(file_state);
+        return ESTALE;
+    }
+    file_state->last_stat = st;
+
+    pthread_rwlock_wrlock(&inode->lock);
+    if (!inode->extended || ((size_t)st.st_size > inode->allocated_size)) {
+        // while we have padded the file out, our size is the authoritative one
+        __atomic_store_n(&inode->size, st.st_size, __ATOMIC_RELEASE);
+        inode->allocated_size = st.st_size;
+        inode->extended       = 0;
+    }
+    pthread_rwlock_unlock(&inode->lock);
+
+    __atomic_store_n(&file_state->size_deadline, size_clock_now() + file_state->size_interval, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+ * The logical size of the file, which is shared by all its file states (so a write through one
+ * descriptor is seen through the others at once.)  If it is due to be checked and that fails,
+ * *size is the last size we knew and the error is returned; ESTALE means the file descriptor now
+ * refers to some other file, and the state has been dropped.
+ */
+int readmap_get_size(readmap_file_state_t *file_state, size_t *size)
+{
+    int status = 0;
+
+    if (size_is_stale(file_state)) {
+        pthread_rwlock_wrlock(&file_state->lock);
+        if (size_is_stale(file_state)) {
+            status = size_revalidate(file_state);
+        }
+        pthread_rwlock_unlock(&file_state->lock);
+    }
+
+    *size = __atomic_load_n(&file_state->inode->size, __ATOMIC_ACQUIRE);
+
+    return status;
+}
+
+/*
+ * Set up size tracking for a new file state (before it is published.)
+ */
+void readmap_size_init(readmap_file_state_t *file_state)
+{
+    file_state->check_size    = 1;  // force the first size check
+    file_state->size_interval = __atomic_load_n(&default_interval, __ATOMIC_RELAXED);
+    file_state->size_deadline = 0;
+    file_state->size_changes  = 0;
+    file_state->size_watch    = size_watch_get(file_state->fd);
+}
+
+/*
+ * Done with the state; called once nobody else can be using it.
+ */
+void readmap_size_cleanup(readmap_file_state_t *file_state)
+{
+    if (NULL != file_state->size_watch) {
+        size_watch_put(file_state->size_watch);
+        file_state->size_watch = NULL;
+    }
+}
+
+int readmap_set_size_interval(int fd, unsigned milliseconds)
+{
+    readmap_file_state_t *file_state;
+
+    file_state = readmap_lookup_file_state(fd);
+    if (NULL == file_state) {
+        errno = EBADF;
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&file_state->lock);
+    file_state->size_interval = (uint64_t)milliseconds * 1000000;
+    // recompute the deadline on the next check
+    __atomic_store_n(&file_state->check_size, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&file_state->lock);
+
+    readmap_release_file_state(file_state);
+
+    return 0;
+}
+
+/*
+ * fstat() as of the last revalidation, but with the size as we know it: writes through the mapping
+ * may have moved the end of the file, or padded the file out beyond it.
+ */
+int readmap_fstat(int fd, struct stat *buf)
+{
+    readmap_file_state_t *file_state;
+    size_t                size;
+    int                   status;
+
+    file_state = readmap_lookup_file_state(fd);
+    if ((NULL == file_state) || (NULL == buf)) {
+        if (NULL != file_state) {
+            readmap_release_file_state(file_state);
+        }
+        return fin_fstat(fd, buf);
+    }
+
+    // revalidating (if it is due) refreshes last_stat as well
+    status = readmap_get_size(file_state, &size);
+    if (0 != status) {
+        readmap_release_file_state(file_state);
+        if (ESTALE == status) {
+            return fin_fstat(fd, buf);
+        }
+        errno = status;
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&file_state->lock);
+    *buf         = file_state->last_stat;
+    buf->st_size = __atomic_load_n(&file_state->inode->size, __ATOMIC_ACQUIRE);
+    pthread_rwlock_unlock(&file_state->lock);
+
+    readmap_release_file_state(file_state);
+
+    return 0;
+}
+
+int readmap_init_size_tracking(void)
+{
+    const char *interval = getenv("READMAP_SIZE_INTERVAL_MS");
+    int         status   = 0;
+
+    if (NULL != interval) {
+        __atomic_store_n(&default_interval, strtoull(interval, NULL, 0) * 1000000, __ATOMIC_RELAXED);
+    }
+
+    if (NULL == getenv("READMAP_SIZE_WATCH")) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&watch_lock);
+    while (NULL == watch_table) {
+        watch_fd     = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        watch_stopfd = eventfd(0, EFD_CLOEXEC);
+        watch_table  = lookup_table_create(1024, "readmapW", NULL, sizeof(int));
+
+        if ((watch_fd < 0) || (watch_stopfd < 0) || (NULL == watch_table)) {
+            status = (NULL == watch_table) ? ENOMEM : errno;
+        }
+        else {
+            status = pthread_create(&watch_thread, NULL, size_watch_thread, NULL);
+        }
+
+        __atomic_store_n(&watching, (0 == status), __ATOMIC_RELAXED);
+
+        if (0 != status) {
+            // we can still fall back to polling
+            if (NULL != watch_table) {
+                lookup_table_destroy(watch_table);
+                watch_table = NULL;
+            }
+            if (watch_fd >= 0) {
+                close(watch_fd);
+                watch_fd = -1;
+            }
+            if (watch_stopfd >= 0) {
+                close(watch_stopfd);
+                watch_stopfd = -1;
+            }
+        }
+        break;
+    }
+    pthread_mutex_unlock(&watch_lock);
+
+    return status;
+}
+
+/*
+ * Watches still held by open file states are dropped as those states go away; after this they
+ * simply stop seeing changes and fall back to the interval.
+ */
+void readmap_terminate_size_tracking(void)
+{
+    lookup_table_t *table;
+    uint64_t        stop = 1;
+
+    pthread_mutex_lock(&watch_lock);
+    table       = watch_table;
+    watch_table = NULL;
+    __atomic_store_n(&watching, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&watch_lock);
+
+    if (NULL == table) {
+        return;
+    }
+
+    if (sizeof(stop) == write(watch_stopfd, &stop, sizeof(stop))) {
+        pthread_join(watch_thread, NULL);
+    }
+
+    lookup_table_destroy(table);
+    close(watch_fd);
+    close(watch_stopfd);
+    watch_fd     = -1;
+    watch_stopfd = -1;
+}
@@ -0,0 +1,178 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include "api-internal.h"
+
+/*
+ * Slab allocation for the fixed size objects that come and go with every open and close.
+ *
+ * Objects are carved out of READMAP_SLAB_CHUNK sized chunks, a cache line apart (so an object
+ * never shares a line with its neighbours), and the slab's construct callback runs once when an
+ * object is carved out: not every time it is handed out.  So anything it sets up (locks, say)
+ * must be left in the same state when the object is freed.  Chunks are never given back.
+ *
+ * Each thread keeps up to READMAP_SLAB_CACHE_SIZE free objects of each slab to itself, so
+ * allocating and freeing normally touch nothing shared; the slab's lock is only taken to move
+ * half a cache's worth of objects to or from the slab's own free list.  A thread's cache goes back
+ * to the slab when it exits.
+ *
+ * While an object is free, its first pointer sized word belongs to the allocator.
+ */
+
+#define READMAP_SLAB_CHUNK ((size_t)64 * 1024)
+#define READMAP_SLAB_CACHE_SIZE (32)
+#define READMAP_SLAB_LINE (64)
+
+typedef struct slab_free {
+    struct slab_free *next;
+} slab_free_t;
+
+typedef struct slab_cache {
+    readmap_slab_t *slab;
+    unsigned        count;
+    void *          objects[READMAP_SLAB_CACHE_SIZE];
+} slab_cache_t;
+
+static __thread slab_cache_t slab_caches[READMAP_SLAB_COUNT];
+static __thread int          slab_registered;
+static pthread_key_t         slab_key;
+static pthread_once_t        slab_key_once = PTHREAD_ONCE_INIT;
+
+/* move count objects from the cache to the slab (which must be locked) */
+static void slab_cache_drain(slab_cache_t *cache, unsigned count)
+{
+    readmap_slab_t *slab = cache->slab;
+    slab_free_t *   object;
+
+    while ((count-- > 0) && (cache->count > 0)) {
+        object          = (slab_free_t *)cache->objects[--cache->count];
+        object->next    = (slab_free_t *)slab->free_list;
+        slab->free_list = object;
+        slab->free_count++;
+    }
+}
+
+static void slab_thread_exit(void *arg)
+{
+    slab_cache_t *cache;
+
+    (void)arg;
+
+    // anything freed after this (by another key's destructor) registers us again
+    slab_registered = 0;
+
+    for (unsigned id = 0; id < READMAP_SLAB_COUNT; id++) {
+        cache = &slab_caches[id];
+        if ((NULL == cache->slab) || (0 == cache->count)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&cache->slab->lock);
+        slab_cache_drain(cache, READMAP_SLAB_CACHE_SIZE);
+        pthread_mutex_unlock(&cache->slab->lock);
+    }
+}
+
+static void slab_key_init(void)
+{
+    int status = pthread_key_create(&slab_key, slab_thread_exit);
+
+    assert(0 == status);
+    (void)status;
+}
+
+static slab_cache_t *slab_get_cache(readmap_slab_t *slab)
+{
+    slab_cache_t *cache = &slab_caches[slab->id];
+
+    if (!slab_registered) {
+        // only so that we find out when the thread exits
+        pthread_once(&slab_key_once, slab_key_init);
+        pthread_setspecific(slab_key, slab_caches);
+        slab_registered = 1;
+    }
+
+    cache->slab = slab;
+
+    return cache;
+}
+
+/* add a new chunk's worth of objects to the slab (which must be locked); returns 0 or ENOMEM */
+static int slab_grow(readmap_slab_t *slab)
+{
+    size_t       chunk_size = READMAP_SLAB_CHUNK;
+    char *       chunk;
+    slab_free_t *object;
+
+    // the first line of the chunk links it to the others
+    if (chunk_size < READMAP_SLAB_LINE + (8 * slab->size)) {
+        chunk_size = READMAP_SLAB_LINE + (8 * slab->size);
+    }
+
+    chunk = aligned_alloc(READMAP_SLAB_LINE, chunk_size);
+    if (NULL == chunk) {
+        return ENOMEM;
+    }
+    *(void **)chunk = slab->chunks;
+    slab->chunks    = chunk;
+
+    for (size_t offset = READMAP_SLAB_LINE; offset + slab->size <= chunk_size; offset += slab->size) {
+        if (NULL != slab->construct) {
+            slab->construct(chunk + offset);
+        }
+        object          = (slab_free_t *)(chunk + offset);
+        object->next    = (slab_free_t *)slab->free_list;
+        slab->free_list = object;
+        slab->free_count++;
+    }
+
+    return 0;
+}
+
+void *readmap_slab_alloc(readmap_slab_t *slab)
+{
+    slab_cache_t *cache = slab_get_cache(slab);
+    slab_free_t * object;
+
+    assert(0 == (slab->size % READMAP_SLAB_LINE));
+
+    if (0 == cache->count) {
+        pthread_mutex_lock(&slab->lock);
+        if ((NULL != slab->free_list) || (0 == slab_grow(slab))) {
+            while ((cache->count < READMAP_SLAB_CACHE_SIZE / 2) && (NULL != slab->free_list)) {
+                object          = (slab_free_t *)slab->free_list;
+                slab->free_list = object->next;
+                slab->free_count--;
+                cache->objects[cache->count++] = object;
+            }
+        }
+        pthread_mutex_unlock(&slab->lock);
+
+        if (0 == cache->count) {
+            return NULL;
+        }
+    }
+
+    return cache->objects[--cache->count];
+}
+
+void readmap_slab_free(readmap_slab_t *slab, void *object)
+{
+    slab_cache_t *cache = slab_get_cache(slab);
+
+    if (NULL == object) {
+        return;
+    }
+
+    if (READMAP_SLAB_CACHE_SIZE == cache->count) {
+        pthread_mutex_lock(&slab->lock);
+        slab_cache_drain(cache, READMAP_SLAB_CACHE_SIZE / 2);
+        pthread_mutex_unlock(&slab->lock);
+    }
+
+    cache->objects[cache->count++] = object;
+}
@@ -0,0 +1,129 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <spawn.h>
+#include "api-internal.h"
+
+/*
+ * Ways of starting a process that don't go through fork(), so our fork handler doesn't see them.
+ * The new process gets all of our open file descriptions, so the offsets we own have to be back
+ * with the kernel first (see lseek.c.)
+ */
+
+static int fin_posix_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *file_actions,
+                           const posix_spawnattr_t *attrp, char *const argv[], char *const envp[])
+{
+    typedef int (*orig_posix_spawn_t)(pid_t *pid, const char *path, const posix_spawn_file_actions_t *file_actions,
+                                      const posix_spawnattr_t *attrp, char *const argv[], char *const envp[]);
+    static orig_posix_spawn_t orig_posix_spawn = NULL;
+
+    if (NULL == orig_posix_spawn) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_posix_spawn = (orig_posix_spawn_t)dlsym(RTLD_NEXT, "posix_spawn");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_posix_spawn);
+    if (NULL == orig_posix_spawn) {
+        return ENOSYS;
+    }
+
+    return orig_posix_spawn(pid, path, file_actions, attrp, argv, envp);
+}
+
+static int fin_posix_spawnp(pid_t *pid, const char *file, const posix_spawn_file_actions_t *file_actions,
+                            const posix_spawnattr_t *attrp, char *const argv[], char *const envp[])
+{
+    typedef int (*orig_posix_spawnp_t)(pid_t *pid, const char *file, const posix_spawn_file_actions_t *file_actions,
+                                       const posix_spawnattr_t *attrp, char *const argv[], char *const envp[]);
+    static orig_posix_spawnp_t orig_posix_spawnp = NULL;
+
+    if (NULL == orig_posix_spawnp) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_posix_spawnp = (orig_posix_spawnp_t)dlsym(RTLD_NEXT, "posix_spawnp");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_posix_spawnp);
+    if (NULL == orig_posix_spawnp) {
+        return ENOSYS;
+    }
+
+    return orig_posix_spawnp(pid, file, file_actions, attrp, argv, envp);
+}
+
+static int fin_system(const char *command)
+{
+    typedef int (*orig_system_t)(const char *command);
+    static orig_system_t orig_system = NULL;
+
+    if (NULL == orig_system) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_system = (orig_system_t)dlsym(RTLD_NEXT, "system");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_system);
+    if (NULL == orig_system) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_system(command);
+}
+
+static FILE *fin_popen(const char *command, const char *type)
+{
+    typedef FILE *(*orig_popen_t)(const char *command, const char *type);
+    static orig_popen_t orig_popen = NULL;
+
+    if (NULL == orig_popen) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_popen = (orig_popen_t)dlsym(RTLD_NEXT, "popen");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_popen);
+    if (NULL == orig_popen) {
+        errno = ENOSYS;
+        return NULL;
+    }
+
+    return orig_popen(command, type);
+}
+
+int readmap_posix_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *file_actions,
+                        const posix_spawnattr_t *attrp, char *const argv[], char *const envp[])
+{
+    readmap_release_offsets();
+
+    return fin_posix_spawn(pid, path, file_actions, attrp, argv, envp);
+}
+
+int readmap_posix_spawnp(pid_t *pid, const char *file, const posix_spawn_file_actions_t *file_actions,
+                         const posix_spawnattr_t *attrp, char *const argv[], char *const envp[])
+{
+    readmap_release_offsets();
+
+    return fin_posix_spawnp(pid, file, file_actions, attrp, argv, envp);
+}
+
+int readmap_system(const char *command)
+{
+    readmap_release_offsets();
+
+    return fin_system(command);
+}
+
+FILE *readmap_popen(const char *command, const char *type)
+{
+    readmap_release_offsets();
+
+    return fin_popen(command, type);
+}
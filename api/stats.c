@@ -0,0 +1,480 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include "api-internal.h"
+#include "callstats.h"
+
+/*
+ * Call statistics.
+ *
+ * When READMAP_STATS is set (to anything other than 0) in the environment, each API call records
+ * whether it succeeded and how long it took, separately for the mapped and native paths, in a
+ * log-bucketed latency histogram (four buckets to each power of two, so any latency is within 25%
+ * of its bucket's bounds.)  Counters live in a per-thread block, on its own cache lines, which only
+ * its thread writes; readmap_get_stats() adds them all up.  When a thread exits its counts are
+ * folded into a common total.  Time spent waiting for file state locks is counted too (see
+ * callstats.h).
+ *
+ * The totals are written out at readmap_shutdown(), and whenever the signal given by
+ * READMAP_STATS_SIGNAL (a number) arrives, to the file named by READMAP_STATS_FILE (appended to),
+ * or to stderr.
+ */
+
+#define STATS_SUB_BUCKETS 4  // per power of two
+
+typedef struct stats_thread
+{
+    readmap_stats_t      stats;
+    struct stats_thread *next;
+    struct stats_thread *prev;
+} __attribute__((aligned(64))) stats_thread_t;
+
+int readmap_stats_enabled;
+
+static pthread_mutex_t          stats_lock     = PTHREAD_MUTEX_INITIALIZER;
+static stats_thread_t *         stats_threads;  // threads that have recorded something
+static readmap_stats_t          stats_retired;  // from threads that have exited
+static pthread_once_t           stats_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t            stats_key;
+static __thread stats_thread_t *stats_local;
+static int                      stats_signal;
+static struct sigaction         stats_old_action;
+static int                      stats_eventfd = -1;
+static int                      stats_stop;
+static pthread_t                stats_dumper;
+
+static const char *stats_call_names[READMAP_CALL_COUNT] = {
+    "read", "pread", "readv", "preadv", "write", "pwrite", "writev", "pwritev",
+};
+
+static const char *stats_path_names[READMAP_PATH_COUNT] = {"mapped", "native"};
+
+/* only the owning thread writes its counters, but others may be reading them */
+static inline void stats_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static void stats_merge(readmap_call_stats_t *to, readmap_call_stats_t *from)
+{
+    uint64_t value;
+
+    to->calls += __atomic_load_n(&from->calls, __ATOMIC_RELAXED);
+    to->failures += __atomic_load_n(&from->failures, __ATOMIC_RELAXED);
+
+    for (unsigned path = 0; path < READMAP_PATH_COUNT; path++) {
+        to->count[path] += __atomic_load_n(&from->count[path], __ATOMIC_RELAXED);
+        to->total_ns[path] += __atomic_load_n(&from->total_ns[path], __ATOMIC_RELAXED);
+
+        value = __atomic_load_n(&from->max_ns[path], __ATOMIC_RELAXED);
+        if (value > to->max_ns[path]) {
+            to->max_ns[path] = value;
+        }
+
+        for (unsigned bucket = 0; bucket < READMAP_STATS_BUCKETS; bucket++) {
+            to->histogram[path][bucket] += __atomic_load_n(&from->histogram[path][bucket], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void stats_merge_all(readmap_stats_t *to, readmap_stats_t *from)
+{
+    for (unsigned call = 0; call < READMAP_CALL_COUNT; call++) {
+        stats_merge(&to->calls[call], &from->calls[call]);
+    }
+
+    to->lock_waits += __atomic_load_n(&from->lock_waits, __ATOMIC_RELAXED);
+    to->lock_wait_ns += __atomic_load_n(&from->lock_wait_ns, __ATOMIC_RELAXED);
+}
+
+static void stats_thread_exit(void *arg)
+{
+    stats_thread_t *local = (stats_thread_t *)arg;
+
+    pthread_mutex_lock(&stats_lock);
+    stats_merge_all(&stats_retired, &local->stats);
+
+    if (NULL != local->next) {
+        local->next->prev = local->prev;
+    }
+    if (NULL != local->prev) {
+        local->prev->next = local->next;
+    }
+    else {
+        stats_threads = local->next;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    free(local);
+}
+
+static void stats_create_key(void)
+{
+    int status = pthread_key_create(&stats_key, stats_thread_exit);
+
+    assert(0 == status);
+    (void)status;
+}
+
+static readmap_stats_t *stats_get_local(void)
+{
+    stats_thread_t *local = stats_local;
+
+    if (NULL == local) {
+        pthread_once(&stats_key_once, stats_create_key);
+
+        local = aligned_alloc(__alignof__(stats_thread_t), sizeof(stats_thread_t));
+        if (NULL == local) {
+            return NULL;
+        }
+        memset(local, 0, sizeof(stats_thread_t));
+
+        pthread_mutex_lock(&stats_lock);
+        local->next = stats_threads;
+        if (NULL != stats_threads) {
+            stats_threads->prev = local;
+        }
+        stats_threads = local;
+        pthread_mutex_unlock(&stats_lock);
+
+        stats_local = local;
+        pthread_setspecific(stats_key, local);
+    }
+
+    return &local->stats;
+}
+
+static readmap_call_stats_t *stats_get(int call)
+{
+    readmap_stats_t *stats = stats_get_local();
+
+    assert((call >= 0) && (call < READMAP_CALL_COUNT));
+
+    return (NULL == stats) ? NULL : &stats->calls[call];
+}
+
+static unsigned stats_bucket(uint64_t ns)
+{
+    unsigned msb;
+    unsigned bucket;
+
+    if (ns < STATS_SUB_BUCKETS) {
+        return ns;
+    }
+
+    msb    = 63 - __builtin_clzll(ns);
+    bucket = ((msb - 1) * STATS_SUB_BUCKETS) + ((ns >> (msb - 2)) & (STATS_SUB_BUCKETS - 1));
+
+    return (bucket < READMAP_STATS_BUCKETS) ? bucket : READMAP_STATS_BUCKETS - 1;
+}
+
+/*
+ * The smallest latency counted in the given bucket.
+ */
+uint64_t readmap_stats_bucket_value(unsigned bucket)
+{
+    if (bucket < STATS_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    if (bucket >= READMAP_STATS_BUCKETS) {
+        return UINT64_MAX;
+    }
+
+    return (uint64_t)(STATS_SUB_BUCKETS + (bucket % STATS_SUB_BUCKETS)) << ((bucket / STATS_SUB_BUCKETS) - 1);
+}
+
+/*
+ * The latency (the top of its bucket) below which percentile percent of the histogram's entries
+ * fall.
+ */
+uint64_t readmap_stats_percentile(const uint64_t *histogram, double percentile)
+{
+    uint64_t total = 0;
+    uint64_t target;
+    uint64_t seen = 0;
+
+    for (unsigned bucket = 0; bucket < READMAP_STATS_BUCKETS; bucket++) {
+        total += histogram[bucket];
+    }
+
+    if (0 == total) {
+        return 0;
+    }
+
+    target = (uint64_t)(total * percentile / 100.0);
+    if ((0 == target) || (target < total * percentile / 100.0)) {
+        target++;
+    }
+
+    for (unsigned bucket = 0; bucket < READMAP_STATS_BUCKETS; bucket++) {
+        seen += histogram[bucket];
+        if (seen >= target) {
+            return readmap_stats_bucket_value(bucket + 1) - 1;
+        }
+    }
+
+    return UINT64_MAX;
+}
+
+const char *readmap_stats_call_name(int call)
+{
+    if ((call < 0) || (call >= READMAP_CALL_COUNT)) {
+        return NULL;
+    }
+
+    return stats_call_names[call];
+}
+
+uint64_t readmap_stats_start(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((uint64_t)now.tv_sec * 1000 * 1000 * 1000) + now.tv_nsec;
+}
+
+void readmap_stats_time(int call, int path, uint64_t start)
+{
+    uint64_t              elapsed = readmap_stats_start() - start;
+    readmap_call_stats_t *stats   = stats_get(call);
+
+    if (NULL == stats) {
+        return;
+    }
+
+    stats_add(&stats->count[path], 1);
+    stats_add(&stats->total_ns[path], elapsed);
+    stats_add(&stats->histogram[path][stats_bucket(elapsed)], 1);
+    if (elapsed > stats->max_ns[path]) {
+        __atomic_store_n(&stats->max_ns[path], elapsed, __ATOMIC_RELAXED);
+    }
+}
+
+void readmap_stats_count(int call, int success)
+{
+    readmap_call_stats_t *stats = stats_get(call);
+
+    if (NULL == stats) {
+        return;
+    }
+
+    stats_add(&stats->calls, 1);
+    if (!success) {
+        stats_add(&stats->failures, 1);
+    }
+}
+
+void readmap_stats_lock_wait(uint64_t start)
+{
+    uint64_t         elapsed = readmap_stats_start() - start;
+    readmap_stats_t *stats   = stats_get_local();
+
+    if (NULL == stats) {
+        return;
+    }
+
+    stats_add(&stats->lock_waits, 1);
+    stats_add(&stats->lock_wait_ns, elapsed);
+}
+
+/*
+ * Fill in stats with the totals so far (for all threads.)  Returns 0, or -1 (with errno set.)
+ */
+int readmap_get_stats(readmap_stats_t *stats)
+{
+    if (NULL == stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(readmap_stats_t));
+
+    pthread_mutex_lock(&stats_lock);
+    stats_merge_all(stats, &stats_retired);
+    for (stats_thread_t *thread = stats_threads; NULL != thread; thread = thread->next) {
+        stats_merge_all(stats, &thread->stats);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    return 0;
+}
+
+void readmap_dump_stats(FILE *file)
+{
+    readmap_stats_t *     stats = malloc(sizeof(readmap_stats_t));
+    readmap_call_stats_t *call_stats;
+
+    if ((NULL == stats) || (0 != readmap_get_stats(stats))) {
+        free(stats);
+        return;
+    }
+
+    fprintf(file, "readmap statistics for process %d (latencies in ns)\n", (int)getpid());
+    fprintf(file, "%-8s %-6s %12s %10s %10s %10s %10s %10s %10s\n", "call", "path", "count", "failures", "mean", "p50", "p90",
+            "p99", "max");
+
+    for (unsigned call = 0; call < READMAP_CALL_COUNT; call++) {
+        call_stats = &stats->calls[call];
+        if (0 == call_stats->calls) {
+            continue;
+        }
+
+        for (unsigned path = 0; path < READMAP_PATH_COUNT; path++) {
+            if (0 == call_stats->count[path]) {
+                continue;
+            }
+
+            fprintf(file, "%-8s %-6s %12lu %10s %10lu %10lu %10lu %10lu %10lu\n", stats_call_names[call], stats_path_names[path],
+                    (unsigned long)call_stats->count[path], "", (unsigned long)(call_stats->total_ns[path] / call_stats->count[path]),
+                    (unsigned long)readmap_stats_percentile(call_stats->histogram[path], 50),
+                    (unsigned long)readmap_stats_percentile(call_stats->histogram[path], 90),
+                    (unsigned long)readmap_stats_percentile(call_stats->histogram[path], 99), (unsigned long)call_stats->max_ns[path]);
+        }
+
+        fprintf(file, "%-8s %-6s %12lu %10lu\n", stats_call_names[call], "all", (unsigned long)call_stats->calls,
+                (unsigned long)call_stats->failures);
+    }
+
+    fprintf(file, "lock waits %lu, %lu ns\n", (unsigned long)stats->lock_waits, (unsigned long)stats->lock_wait_ns);
+
+    fflush(file);
+    free(stats);
+}
+
+static void stats_dump_default(void)
+{
+    const char *path = getenv("READMAP_STATS_FILE");
+    FILE *      file = stderr;
+
+    if (NULL != path) {
+        file = fopen(path, "a");
+        if (NULL == file) {
+            return;
+        }
+    }
+
+    readmap_dump_stats(file);
+
+    if (stderr != file) {
+        fclose(file);
+    }
+}
+
+static void stats_signal_handler(int signo)
+{
+    uint64_t one   = 1;
+    int      saved = errno;
+
+    (void)signo;
+
+    // straight to the kernel: write() may be interposed, and we can't do anything else from here
+    (void)syscall(SYS_write, stats_eventfd, &one, sizeof(one));
+    errno = saved;
+}
+
+static void *stats_dump_thread(void *arg)
+{
+    uint64_t count;
+
+    (void)arg;
+
+    while (1) {
+        // (not through read(), so as not to count ourselves)
+        if (sizeof(count) != syscall(SYS_read, stats_eventfd, &count, sizeof(count))) {
+            if (EINTR == errno) {
+                continue;
+            }
+            break;
+        }
+
+        if (__atomic_load_n(&stats_stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        stats_dump_default();
+    }
+
+    return NULL;
+}
+
+int readmap_init_stats(void)
+{
+    const char *     enabled = getenv("READMAP_STATS");
+    const char *     signal  = getenv("READMAP_STATS_SIGNAL");
+    struct sigaction action;
+    int              status = 0;
+
+    __atomic_store_n(&readmap_stats_enabled, (NULL != enabled) && (0 != strtoul(enabled, NULL, 0)), __ATOMIC_RELAXED);
+
+    if (!readmap_stats_enabled || (NULL == signal) || (stats_eventfd >= 0)) {
+        return 0;
+    }
+
+    while (1) {
+        stats_signal = strtoul(signal, NULL, 0);
+        if ((stats_signal <= 0) || (stats_signal >= NSIG)) {
+            status = EINVAL;
+            break;
+        }
+
+        stats_eventfd = eventfd(0, EFD_CLOEXEC);
+        if (stats_eventfd < 0) {
+            status = errno;
+            break;
+        }
+
+        stats_stop = 0;
+        status     = pthread_create(&stats_dumper, NULL, stats_dump_thread, NULL);
+        if (0 != status) {
+            break;
+        }
+
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = stats_signal_handler;
+        action.sa_flags   = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (0 != sigaction(stats_signal, &action, &stats_old_action)) {
+            status = errno;
+            __atomic_store_n(&stats_stop, 1, __ATOMIC_RELEASE);
+            eventfd_write(stats_eventfd, 1);
+            pthread_join(stats_dumper, NULL);
+        }
+        break;
+    }
+
+    if ((0 != status) && (stats_eventfd >= 0)) {
+        close(stats_eventfd);
+        stats_eventfd = -1;
+    }
+
+    return status;
+}
+
+/*
+ * Write out the totals (if we're collecting them) and stop collecting.
+ */
+void readmap_terminate_stats(void)
+{
+    if (stats_eventfd >= 0) {
+        sigaction(stats_signal, &stats_old_action, NULL);
+        __atomic_store_n(&stats_stop, 1, __ATOMIC_RELEASE);
+        eventfd_write(stats_eventfd, 1);
+        pthread_join(stats_dumper, NULL);
+        close(stats_eventfd);
+        stats_eventfd = -1;
+    }
+
+    if (__atomic_load_n(&readmap_stats_enabled, __ATOMIC_RELAXED)) {
+        stats_dump_default();
+        __atomic_store_n(&readmap_stats_enabled, 0, __ATOMIC_RELAXED);
+    }
+}
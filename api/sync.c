@@ -0,0 +1,98 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include "api-internal.h"
+
+static int fin_fsync(int fd)
+{
+    typedef int (*orig_fsync_t)(int fd);
+    static orig_fsync_t orig_fsync = NULL;
+
+    if (NULL == orig_fsync) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_fsync = (orig_fsync_t)dlsym(RTLD_NEXT, "fsync");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_fsync);
+    if (NULL == orig_fsync) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_fsync(fd);
+}
+
+static int fin_fdatasync(int fd)
+{
+    typedef int (*orig_fdatasync_t)(int fd);
+    static orig_fdatasync_t orig_fdatasync = NULL;
+
+    if (NULL == orig_fdatasync) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_fdatasync = (orig_fdatasync_t)dlsym(RTLD_NEXT, "fdatasync");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_fdatasync);
+    if (NULL == orig_fdatasync) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_fdatasync(fd);
+}
+
+/*
+ * Data written through a shared mapping is in the page cache like any other, so the kernel's
+ * fsync() covers it; but we know which parts we have written, so we write those back ourselves
+ * (see dirty.c) and leave the native call little to do.  What it must not make durable is the
+ * padding readmap_extend_file() added beyond the end of the file, so that has to go first.
+ */
+static int sync_prepare(int fd)
+{
+    readmap_file_state_t *file_state;
+    int                   status = 0;
+
+    file_state = readmap_lookup_file_state(fd);
+    if (NULL != file_state) {
+        pthread_rwlock_wrlock(&file_state->lock);
+        // before the trim, which lets go of the mapping
+        status = readmap_dirty_flush(file_state);
+        if (0 == status) {
+            status = readmap_trim_file(file_state);
+        }
+        pthread_rwlock_unlock(&file_state->lock);
+        readmap_release_file_state(file_state);
+    }
+
+    return status;
+}
+
+int readmap_fsync(int fd)
+{
+    int status = sync_prepare(fd);
+
+    if (0 != status) {
+        errno = status;
+        return -1;
+    }
+
+    return fin_fsync(fd);
+}
+
+int readmap_fdatasync(int fd)
+{
+    int status = sync_prepare(fd);
+
+    if (0 != status) {
+        errno = status;
+        return -1;
+    }
+
+    return fin_fdatasync(fd);
+}
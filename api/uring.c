@@ -0,0 +1,608 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include "api-internal.h"
+
+/*
+ * io_uring fallback.
+ *
+ * I/O on descriptors we don't map (pipes, sockets, devices, O_DIRECT files, and regular files we
+ * aren't tracking) normally goes straight to the native call.  When a caller has several of them
+ * to do at once - the leftovers of a batch (batch.c), or the asynchronous interface below - they
+ * are queued on a per-thread io_uring instead and handed to the kernel with one system call.
+ * Reads and writes of files we do map are still done through the mapping, right away, and show
+ * up as completions like any other.
+ *
+ * Each thread's ring is set up (with the raw system calls, so there's no dependency on liburing)
+ * the first time the thread needs it, and torn down when the thread exits.  If the kernel doesn't
+ * have io_uring (or it is disabled, or READMAP_URING is set to 0 in the environment) everything
+ * is done synchronously with the native calls.
+ *
+ * The I/O goes straight to and from the caller's buffers.  Registering buffers with the ring only
+ * pays when the same memory is used over and over; for arbitrary caller buffers it would mean
+ * bouncing the data through ours, which costs more than the page pinning it saves.
+ */
+
+#define URING_ENTRIES 64                  // submission queue entries
+#define URING_SLOTS (2 * URING_ENTRIES)   // operations in flight (the completion queue size)
+#define URING_MAX_RW ((size_t)0x7ffff000) // the most one read or write transfers (as for read(2))
+
+typedef enum uring_slot_kind {
+    URING_SLOT_FREE = 0,
+    URING_SLOT_BATCH,
+    URING_SLOT_ASYNC,
+} uring_slot_kind_t;
+
+typedef struct uring_slot {
+    uring_slot_kind_t        kind;
+    readmap_batch_request_t *request;    // URING_SLOT_BATCH
+    void *                   user_data;  // URING_SLOT_ASYNC
+} uring_slot_t;
+
+typedef struct uring {
+    int                  fd;  // -1 if there's no ring, in which case everything is synchronous
+    int                  current_position;  // the kernel understands an offset of -1
+    unsigned *           sq_head;
+    unsigned *           sq_tail;
+    unsigned *           sq_mask;
+    unsigned *           sq_array;
+    unsigned             sq_entries;
+    unsigned *           cq_head;
+    unsigned *           cq_tail;
+    unsigned *           cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *               sq_ring;
+    size_t               sq_ring_size;
+    void *               cq_ring;
+    size_t               cq_ring_size;
+    size_t               sqes_size;
+    unsigned             unsubmitted;    // queued, but not yet given to the kernel
+    unsigned             batch_pending;  // batch reads not yet complete
+    unsigned             async_pending;  // async operations not yet reaped
+    uring_slot_t         slots[URING_SLOTS];
+    unsigned             free_slots[URING_SLOTS];
+    unsigned             free_count;
+    readmap_completion_t ready[URING_SLOTS];  // async completions waiting to be reaped
+    unsigned             ready_head;
+    unsigned             ready_count;
+} uring_t;
+
+static pthread_once_t  uring_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t   uring_key;
+static __thread uring_t *uring_thread;
+static int             uring_enabled = 1;
+
+static void uring_destroy(void *arg)
+{
+    uring_t *ring = (uring_t *)arg;
+
+    if (ring->fd >= 0) {
+        munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+    }
+
+    free(ring);
+}
+
+static void uring_create_key(void)
+{
+    int status = pthread_key_create(&uring_key, uring_destroy);
+
+    assert(0 == status);
+    (void)status;
+}
+
+/*
+ * Check that the kernel can do plain reads and writes on a ring (older ones only have the
+ * vectored versions.)
+ */
+static int uring_probe(int fd)
+{
+    const unsigned         count = IORING_OP_WRITE + 1;
+    struct io_uring_probe *probe = calloc(1, sizeof(struct io_uring_probe) + (count * sizeof(struct io_uring_probe_op)));
+    int                    status = ENOTSUP;
+
+    if (NULL == probe) {
+        return ENOMEM;
+    }
+
+    if ((0 == syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, count)) && (probe->ops_len >= count) &&
+        (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)) {
+        status = 0;
+    }
+
+    free(probe);
+
+    return status;
+}
+
+static int uring_setup(uring_t *ring)
+{
+    struct io_uring_params params;
+    int                    status = 0;
+
+    memset(&params, 0, sizeof(params));
+    params.flags      = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_SLOTS;
+    ring->fd          = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        return errno;
+    }
+
+    ring->sq_ring = MAP_FAILED;
+    ring->cq_ring = MAP_FAILED;
+    ring->sqes    = MAP_FAILED;
+
+    while (1) {
+        status = uring_probe(ring->fd);
+        if (0 != status) {
+            break;
+        }
+
+        ring->sq_ring_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+        ring->cq_ring_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            if (ring->cq_ring_size > ring->sq_ring_size) {
+                ring->sq_ring_size = ring->cq_ring_size;
+            }
+            ring->cq_ring_size = ring->sq_ring_size;
+        }
+
+        ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        if (MAP_FAILED == ring->sq_ring) {
+            status = errno;
+            break;
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            ring->cq_ring = ring->sq_ring;
+        }
+        else {
+            ring->cq_ring =
+                mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+            if (MAP_FAILED == ring->cq_ring) {
+                status = errno;
+                break;
+            }
+        }
+
+        ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes      = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        if (MAP_FAILED == ring->sqes) {
+            status = errno;
+            break;
+        }
+
+        ring->sq_head          = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+        ring->sq_tail          = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+        ring->sq_mask          = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+        ring->sq_array         = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+        ring->sq_entries       = params.sq_entries;
+        ring->cq_head          = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+        ring->cq_tail          = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+        ring->cq_mask          = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+        ring->cqes             = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+        ring->current_position = (params.features & IORING_FEAT_RW_CUR_POS) ? 1 : 0;
+        break;
+    }
+
+    if (0 != status) {
+        if (MAP_FAILED != ring->sqes) {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        if ((MAP_FAILED != ring->cq_ring) && (ring->cq_ring != ring->sq_ring)) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        if (MAP_FAILED != ring->sq_ring) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+        close(ring->fd);
+        ring->fd = -1;
+    }
+
+    return status;
+}
+
+/*
+ * This thread's ring, which is created if need be.  Returns NULL if we're out of memory.
+ */
+static uring_t *uring_get(void)
+{
+    uring_t *ring = uring_thread;
+    int      status;
+
+    if (NULL != ring) {
+        return ring;
+    }
+
+    pthread_once(&uring_key_once, uring_create_key);
+
+    ring = calloc(1, sizeof(uring_t));
+    if (NULL == ring) {
+        return NULL;
+    }
+
+    ring->fd = -1;
+    if (__atomic_load_n(&uring_enabled, __ATOMIC_RELAXED)) {
+        status = uring_setup(ring);
+        if ((ENOSYS == status) || (EPERM == status) || (ENOTSUP == status)) {
+            // and it won't be for any other thread either
+            __atomic_store_n(&uring_enabled, 0, __ATOMIC_RELAXED);
+        }
+    }
+
+    for (unsigned index = 0; index < URING_SLOTS; index++) {
+        ring->free_slots[index] = URING_SLOTS - 1 - index;
+    }
+    ring->free_count = URING_SLOTS;
+
+    uring_thread = ring;
+    pthread_setspecific(uring_key, ring);
+
+    return ring;
+}
+
+static void uring_ready(uring_t *ring, void *user_data, ssize_t result)
+{
+    readmap_completion_t *completion = &ring->ready[(ring->ready_head + ring->ready_count) % URING_SLOTS];
+
+    assert(ring->ready_count < URING_SLOTS);
+    completion->user_data = user_data;
+    completion->result    = result;
+    ring->ready_count++;
+}
+
+/*
+ * Pick up whatever the kernel has finished.
+ */
+static void uring_reap(uring_t *ring)
+{
+    unsigned             head = *ring->cq_head;
+    unsigned             tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe *cqe;
+    uring_slot_t *       slot;
+
+    for (; head != tail; head++) {
+        cqe  = &ring->cqes[head & *ring->cq_mask];
+        slot = &ring->slots[cqe->user_data];
+
+        if (URING_SLOT_BATCH == slot->kind) {
+            slot->request->result = cqe->res;
+            ring->batch_pending--;
+        }
+        else {
+            uring_ready(ring, slot->user_data, cqe->res);
+        }
+
+        slot->kind                             = URING_SLOT_FREE;
+        ring->free_slots[ring->free_count++] = cqe->user_data;
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Give the kernel whatever has been queued, wait for at least wait operations to complete (if
+ * there are that many), and reap them.
+ */
+static int uring_enter(uring_t *ring, unsigned wait)
+{
+    long submitted;
+
+    while (1) {
+        submitted = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted >= 0) {
+            ring->unsubmitted -= submitted;
+            break;
+        }
+
+        if ((EAGAIN == errno) || (EBUSY == errno)) {
+            // the kernel needs us to make room
+            uring_reap(ring);
+            continue;
+        }
+
+        if (EINTR != errno) {
+            return errno;
+        }
+    }
+
+    uring_reap(ring);
+
+    return 0;
+}
+
+/*
+ * Queue an operation for the kernel.  Returns the slot it uses, or -1 (with errno set) if the
+ * ring has failed.
+ */
+static int uring_queue(uring_t *ring, int opcode, int fd, const void *buffer, size_t length, off_t offset)
+{
+    struct io_uring_sqe *sqe;
+    unsigned             tail;
+    unsigned             index;
+    unsigned             slot;
+    int                  status;
+
+    // make sure there's a slot to track it, and room in the submission queue
+    while ((0 == ring->free_count) || (ring->unsubmitted == ring->sq_entries)) {
+        status = uring_enter(ring, ring->free_count ? 0 : 1);
+        if (0 != status) {
+            errno = status;
+            return -1;
+        }
+    }
+
+    slot = ring->free_slots[--ring->free_count];
+
+    tail  = *ring->sq_tail;  // we are the only producer
+    index = tail & *ring->sq_mask;
+    sqe   = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    sqe->addr      = (uintptr_t)buffer;
+    sqe->len       = (length > URING_MAX_RW) ? URING_MAX_RW : length;
+    sqe->off       = (uint64_t)offset;
+    sqe->user_data = slot;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+
+    return slot;
+}
+
+/*
+ * Take back whatever is queued but was never given to the kernel, once uring_enter() has failed
+ * with error.  Batch reads are left undone (with a result of -ENOTSUP) for the caller to do some
+ * other way; asynchronous operations complete with the error.
+ */
+static void uring_unqueue(uring_t *ring, int error)
+{
+    unsigned      tail = *ring->sq_tail;  // the kernel only looks at it when we enter
+    unsigned      index;
+    uring_slot_t *slot;
+
+    for (; ring->unsubmitted > 0; ring->unsubmitted--) {
+        tail--;
+        index = (unsigned)ring->sqes[tail & *ring->sq_mask].user_data;
+        slot  = &ring->slots[index];
+
+        if (URING_SLOT_BATCH == slot->kind) {
+            ring->batch_pending--;
+        }
+        else {
+            uring_ready(ring, slot->user_data, -error);
+        }
+
+        slot->kind                             = URING_SLOT_FREE;
+        ring->free_slots[ring->free_count++] = index;
+    }
+
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Read the requests (none of which can be served from a mapping) through this thread's ring,
+ * waiting for them all.  Returns ENOTSUP if there is no ring, in which case the caller should
+ * read them natively, or the error if the ring failed part way; either way, those left with a
+ * result of -ENOTSUP weren't done, and nothing is still in flight.
+ */
+int readmap_uring_read_batch(readmap_batch_request_t **requests, unsigned count)
+{
+    uring_t *ring = uring_get();
+    int      slot;
+    int      status = 0;
+    int      enter_status;
+
+    if ((NULL == ring) || (ring->fd < 0)) {
+        return ENOTSUP;
+    }
+
+    for (unsigned index = 0; index < count; index++) {
+        slot = uring_queue(ring, IORING_OP_READ, requests[index]->fd, requests[index]->buffer, requests[index]->length,
+                           requests[index]->offset);
+        if (slot < 0) {
+            // the rest are left for the caller
+            status = errno;
+            break;
+        }
+
+        ring->slots[slot].kind    = URING_SLOT_BATCH;
+        ring->slots[slot].request = requests[index];
+        ring->batch_pending++;
+    }
+
+    // The buffers (and results) are the caller's, and it will do what's left itself, so nothing
+    // can still be in flight when we return, even if the ring has failed: what the kernel never
+    // saw is taken back, and the rest waited for.
+    while (ring->batch_pending > 0) {
+        enter_status = uring_enter(ring, ring->batch_pending);
+        if (0 == enter_status) {
+            continue;
+        }
+
+        if (0 == status) {
+            status = enter_status;
+        }
+        if (0 == ring->unsubmitted) {
+            // only waiting failed, which a valid ring doesn't do (EINTR is retried)
+            break;
+        }
+        uring_unqueue(ring, enter_status);
+    }
+
+    return status;
+}
+
+/*
+ * Do the operation right here, through the mapping if it's a file we track, and queue its
+ * completion.
+ */
+static void uring_now(uring_t *ring, int opcode, int fd, void *buffer, size_t count, off_t offset, void *user_data)
+{
+    ssize_t result;
+
+    if (IORING_OP_READ == opcode) {
+        result = (offset < 0) ? readmap_read(fd, buffer, count) : readmap_pread(fd, buffer, count, offset);
+    }
+    else {
+        result = (offset < 0) ? readmap_write(fd, buffer, count) : readmap_pwrite(fd, buffer, count, offset);
+    }
+
+    uring_ready(ring, user_data, (result < 0) ? -errno : result);
+    ring->async_pending++;
+}
+
+static int uring_async(int opcode, int fd, void *buffer, size_t count, off_t offset, void *user_data)
+{
+    uring_t *             ring = uring_get();
+    readmap_file_state_t *file_state;
+    int                   slot;
+
+    if (NULL == ring) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if ((offset < -1) || (count > SSIZE_MAX)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ring->async_pending >= URING_SLOTS) {
+        // time to reap some
+        errno = EAGAIN;
+        return -1;
+    }
+
+    file_state = readmap_lookup_file_state(fd);
+    if (NULL != file_state) {
+        readmap_release_file_state(file_state);
+    }
+
+    if ((NULL != file_state) || (ring->fd < 0) || ((offset < 0) && !ring->current_position)) {
+        uring_now(ring, opcode, fd, buffer, count, offset, user_data);
+        return 0;
+    }
+
+    slot = uring_queue(ring, opcode, fd, buffer, count, offset);
+    if (slot < 0) {
+        // no ring after all
+        uring_now(ring, opcode, fd, buffer, count, offset, user_data);
+        return 0;
+    }
+
+    ring->slots[slot].kind      = URING_SLOT_ASYNC;
+    ring->slots[slot].user_data = user_data;
+    ring->async_pending++;
+
+    return 0;
+}
+
+/*
+ * Start reading count bytes from fd at offset (-1 for the file position) into buffer.  The
+ * completion, tagged with user_data, is collected with readmap_async_reap() on the same thread.
+ * Returns 0, or -1 with errno set (EAGAIN if too many operations are waiting to be reaped.)
+ */
+int readmap_async_read(int fd, void *buffer, size_t count, off_t offset, void *user_data)
+{
+    return uring_async(IORING_OP_READ, fd, buffer, count, offset, user_data);
+}
+
+int readmap_async_write(int fd, const void *buffer, size_t count, off_t offset, void *user_data)
+{
+    return uring_async(IORING_OP_WRITE, fd, (void *)(uintptr_t)buffer, count, offset, user_data);
+}
+
+/*
+ * Start anything that is queued, wait until at least wait operations have completed (or all of
+ * them, if fewer are outstanding), and return up to count completions.  Returns the number of
+ * completions, or -1 with errno set.
+ */
+int readmap_async_reap(readmap_completion_t *completions, unsigned count, unsigned wait)
+{
+    uring_t *ring = uring_thread;
+    unsigned reaped;
+    int      status;
+
+    if ((NULL == completions) && (0 != count)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (NULL == ring) {
+        // this thread hasn't started anything
+        return 0;
+    }
+
+    if (wait > count) {
+        wait = count;
+    }
+    if (wait > ring->async_pending) {
+        wait = ring->async_pending;
+    }
+
+    if (ring->fd >= 0) {
+        uring_reap(ring);
+        do {
+            status = uring_enter(ring, (ring->ready_count < wait) ? wait - ring->ready_count : 0);
+            if (0 != status) {
+                errno = status;
+                return -1;
+            }
+        } while ((ring->ready_count < wait) || (0 != ring->unsubmitted));
+    }
+
+    for (reaped = 0; (reaped < count) && (reaped < ring->ready_count); reaped++) {
+        completions[reaped] = ring->ready[(ring->ready_head + reaped) % URING_SLOTS];
+    }
+    ring->ready_head = (ring->ready_head + reaped) % URING_SLOTS;
+    ring->ready_count -= reaped;
+    ring->async_pending -= reaped;
+
+    return reaped;
+}
+
+void readmap_init_uring(void)
+{
+    const char *enabled = getenv("READMAP_URING");
+
+    uring_enabled = (NULL == enabled) || (0 != strtoul(enabled, NULL, 0));
+}
+
+/*
+ * Tear down the calling thread's ring (other threads' go away when they exit.)
+ */
+void readmap_terminate_uring(void)
+{
+    uring_t *ring = uring_thread;
+
+    if (NULL == ring) {
+        return;
+    }
+
+    // anything still in flight has to finish before its buffers can be let go
+    while ((ring->fd >= 0) && ((ring->async_pending > ring->ready_count) || (ring->batch_pending > 0))) {
+        if (0 != uring_enter(ring, 1)) {
+            break;
+        }
+    }
+
+    uring_thread = NULL;
+    pthread_setspecific(uring_key, NULL);
+    uring_destroy(ring);
+}
@@ -0,0 +1,134 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+#include <fcntl.h>
+#include "api-internal.h"
+#include "callstats.h"
+
+/*
+ * Zero copy reads.
+ *
+ * readmap_read_view() hands back a pointer to the data in place, in the mapping, rather than
+ * copying it.  The view holds a reference to the mapping, so it stays valid (even if the file is
+ * closed) until readmap_release_view() is called.  A view never spans mappings, so for a large
+ * file that is being read a window at a time it may be shorter than what was asked for; just ask
+ * again for the rest.
+ *
+ * The view is of the file itself: writes made to the file while the view is held show through
+ * it, and if the file is truncated, touching the part of the view that is gone raises SIGBUS (or,
+ * if it was cut short through the library, reads as zeros.)
+ */
+
+/*
+ * Fill in the view from the file state's current mapping, if it covers offset.  Returns the
+ * length of the view, or zero if the mapping doesn't cover it.
+ *
+ * Caller must hold file_state->lock.
+ */
+static size_t view_fill(readmap_file_state_t *file_state, off_t offset, size_t length, size_t size, readmap_view_t *view)
+{
+    size_t available;
+
+    if (!file_state->mapped || (offset < file_state->map_offset) || (offset >= readmap_mapping_valid_end(file_state->mapping))) {
+        return 0;
+    }
+
+    available = readmap_mapping_valid_end(file_state->mapping) - offset;
+    if (available > size - offset) {
+        available = size - offset;
+    }
+    if (available > length) {
+        available = length;
+    }
+
+    readmap_mapping_hold(file_state->mapping);
+    view->data         = (const char *)file_state->map_location + (offset - file_state->map_offset);
+    view->length       = available;
+    view->private_data = file_state->mapping;
+
+    readmap_access_note(file_state, offset, available, size);
+
+    return available;
+}
+
+ssize_t readmap_read_view(int fd, off_t offset, size_t length, readmap_view_t *view)
+{
+    readmap_file_state_t *file_state;
+    size_t                size;
+    size_t                available = 0;
+    int                   status    = 0;
+
+    view->data         = NULL;
+    view->length       = 0;
+    view->private_data = NULL;
+
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    file_state = readmap_lookup_file_state(fd);
+    if (NULL == file_state) {
+        errno = EBADF;
+        return -1;
+    }
+
+    while (1) {
+        if (O_WRONLY == (file_state->flags & O_ACCMODE)) {
+            status = EBADF;
+            break;
+        }
+
+        status = readmap_get_size(file_state, &size);
+        if (0 != status) {
+            break;
+        }
+
+        if ((0 == length) || ((size_t)offset >= size)) {
+            break;
+        }
+
+        // usually what we want is already mapped
+        readmap_stats_rdlock(file_state);
+        available = view_fill(file_state, offset, length, size, view);
+        pthread_rwlock_unlock(&file_state->lock);
+
+        if (0 != available) {
+            break;
+        }
+
+        readmap_stats_wrlock(file_state);
+        status = readmap_map_range(file_state, offset, size);
+        if (0 == status) {
+            available = view_fill(file_state, offset, length, size, view);
+            assert(0 != available);
+        }
+        pthread_rwlock_unlock(&file_state->lock);
+        break;
+    }
+
+    if (0 != available) {
+        readmap_stats_served(file_state, available);
+    }
+    readmap_release_file_state(file_state);
+
+    if (0 != status) {
+        errno = status;
+        return -1;
+    }
+
+    return available;
+}
+
+void readmap_release_view(readmap_view_t *view)
+{
+    if (NULL != view->private_data) {
+        readmap_mapping_put((readmap_mapping_t *)view->private_data);
+    }
+
+    view->data         = NULL;
+    view->length       = 0;
+    view->private_data = NULL;
+}
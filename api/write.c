@@ -1,14 +1,17 @@
 /*
- * (C) Copyright 2017-2020 Tony Mason
+ * (C) Copyright 2017-2021 Tony Mason
  * All Rights Reserved
  */
 
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
 #include "api-internal.h"
 #include "callstats.h"
 
-static int fin_write(int fd, void *buffer, size_t length)
+static ssize_t fin_write(int fd, const void *buffer, size_t length)
 {
-    typedef int (*orig_write_t)(int fd, void *buffer, size_t length);
+    typedef ssize_t (*orig_write_t)(int fd, const void *buffer, size_t length);
     static orig_write_t orig_write = NULL;
 
     if (NULL == orig_write) {
@@ -27,16 +30,240 @@ static int fin_write(int fd, void *buffer, size_t length)
     return orig_write(fd, buffer, length);
 }
 
-static int internal_write(int fd, void *buffer, size_t length)
+static ssize_t fin_pwrite(int fd, const void *buffer, size_t length, off_t offset)
 {
-    int status;
+    typedef ssize_t (*orig_pwrite_t)(int fd, const void *buffer, size_t length, off_t offset);
+    static orig_pwrite_t orig_pwrite = NULL;
+
+    if (NULL == orig_pwrite) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_pwrite = (orig_pwrite_t)dlsym(RTLD_NEXT, "pwrite");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_pwrite);
+    if (NULL == orig_pwrite) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_pwrite(fd, buffer, length, offset);
+}
+
+static ssize_t fin_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    typedef ssize_t (*orig_writev_t)(int fd, const struct iovec *iov, int iovcnt);
+    static orig_writev_t orig_writev = NULL;
+
+    if (NULL == orig_writev) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_writev = (orig_writev_t)dlsym(RTLD_NEXT, "writev");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_writev);
+    if (NULL == orig_writev) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_writev(fd, iov, iovcnt);
+}
+
+static ssize_t fin_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    typedef ssize_t (*orig_pwritev_t)(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+    static orig_pwritev_t orig_pwritev = NULL;
+
+    if (NULL == orig_pwritev) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+        orig_pwritev = (orig_pwritev_t)dlsym(RTLD_NEXT, "pwritev");
+#pragma GCC diagnostic pop
+    }
+
+    assert(NULL != orig_pwritev);
+    if (NULL == orig_pwritev) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return orig_pwritev(fd, iov, iovcnt, offset);
+}
+
+/*
+ * Store the data into the mapping, growing the file if this write runs past the space we have.
+ * If positional is set, the write is at offset and the file position is neither used nor
+ * changed; otherwise, the write is at (and advances) the file position.
+ *
+ * Returns -1 (without setting errno) if this request can't be handled here and needs to go
+ * to the native call.
+ */
+static ssize_t mapped_writev(readmap_file_state_t *file_state, const struct iovec *iov, int iovcnt, off_t offset, int positional)
+{
+    readmap_inode_t *inode  = file_state->inode;
+    ssize_t          result = -1;
+    size_t           length = 0;
+    size_t           end;
+    size_t           size;
+
+    if (O_RDWR != (file_state->flags & O_ACCMODE)) {
+        // a shared writable mapping requires read access as well
+        return -1;
+    }
+
+    if (__atomic_load_n(&file_state->flags, __ATOMIC_RELAXED) & O_APPEND) {
+        // Appending is only atomic if the kernel picks the end of the file: anyone else (in this
+        // process or not) may be appending too, and our idea of where it ends can be stale.
+        return -1;
+    }
+
+    for (int index = 0; index < iovcnt; index++) {
+        if (iov[index].iov_len > SSIZE_MAX - length) {
+            // let the kernel return the error
+            return -1;
+        }
+        length += iov[index].iov_len;
+    }
+
+    if (0 == length) {
+        return 0;
+    }
+
+    if (0 != readmap_get_size(file_state, &size)) {
+        // let the kernel return the error
+        return -1;
+    }
+
+    readmap_stats_wrlock(file_state);
+    while (1) {
+        if (!positional) {
+            if (0 != readmap_claim_offset(file_state)) {
+                break;
+            }
+            offset = file_state->offset;
+        }
+
+        end = offset + length;
+
+        if (0 != readmap_extend_file(file_state, end)) {
+            break;
+        }
+
+        for (int index = 0; index < iovcnt; index++) {
+            memcpy((char *)file_state->map_location + offset, iov[index].iov_base, iov[index].iov_len);
+            offset += iov[index].iov_len;
+        }
+        readmap_dirty_note(file_state, end - length, length);
+
+        if (!positional) {
+            file_state->offset = end;
+        }
+        // other descriptors for the file may be writing too (under the inode's shared lock)
+        size = __atomic_load_n(&inode->size, __ATOMIC_RELAXED);
+        while ((end > size) && !__atomic_compare_exchange_n(&inode->size, &size, end, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            // size has been reloaded
+        }
+        pthread_rwlock_unlock(&inode->lock);
+        result = length;
+        break;
+    }
+    pthread_rwlock_unlock(&file_state->lock);
+
+    return result;
+}
+
+/*
+ * Try to satisfy the write via the mapping.  Returns non-zero if the request was handled (the
+ * outcome is in *result, with errno set if that is -1), or zero if the native call should be
+ * used.
+ */
+static int try_mapped_write(int fd, const struct iovec *iov, int iovcnt, off_t offset, int positional, ssize_t *result)
+{
+    readmap_file_state_t *file_state;
+    int                   handled = 0;
+    int                   status;
+
+    file_state = readmap_lookup_file_state(fd);
+
+    while (NULL != file_state) {
+        if ((iovcnt >= 0) && (iovcnt <= IOV_MAX) && (!positional || (offset >= 0))) {
+            *result = mapped_writev(file_state, iov, iovcnt, offset, positional);
+            if (*result >= 0) {
+                readmap_stats_served(file_state, *result);
+                handled = 1;
+                break;
+            }
+        }
+
+        // writes go to the kernel, which needs to know where we are, and where the file ends
+        readmap_stats_wrlock(file_state);
+        status = readmap_release_offset(file_state);
+        if (0 == status) {
+            status = readmap_trim_file(file_state);
+        }
+        pthread_rwlock_unlock(&file_state->lock);
+
+        if (0 != status) {
+            errno   = status;
+            *result = -1;
+            handled = 1;
+        }
+        break;
+    }
+
+    if (NULL != file_state) {
+        readmap_release_file_state(file_state);
+    }
+
+    return handled;
+}
+
+/*
+ * After a native write the file may have grown, so the cached size is suspect.
+ */
+static void invalidate_size(int fd)
+{
+    readmap_file_state_t *file_state;
+
+    file_state = readmap_lookup_file_state(fd);
+    if (NULL != file_state) {
+        __atomic_store_n(&file_state->check_size, 1, __ATOMIC_RELAXED);
+        readmap_release_file_state(file_state);
+    }
+}
+
+static ssize_t internal_write(int fd, const void *buffer, size_t length)
+{
+    struct iovec iov = {.iov_base = (void *)(uintptr_t)buffer, .iov_len = length};
+    ssize_t      status;
 
     DECLARE_TIME(FINESSE_API_CALL_WRITE)
 
+    START_TIME
+    if (try_mapped_write(fd, &iov, 1, 0, 0, &status)) {
+        STOP_MAPPED_TIME;
+        return status;
+    }
+
     START_TIME
     status = fin_write(fd, buffer, length);
     STOP_NATIVE_TIME;
 
+    if (status > 0) {
+        invalidate_size(fd);
+    }
+
+    return status;
+}
+
+ssize_t readmap_write(int fd, const void *buffer, size_t length)
+{
+    ssize_t status = internal_write(fd, buffer, length);
+
+    FinesseApiCountCall(FINESSE_API_CALL_WRITE, !(status < 0));  // number of bytes, -1 on error
     return status;
 }
 
@@ -44,8 +271,99 @@ int finesse_write(int fd, void *buffer, size_t length);
 
 int finesse_write(int fd, void *buffer, size_t length)
 {
-    int status = internal_write(fd, buffer, length);
+    return readmap_write(fd, buffer, length);
+}
 
-    FinesseApiCountCall(FINESSE_API_CALL_WRITE, !(status < 0));  // number of bytes, -1 on error
+static ssize_t internal_pwrite(int fd, const void *buffer, size_t length, off_t offset)
+{
+    struct iovec iov = {.iov_base = (void *)(uintptr_t)buffer, .iov_len = length};
+    ssize_t      status;
+
+    DECLARE_TIME(FINESSE_API_CALL_PWRITE)
+
+    START_TIME
+    if (try_mapped_write(fd, &iov, 1, offset, 1, &status)) {
+        STOP_MAPPED_TIME;
+        return status;
+    }
+
+    START_TIME
+    status = fin_pwrite(fd, buffer, length, offset);
+    STOP_NATIVE_TIME;
+
+    if (status > 0) {
+        invalidate_size(fd);
+    }
+
+    return status;
+}
+
+ssize_t readmap_pwrite(int fd, const void *buffer, size_t length, off_t offset)
+{
+    ssize_t status = internal_pwrite(fd, buffer, length, offset);
+
+    FinesseApiCountCall(FINESSE_API_CALL_PWRITE, !(status < 0));
+    return status;
+}
+
+static ssize_t internal_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t status;
+
+    DECLARE_TIME(FINESSE_API_CALL_WRITEV)
+
+    START_TIME
+    if (try_mapped_write(fd, iov, iovcnt, 0, 0, &status)) {
+        STOP_MAPPED_TIME;
+        return status;
+    }
+
+    START_TIME
+    status = fin_writev(fd, iov, iovcnt);
+    STOP_NATIVE_TIME;
+
+    if (status > 0) {
+        invalidate_size(fd);
+    }
+
+    return status;
+}
+
+ssize_t readmap_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t status = internal_writev(fd, iov, iovcnt);
+
+    FinesseApiCountCall(FINESSE_API_CALL_WRITEV, !(status < 0));
+    return status;
+}
+
+static ssize_t internal_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    ssize_t status;
+
+    DECLARE_TIME(FINESSE_API_CALL_PWRITEV)
+
+    START_TIME
+    if (try_mapped_write(fd, iov, iovcnt, offset, 1, &status)) {
+        STOP_MAPPED_TIME;
+        return status;
+    }
+
+    START_TIME
+    status = fin_pwritev(fd, iov, iovcnt, offset);
+    STOP_NATIVE_TIME;
+
+    if (status > 0) {
+        invalidate_size(fd);
+    }
+
+    return status;
+}
+
+ssize_t readmap_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    ssize_t status = internal_pwritev(fd, iov, iovcnt, offset);
+
+    FinesseApiCountCall(FINESSE_API_CALL_PWRITEV, !(status < 0));
     return status;
 }
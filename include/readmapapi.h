@@ -7,21 +7,135 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <spawn.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
 
-void  readmap_init(void);
-void  readmap_shutdown(void);
-int   readmap_open(const char *pathname, int flags, ...);
-int   readmap_creat(const char *pathname, mode_t mode);
-int   readmap_openat(int dirfd, const char *pathname, int flags, ...);
-int   readmap_close(int fd);
-FILE *readmap_fopen(const char *pathname, const char *mode);
-FILE *readmap_fdopen(int fd, const char *mode);
-FILE *readmap_freopen(const char *pathname, const char *mode, FILE *stream);
+/*
+ * A zero copy view of part of a file (see readmap_read_view).  private_data belongs to the library.
+ */
+typedef struct readmap_view {
+    const void *data;
+    size_t      length;
+    void       *private_data;
+} readmap_view_t;
+
+/*
+ * One read in a batch (see readmap_submit_batch).  result is filled in with the number of bytes
+ * read, or with -errno if the read failed.
+ */
+typedef struct readmap_batch_request {
+    int     fd;
+    off_t   offset;
+    void   *buffer;
+    size_t  length;
+    ssize_t result;
+} readmap_batch_request_t;
+
+/*
+ * A finished asynchronous operation (see readmap_async_reap).  result is the number of bytes
+ * transferred, or -errno.
+ */
+typedef struct readmap_completion {
+    void   *user_data;
+    ssize_t result;
+} readmap_completion_t;
+
+/*
+ * Call statistics (see readmap_get_stats), collected when READMAP_STATS is set in the environment.
+ * Latencies are in nanoseconds; histogram bucket b counts latencies in the range
+ * [readmap_stats_bucket_value(b), readmap_stats_bucket_value(b + 1)), with four buckets to each
+ * power of two.
+ */
+#define READMAP_CALL_READ 0
+#define READMAP_CALL_PREAD 1
+#define READMAP_CALL_READV 2
+#define READMAP_CALL_PREADV 3
+#define READMAP_CALL_WRITE 4
+#define READMAP_CALL_PWRITE 5
+#define READMAP_CALL_WRITEV 6
+#define READMAP_CALL_PWRITEV 7
+#define READMAP_CALL_COUNT 8
+
+#define READMAP_PATH_MAPPED 0
+#define READMAP_PATH_NATIVE 1
+#define READMAP_PATH_COUNT 2
+
+#define READMAP_STATS_BUCKETS 160
+
+typedef struct readmap_call_stats {
+    uint64_t calls;
+    uint64_t failures;
+    uint64_t count[READMAP_PATH_COUNT];
+    uint64_t total_ns[READMAP_PATH_COUNT];
+    uint64_t max_ns[READMAP_PATH_COUNT];
+    uint64_t histogram[READMAP_PATH_COUNT][READMAP_STATS_BUCKETS];
+} readmap_call_stats_t;
+
+typedef struct readmap_stats {
+    readmap_call_stats_t calls[READMAP_CALL_COUNT];
+    uint64_t             lock_waits;  // file state locks that weren't free right away
+    uint64_t             lock_wait_ns;
+} readmap_stats_t;
+
+void    readmap_init(void);
+void    readmap_shutdown(void);
+int     readmap_open(const char *pathname, int flags, ...);
+int     readmap_creat(const char *pathname, mode_t mode);
+int     readmap_openat(int dirfd, const char *pathname, int flags, ...);
+int     readmap_close(int fd);
+FILE   *readmap_fopen(const char *pathname, const char *mode);
+FILE   *readmap_fdopen(int fd, const char *mode);
+FILE   *readmap_freopen(const char *pathname, const char *mode, FILE *stream);
+int     readmap_fclose(FILE *stream);
+ssize_t readmap_read(int fd, void *buf, size_t count);
+ssize_t readmap_write(int fd, const void *buf, size_t count);
+off_t   readmap_lseek(int fd, off_t offset, int whence);
+int     readmap_dup(int oldfd);
+int     readmap_dup2(int oldfd, int newfd);
+int     readmap_dup3(int oldfd, int newfd, int flags);
+int     readmap_fcntl(int fd, int cmd, ...);
+int     readmap_fstat(int fd, struct stat *buf);
+int     readmap_ftruncate(int fd, off_t length);
+int     readmap_fallocate(int fd, int mode, off_t offset, off_t length);
+int     readmap_fsync(int fd);
+int     readmap_fdatasync(int fd);
+int     readmap_posix_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *file_actions,
+                            const posix_spawnattr_t *attrp, char *const argv[], char *const envp[]);
+int     readmap_posix_spawnp(pid_t *pid, const char *file, const posix_spawn_file_actions_t *file_actions,
+                             const posix_spawnattr_t *attrp, char *const argv[], char *const envp[]);
+int     readmap_system(const char *command);
+FILE   *readmap_popen(const char *command, const char *type);
+ssize_t readmap_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t readmap_pwrite(int fd, const void *buf, size_t count, off_t offset);
+ssize_t readmap_readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t readmap_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t readmap_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t readmap_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+int     readmap_set_size_interval(int fd, unsigned milliseconds);
+long    readmap_get_page_size(int fd);
+int     readmap_get_access_pattern(int fd);
+ssize_t readmap_read_view(int fd, off_t offset, size_t length, readmap_view_t *view);
+void    readmap_release_view(readmap_view_t *view);
+int     readmap_submit_batch(readmap_batch_request_t *requests, unsigned count);
+int     readmap_async_read(int fd, void *buf, size_t count, off_t offset, void *user_data);
+int     readmap_async_write(int fd, const void *buf, size_t count, off_t offset, void *user_data);
+int     readmap_async_reap(readmap_completion_t *completions, unsigned count, unsigned wait);
+int     readmap_get_stats(readmap_stats_t *stats);
+void    readmap_dump_stats(FILE *file);
+const char *readmap_stats_call_name(int call);
+uint64_t    readmap_stats_bucket_value(unsigned bucket);
+uint64_t    readmap_stats_percentile(const uint64_t *histogram, double percentile);
+
+// what readmap_get_access_pattern() reports
+#define READMAP_ACCESS_UNKNOWN 0
+#define READMAP_ACCESS_SEQUENTIAL 1
+#define READMAP_ACCESS_STRIDED 2
+#define READMAP_ACCESS_RANDOM 3
@@ -0,0 +1,70 @@
+//
+// The layout of the statistics a readmap process publishes in shared memory
+//
+// (C) Copyright 2021 Tony Mason
+// All Rights Reserved
+//
+
+#include <stdint.h>
+
+/*
+ * With READMAP_STATS_SHM set in its environment, a process publishes its statistics (see
+ * readmap_get_stats) in the POSIX shared memory segment READMAP_SHM_PREFIX<pid> (that is,
+ * /dev/shm/readmap.<pid>), refreshed every READMAP_STATS_SHM_INTERVAL_MS milliseconds (one second
+ * by default.)  The segment goes away at readmap_shutdown(); one left behind by a process that
+ * died can be recognized because its pid no longer exists.
+ *
+ * Everything after sequence is protected by it, seqlock style: the publisher makes it odd while
+ * it is updating, and even again once it is done.  So a reader copies the segment, and keeps the
+ * copy if sequence was even and the same before and after.
+ *
+ * Readers should check magic and version, and that size is at least what they expect; new fields
+ * are only ever added at the end.
+ */
+
+#define READMAP_SHM_PREFIX "/readmap."
+#define READMAP_SHM_MAGIC 0x504d4452  // "RDMP"
+#define READMAP_SHM_VERSION 1
+#define READMAP_SHM_CALLS 8  // as READMAP_CALL_COUNT
+#define READMAP_SHM_PATHS 2  // as READMAP_PATH_COUNT
+#define READMAP_SHM_FILES 64
+
+typedef struct readmap_shm_call {
+    uint64_t calls;
+    uint64_t failures;
+    uint64_t count[READMAP_SHM_PATHS];  // mapped hits, native fallbacks
+    uint64_t total_ns[READMAP_SHM_PATHS];
+    uint64_t max_ns[READMAP_SHM_PATHS];
+    uint64_t p50_ns[READMAP_SHM_PATHS];
+    uint64_t p99_ns[READMAP_SHM_PATHS];
+} readmap_shm_call_t;
+
+typedef struct readmap_shm_file {
+    int32_t  fd;
+    int32_t  access_pattern;  // READMAP_ACCESS_xxx
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mapped_bytes;    // currently mapped (the window, for large files)
+    uint64_t served_calls;    // reads and writes done through the mapping
+    uint64_t served_bytes;
+} readmap_shm_file_t;
+
+typedef struct readmap_shm_stats {
+    uint32_t           magic;
+    uint32_t           version;
+    uint32_t           size;  // of this structure
+    uint32_t           pid;
+    uint64_t           sequence;
+    uint64_t           updated_ns;  // CLOCK_REALTIME
+    uint64_t           interval_ns;
+    uint64_t           minor_faults;
+    uint64_t           major_faults;
+    uint64_t           bytes_mapped;
+    uint64_t           lock_waits;
+    uint64_t           lock_wait_ns;
+    readmap_shm_call_t calls[READMAP_SHM_CALLS];
+    uint32_t           file_count;
+    uint32_t           files_omitted;  // open files that didn't fit
+    readmap_shm_file_t files[READMAP_SHM_FILES];
+} readmap_shm_stats_t;
@@ -3,8 +3,16 @@
  */
 
 #include "preload.h"
+#include <stdio.h>
+
+int fclose(FILE *stream);
 
 int close(int fd)
 {
     return readmap_close(fd);
 }
+
+int fclose(FILE *stream)
+{
+    return readmap_fclose(stream);
+}
@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2021, Tony Mason. All rights reserved.
+ */
+
+#include "preload.h"
+
+int dup(int oldfd)
+{
+    return readmap_dup(oldfd);
+}
+
+int dup2(int oldfd, int newfd)
+{
+    return readmap_dup2(oldfd, newfd);
+}
+
+int dup3(int oldfd, int newfd, int flags)
+{
+    return readmap_dup3(oldfd, newfd, flags);
+}
@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2021, Tony Mason. All rights reserved.
+ */
+
+#include "preload.h"
+#include <stdarg.h>
+
+int fcntl(int fd, int cmd, ...)
+{
+    va_list args;
+    void *arg;
+
+    va_start(args, cmd);
+    arg = va_arg(args, void *);
+    va_end(args);
+
+    return readmap_fcntl(fd, cmd, arg);
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2021, Tony Mason. All rights reserved.
+ */
+
+#include "preload.h"
+
+/*
+ * Bring the library up as soon as we are loaded, before the program can open anything, and put
+ * any files it still has open back in order (see readmap_shutdown) on the way out.
+ */
+static void readmap_preload_init(void) __attribute__((constructor));
+static void readmap_preload_fini(void) __attribute__((destructor));
+
+static void readmap_preload_init(void)
+{
+    readmap_init();
+}
+
+static void readmap_preload_fini(void)
+{
+    readmap_shutdown();
+}
@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2021, Tony Mason. All rights reserved.
+ */
+
+#include "preload.h"
+
+off_t lseek(int fd, off_t offset, int whence);
+off64_t lseek64(int fd, off64_t offset, int whence);
+
+off_t lseek(int fd, off_t offset, int whence)
+{
+    return readmap_lseek(fd, offset, whence);
+}
+
+off64_t lseek64(int fd, off64_t offset, int whence)
+{
+    return readmap_lseek(fd, offset, whence);
+}
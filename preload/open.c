@@ -14,6 +14,11 @@ int openat(int dirfd, const char *pathname, int flags, ...);
 FILE *fopen(const char *pathname, const char *mode);
 FILE *fdopen(int fd, const char *mode);
 FILE *freopen(const char *pathname, const char *mode, FILE *stream);
+int open64(const char *pathname, int flags, ...);
+int creat64(const char *pathname, mode_t mode);
+int openat64(int dirfd, const char *pathname, int flags, ...);
+FILE *fopen64(const char *pathname, const char *mode);
+FILE *freopen64(const char *pathname, const char *mode, FILE *stream);
 
 int open(const char *pathname, int flags, ...)
 {
@@ -24,8 +29,6 @@ int open(const char *pathname, int flags, ...)
     mode = va_arg(args, int);
     va_end(args);
 
-    // readmap_preload_init();
-
     return readmap_open(pathname, flags, mode);
 }
 
@@ -60,3 +63,46 @@ FILE *freopen(const char *pathname, const char *mode, FILE *stream)
 {
     return readmap_freopen(pathname, mode, stream);
 }
+
+/*
+ * Programs built with _FILE_OFFSET_BITS=64 call these instead.  Missing one would leave its file
+ * descriptor untracked, and a stale state from an earlier file with that number in place.
+ */
+int open64(const char *pathname, int flags, ...)
+{
+    va_list args;
+    mode_t mode;
+
+    va_start(args, flags);
+    mode = va_arg(args, int);
+    va_end(args);
+
+    return readmap_open(pathname, flags | O_LARGEFILE, mode);
+}
+
+int creat64(const char *pathname, mode_t mode)
+{
+    return readmap_open(pathname, O_CREAT | O_WRONLY | O_TRUNC | O_LARGEFILE, mode);
+}
+
+int openat64(int dirfd, const char *pathname, int flags, ...)
+{
+    va_list args;
+    mode_t mode;
+
+    va_start(args, flags);
+    mode = va_arg(args, int);
+    va_end(args);
+
+    return readmap_openat(dirfd, pathname, flags | O_LARGEFILE, mode);
+}
+
+FILE *fopen64(const char *pathname, const char *mode)
+{
+    return readmap_fopen(pathname, mode);
+}
+
+FILE *freopen64(const char *pathname, const char *mode, FILE *stream)
+{
+    return readmap_freopen(pathname, mode, stream);
+}
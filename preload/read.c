@@ -1,13 +1,44 @@
 
 /*
- * Copyright (c) 2020, Tony Mason. All rights reserved.
+ * Copyright (c) 2020-2021, Tony Mason. All rights reserved.
  */
 
 #include "preload.h"
+#include <sys/uio.h>
 
 ssize_t read(int fd, void *buf, size_t count);
+ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset);
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t preadv64(int fd, const struct iovec *iov, int iovcnt, off64_t offset);
 
-void todo_read(void);
-void todo_read(void)
+ssize_t read(int fd, void *buf, size_t count)
 {
+    return readmap_read(fd, buf, count);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+    return readmap_pread(fd, buf, count, offset);
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset)
+{
+    return readmap_pread(fd, buf, count, offset);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    return readmap_readv(fd, iov, iovcnt);
+}
+
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    return readmap_preadv(fd, iov, iovcnt, offset);
+}
+
+ssize_t preadv64(int fd, const struct iovec *iov, int iovcnt, off64_t offset)
+{
+    return readmap_preadv(fd, iov, iovcnt, offset);
 }
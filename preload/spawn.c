@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2021, Tony Mason. All rights reserved.
+ */
+
+#include "preload.h"
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int posix_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *file_actions, const posix_spawnattr_t *attrp,
+                char *const argv[], char *const envp[]);
+int posix_spawnp(pid_t *pid, const char *file, const posix_spawn_file_actions_t *file_actions, const posix_spawnattr_t *attrp,
+                 char *const argv[], char *const envp[]);
+int system(const char *command);
+FILE *popen(const char *command, const char *type);
+
+int posix_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *file_actions, const posix_spawnattr_t *attrp,
+                char *const argv[], char *const envp[])
+{
+    return readmap_posix_spawn(pid, path, file_actions, attrp, argv, envp);
+}
+
+int posix_spawnp(pid_t *pid, const char *file, const posix_spawn_file_actions_t *file_actions, const posix_spawnattr_t *attrp,
+                 char *const argv[], char *const envp[])
+{
+    return readmap_posix_spawnp(pid, file, file_actions, attrp, argv, envp);
+}
+
+int system(const char *command)
+{
+    return readmap_system(command);
+}
+
+FILE *popen(const char *command, const char *type)
+{
+    return readmap_popen(command, type);
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2021, Tony Mason. All rights reserved.
+ */
+
+#include "preload.h"
+#include <stddef.h>
+
+int fstat(int fd, struct stat *buf);
+int fstat64(int fd, struct stat64 *buf);
+
+int fstat(int fd, struct stat *buf)
+{
+    return readmap_fstat(fd, buf);
+}
+
+/*
+ * Where off_t is 64 bits (LP64, or _FILE_OFFSET_BITS=64) struct stat64 is laid out just like
+ * struct stat, so the one can be filled in as the other.  Anywhere else, rather than hand back a
+ * mangled structure, the build stops here (and fstat64 would have to convert field by field.)
+ */
+_Static_assert(sizeof(struct stat) == sizeof(struct stat64), "struct stat64 differs from struct stat");
+_Static_assert(offsetof(struct stat, st_size) == offsetof(struct stat64, st_size), "struct stat64 differs from struct stat");
+
+int fstat64(int fd, struct stat64 *buf)
+{
+    return readmap_fstat(fd, (struct stat *)buf);
+}
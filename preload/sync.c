@@ -0,0 +1,15 @@
+/*
+ * Copyright (c) 2021, Tony Mason. All rights reserved.
+ */
+
+#include "preload.h"
+
+int fsync(int fd)
+{
+    return readmap_fsync(fd);
+}
+
+int fdatasync(int fd)
+{
+    return readmap_fdatasync(fd);
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2021, Tony Mason. All rights reserved.
+ */
+
+#include "preload.h"
+
+int ftruncate(int fd, off_t length);
+int ftruncate64(int fd, off64_t length);
+int fallocate(int fd, int mode, off_t offset, off_t len);
+int fallocate64(int fd, int mode, off64_t offset, off64_t len);
+
+int ftruncate(int fd, off_t length)
+{
+    return readmap_ftruncate(fd, length);
+}
+
+int ftruncate64(int fd, off64_t length)
+{
+    return readmap_ftruncate(fd, length);
+}
+
+int fallocate(int fd, int mode, off_t offset, off_t len)
+{
+    return readmap_fallocate(fd, mode, offset, len);
+}
+
+int fallocate64(int fd, int mode, off64_t offset, off64_t len)
+{
+    return readmap_fallocate(fd, mode, offset, len);
+}
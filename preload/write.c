@@ -1,15 +1,46 @@
 
 /*
- * Copyright (c) 2020, Tony Mason. All rights reserved.
+ * Copyright (c) 2020-2021, Tony Mason. All rights reserved.
  */
 
 #include "preload.h"
 #include <fcntl.h> /* Definition of AT_* constants */
+#include <sys/uio.h>
 #include <unistd.h>
 
 ssize_t write(int fd, const void *buf, size_t count);
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset);
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset);
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t pwritev64(int fd, const struct iovec *iov, int iovcnt, off64_t offset);
 
-void todo_write(void);
-void todo_write(void)
+ssize_t write(int fd, const void *buf, size_t count)
 {
+    return readmap_write(fd, buf, count);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    return readmap_pwrite(fd, buf, count, offset);
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset)
+{
+    return readmap_pwrite(fd, buf, count, offset);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    return readmap_writev(fd, iov, iovcnt);
+}
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    return readmap_pwritev(fd, iov, iovcnt, offset);
+}
+
+ssize_t pwritev64(int fd, const struct iovec *iov, int iovcnt, off64_t offset)
+{
+    return readmap_pwritev(fd, iov, iovcnt, offset);
 }
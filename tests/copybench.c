@@ -0,0 +1,119 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+/*
+ * Compare the copy kernels (copy.c) with the C library's memcpy across a range of sizes.
+ *
+ * For each size and kernel this reports the copy bandwidth, and how long it then takes to walk
+ * a small "working set" buffer that was warm before the copy; a copy that pushes the working
+ * set out of the cache makes that walk slower.
+ *
+ *     copybench [total bytes per measurement]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "api-internal.h"
+
+#define SOURCE_SIZE ((size_t)256 * 1024 * 1024)
+#define WORKING_SET_SIZE ((size_t)1024 * 1024)
+
+static const char *kernels[] = {"memcpy", "sse2", "avx2", "avx512", NULL};
+static volatile uint64_t sink;  // keeps the walks from being optimized away
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static uint64_t walk(const volatile uint64_t *buffer, size_t length)
+{
+    uint64_t sum = 0;
+
+    for (size_t index = 0; index < length / sizeof(uint64_t); index += 8) {
+        sum += buffer[index];
+    }
+
+    return sum;
+}
+
+int main(int argc, char **argv)
+{
+    size_t    total = (argc > 1) ? strtoull(argv[1], NULL, 0) : ((size_t)1024 * 1024 * 1024);
+    char *    source;
+    char *    destination;
+    uint64_t *working_set;
+
+    readmap_init_copy();
+
+    source      = aligned_alloc(4096, SOURCE_SIZE);
+    destination = aligned_alloc(4096, SOURCE_SIZE);
+    working_set = aligned_alloc(4096, WORKING_SET_SIZE);
+    if ((NULL == source) || (NULL == destination) || (NULL == working_set)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    memset(source, 0x5a, SOURCE_SIZE);
+    memset(destination, 0, SOURCE_SIZE);
+    memset(working_set, 1, WORKING_SET_SIZE);
+
+    printf("default kernel %s\n", readmap_copy_kernel_name());
+    printf("%10s %8s %10s %14s\n", "size", "kernel", "GB/s", "ws walk (us)");
+
+    for (size_t size = 4096; size <= (size_t)64 * 1024 * 1024; size *= 4) {
+        for (const char **kernel = kernels; NULL != *kernel; kernel++) {
+            size_t iterations = total / size;
+            size_t offset     = 0;
+            double start;
+            double copy_time;
+            double walk_time = 0;
+
+            if (0 != readmap_copy_set_kernel(*kernel)) {
+                continue;  // not on this CPU
+            }
+            readmap_copy_set_threshold(0);  // always use it
+
+            if (0 == iterations) {
+                iterations = 1;
+            }
+
+            start = now();
+            for (size_t iteration = 0; iteration < iterations; iteration++) {
+                readmap_copy(destination + offset, source + offset, size);
+                offset += size;
+                if (offset + size > SOURCE_SIZE) {
+                    offset = 0;
+                }
+            }
+            copy_time = now() - start;
+
+            // now see what a copy does to a working set that was in the cache
+            for (unsigned pass = 0; pass < 16; pass++) {
+                sink += walk(working_set, WORKING_SET_SIZE);
+                readmap_copy(destination, source + ((pass * size) % (SOURCE_SIZE - size)), size);
+                start = now();
+                sink += walk(working_set, WORKING_SET_SIZE);
+                walk_time += now() - start;
+            }
+
+            printf("%10zu %8s %10.2f %14.2f\n", size, *kernel, (iterations * size) / copy_time / 1e9, walk_time * 1e6 / 16);
+        }
+    }
+
+    free(source);
+    free(destination);
+    free(working_set);
+
+    return 0;
+}
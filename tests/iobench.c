@@ -0,0 +1,421 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+/*
+ * Compare I/O through readmap with the same I/O done by the C library.
+ *
+ * Every combination of API (readmap, native), operation (read, pread, write), access pattern
+ * (sequential, random), block size (powers of four from -b to -B) and thread count (powers of two
+ * up to -t) is run for -T milliseconds against one file of -s bytes in -d.  Each thread opens the
+ * file itself; sequential threads start at evenly spaced offsets, and "random" read and write
+ * calls are preceded by an lseek (which is timed along with them.)
+ *
+ * The results go to stdout (or -o) as JSON, with progress on stderr:
+ *
+ *     { "file_size": ..., "duration_ms": ..., "results": [
+ *         { "api": "readmap", "op": "pread", "pattern": "random", "block_size": 4096, "threads": 4,
+ *           "ops": ..., "bytes": ..., "seconds": ..., "ops_per_second": ..., "mb_per_second": ...,
+ *           "p50_ns": ..., "p99_ns": ..., "max_ns": ... }, ... ] }
+ *
+ *     iobench [-d directory] [-s file size] [-b min block] [-B max block] [-t max threads]
+ *             [-T milliseconds] [-o output]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "readmapapi.h"
+
+typedef struct bench_api {
+    const char *name;
+    int (*open)(const char *pathname, int flags, ...);
+    int (*close)(int fd);
+    ssize_t (*read)(int fd, void *buf, size_t count);
+    ssize_t (*write)(int fd, const void *buf, size_t count);
+    ssize_t (*pread)(int fd, void *buf, size_t count, off_t offset);
+    off_t (*lseek)(int fd, off_t offset, int whence);
+} bench_api_t;
+
+typedef enum bench_op {
+    BENCH_READ,
+    BENCH_PREAD,
+    BENCH_WRITE,
+    BENCH_OP_COUNT,
+} bench_op_t;
+
+typedef struct bench_run {
+    const bench_api_t *api;
+    bench_op_t         op;
+    int                random;
+    size_t             block_size;
+    unsigned           threads;
+} bench_run_t;
+
+typedef struct bench_thread {
+    pthread_t          thread;
+    const bench_run_t *run;
+    unsigned           index;
+    int                failed;
+    uint64_t           ops;
+    uint64_t           bytes;
+    uint64_t           elapsed_ns;
+    uint64_t           max_ns;
+    uint64_t           histogram[READMAP_STATS_BUCKETS];
+} bench_thread_t;
+
+static const bench_api_t apis[] = {
+    {"readmap", readmap_open, readmap_close, readmap_read, readmap_write, readmap_pread, readmap_lseek},
+    {"native", open, close, read, write, pread, lseek},
+};
+
+static const char *op_names[BENCH_OP_COUNT] = {"read", "pread", "write"};
+
+static char *            file_name;
+static size_t            file_size = (size_t)256 * 1024 * 1024;
+static uint64_t          duration  = (uint64_t)250 * 1000 * 1000;  // ns
+static pthread_barrier_t start_barrier;
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 * 1000 * 1000) + ts.tv_nsec;
+}
+
+/*
+ * The histogram is the library's (see readmap_stats_percentile): find the last bucket starting
+ * at or below ns.
+ */
+static unsigned bench_bucket(uint64_t ns)
+{
+    unsigned low  = 0;
+    unsigned high = READMAP_STATS_BUCKETS - 1;
+    unsigned middle;
+
+    while (low < high) {
+        middle = (low + high + 1) / 2;
+        if (readmap_stats_bucket_value(middle) <= ns) {
+            low = middle;
+        }
+        else {
+            high = middle - 1;
+        }
+    }
+
+    return low;
+}
+
+static uint64_t bench_random(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+
+    return x;
+}
+
+static void *bench_thread(void *arg)
+{
+    bench_thread_t *   thread = (bench_thread_t *)arg;
+    const bench_run_t *run    = thread->run;
+    const bench_api_t *api    = run->api;
+    const size_t       block  = run->block_size;
+    const size_t       blocks = file_size / block;
+    uint64_t           seed   = 0x9e3779b97f4a7c15ULL * (thread->index + 1);
+    off_t              offset = (off_t)((blocks * thread->index) / run->threads) * block;
+    uint64_t           start;
+    uint64_t           end;
+    uint64_t           before;
+    uint64_t           elapsed;
+    ssize_t            result;
+    char *             buffer;
+    int                fd;
+
+    buffer = aligned_alloc(4096, (block + 4095) & ~(size_t)4095);
+    fd     = api->open(file_name, (BENCH_WRITE == run->op) ? O_RDWR : O_RDONLY);
+    if ((NULL == buffer) || (fd < 0) || (offset != api->lseek(fd, offset, SEEK_SET))) {
+        thread->failed = 1;
+    }
+    if (NULL != buffer) {
+        memset(buffer, 0x5a, block);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+
+    start = now();
+    end   = start + duration;
+    while (!thread->failed) {
+        if (run->random) {
+            offset = (off_t)(bench_random(&seed) % blocks) * block;
+        }
+        else if ((size_t)offset + block > file_size) {
+            offset = 0;
+            if ((BENCH_PREAD != run->op) && (0 != api->lseek(fd, 0, SEEK_SET))) {
+                thread->failed = 1;
+                break;
+            }
+        }
+
+        before = now();
+        switch (run->op) {
+        case BENCH_READ:
+            if (run->random) {
+                (void)api->lseek(fd, offset, SEEK_SET);
+            }
+            result = api->read(fd, buffer, block);
+            break;
+        case BENCH_PREAD:
+            result = api->pread(fd, buffer, block, offset);
+            break;
+        case BENCH_WRITE:
+            if (run->random) {
+                (void)api->lseek(fd, offset, SEEK_SET);
+            }
+            result = api->write(fd, buffer, block);
+            break;
+        default:
+            result = -1;
+            break;
+        }
+        elapsed = now() - before;
+
+        if ((ssize_t)block != result) {
+            thread->failed = 1;
+            break;
+        }
+
+        offset += block;
+        thread->ops++;
+        thread->bytes += block;
+        thread->histogram[bench_bucket(elapsed)]++;
+        if (elapsed > thread->max_ns) {
+            thread->max_ns = elapsed;
+        }
+
+        if (before + elapsed >= end) {
+            break;
+        }
+    }
+    thread->elapsed_ns = now() - start;
+
+    if (fd >= 0) {
+        api->close(fd);
+    }
+    free(buffer);
+
+    return NULL;
+}
+
+static int bench_make_file(const char *directory)
+{
+    char * buffer;
+    size_t done = 0;
+    int    fd;
+
+    file_name = malloc(strlen(directory) + 32);
+    buffer    = malloc(1024 * 1024);
+    if ((NULL == file_name) || (NULL == buffer)) {
+        return -1;
+    }
+    sprintf(file_name, "%s/iobench.XXXXXX", directory);
+    fd = mkstemp(file_name);
+    if (fd < 0) {
+        return -1;
+    }
+
+    for (size_t index = 0; index < 1024 * 1024; index++) {
+        buffer[index] = (char)index;
+    }
+    while (done < file_size) {
+        size_t  length = (file_size - done < 1024 * 1024) ? file_size - done : 1024 * 1024;
+        ssize_t written = write(fd, buffer, length);
+
+        if (written <= 0) {
+            close(fd);
+            return -1;
+        }
+        done += written;
+    }
+    (void)fsync(fd);
+    close(fd);
+    free(buffer);
+
+    return 0;
+}
+
+static int bench_run(const bench_run_t *run, FILE *output, int first)
+{
+    bench_thread_t *threads;
+    uint64_t        histogram[READMAP_STATS_BUCKETS];
+    uint64_t        ops     = 0;
+    uint64_t        bytes   = 0;
+    uint64_t        elapsed = 0;
+    uint64_t        max_ns  = 0;
+    double          seconds;
+    int             failed = 0;
+
+    threads = calloc(run->threads, sizeof(bench_thread_t));
+    if (NULL == threads) {
+        return -1;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, run->threads);
+    for (unsigned index = 0; index < run->threads; index++) {
+        threads[index].run   = run;
+        threads[index].index = index;
+        if (0 != pthread_create(&threads[index].thread, NULL, bench_thread, &threads[index])) {
+            fprintf(stderr, "iobench: can't create threads\n");
+            exit(1);
+        }
+    }
+
+    memset(histogram, 0, sizeof(histogram));
+    for (unsigned index = 0; index < run->threads; index++) {
+        pthread_join(threads[index].thread, NULL);
+        failed |= threads[index].failed;
+        ops += threads[index].ops;
+        bytes += threads[index].bytes;
+        if (threads[index].elapsed_ns > elapsed) {
+            elapsed = threads[index].elapsed_ns;
+        }
+        if (threads[index].max_ns > max_ns) {
+            max_ns = threads[index].max_ns;
+        }
+        for (unsigned bucket = 0; bucket < READMAP_STATS_BUCKETS; bucket++) {
+            histogram[bucket] += threads[index].histogram[bucket];
+        }
+    }
+    pthread_barrier_destroy(&start_barrier);
+    free(threads);
+
+    if (failed) {
+        fprintf(stderr, "iobench: %s %s failed\n", run->api->name, op_names[run->op]);
+        return -1;
+    }
+
+    seconds = elapsed / 1e9;
+    fprintf(output,
+            "%s    {\"api\": \"%s\", \"op\": \"%s\", \"pattern\": \"%s\", \"block_size\": %zu, \"threads\": %u, "
+            "\"ops\": %lu, \"bytes\": %lu, \"seconds\": %.6f, \"ops_per_second\": %.1f, \"mb_per_second\": %.2f, "
+            "\"p50_ns\": %lu, \"p99_ns\": %lu, \"max_ns\": %lu}",
+            first ? "" : ",\n", run->api->name, op_names[run->op], run->random ? "random" : "sequential", run->block_size,
+            run->threads, (unsigned long)ops, (unsigned long)bytes, seconds, ops / seconds,
+            bytes / seconds / (1024 * 1024), (unsigned long)readmap_stats_percentile(histogram, 50),
+            (unsigned long)readmap_stats_percentile(histogram, 99), (unsigned long)max_ns);
+    fflush(output);
+
+    fprintf(stderr, "%-8s %-6s %-10s %9zu %3u %12.1f ops/s %10.2f MB/s\n", run->api->name, op_names[run->op],
+            run->random ? "random" : "sequential", run->block_size, run->threads, ops / seconds,
+            bytes / seconds / (1024 * 1024));
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *directory   = "/tmp";
+    FILE *      output      = stdout;
+    size_t      min_block   = 64;
+    size_t      max_block   = (size_t)16 * 1024 * 1024;
+    long        cpus        = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned    max_threads = (cpus > 8) ? 8 : ((cpus > 0) ? cpus : 1);
+    bench_run_t run;
+    int         first  = 1;
+    int         status = 0;
+    int         option;
+
+    while (-1 != (option = getopt(argc, argv, "d:s:b:B:t:T:o:"))) {
+        switch (option) {
+        case 'd':
+            directory = optarg;
+            break;
+        case 's':
+            file_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            min_block = strtoull(optarg, NULL, 0);
+            break;
+        case 'B':
+            max_block = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            max_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'T':
+            duration = strtoull(optarg, NULL, 0) * 1000 * 1000;
+            break;
+        case 'o':
+            output = fopen(optarg, "w");
+            if (NULL == output) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s [-d directory] [-s file size] [-b min block] [-B max block] [-t max threads] "
+                    "[-T milliseconds] [-o output]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if ((0 == min_block) || (0 == max_threads) || (max_block > file_size)) {
+        fprintf(stderr, "iobench: blocks must fit in the file, and there must be a thread\n");
+        return 1;
+    }
+
+    readmap_init();
+
+    if (0 != bench_make_file(directory)) {
+        perror("iobench: creating the test file");
+        return 1;
+    }
+
+    fprintf(output, "{\"file_size\": %zu, \"duration_ms\": %lu, \"results\": [\n", file_size,
+            (unsigned long)(duration / (1000 * 1000)));
+
+    for (unsigned api = 0; api < sizeof(apis) / sizeof(apis[0]); api++) {
+        run.api = &apis[api];
+        for (unsigned op = 0; op < BENCH_OP_COUNT; op++) {
+            run.op = (bench_op_t)op;
+            for (run.random = 0; run.random < 2; run.random++) {
+                for (run.block_size = min_block; run.block_size <= max_block; run.block_size *= 4) {
+                    for (run.threads = 1; run.threads <= max_threads; run.threads *= 2) {
+                        if (0 != bench_run(&run, output, first)) {
+                            status = 1;
+                            continue;
+                        }
+                        first = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    fprintf(output, "\n]}\n");
+    if (stdout != output) {
+        fclose(output);
+    }
+
+    unlink(file_name);
+    free(file_name);
+    readmap_shutdown();
+
+    return status;
+}
@@ -0,0 +1,440 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+/*
+ * How the lookup structures scale with threads.
+ *
+ * Each run fills a table with -n entries and then has 1, 2, 4, ... -t threads look up, insert and
+ * remove entries for -T milliseconds.  Lookups pick any key (so they miss when its owner has
+ * removed it); each thread owns every threads'th key, and updates toggle one of its own keys in or
+ * out of the table.  The mixes are all lookups, 90% lookups and half lookups.
+ *
+ * The tables are the generic hash table (lookuptable.c, with -b buckets) and the file state
+ * manager's fd table (fdmgr.c), which needs a real file descriptor for each entry, so it gets as
+ * many as RLIMIT_NOFILE allows.  Its inserts include the fstat() that creating a file state does.
+ *
+ * Results go to stdout (or -o) as JSON, one entry per run, with ops/second and latency percentiles.
+ *
+ *     tablebench [-n entries] [-b buckets] [-t max threads] [-T milliseconds] [-o output]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "api-internal.h"
+#include "lookuptable.h"
+
+typedef struct bench_table {
+    const char *name;
+    unsigned (*setup)(unsigned entries);  // returns how many entries it can hold
+    int (*insert)(unsigned key);
+    int (*lookup)(unsigned key);
+    int (*remove)(unsigned key);
+    void (*teardown)(void);
+} bench_table_t;
+
+typedef struct bench_thread {
+    pthread_t thread;
+    unsigned  index;
+    unsigned  threads;
+    unsigned  lookup_percent;
+    uint64_t  lookups;
+    uint64_t  inserts;
+    uint64_t  removes;
+    uint64_t  elapsed_ns;
+    uint64_t  max_ns;
+    uint64_t  histogram[READMAP_STATS_BUCKETS];
+} bench_thread_t;
+
+static const bench_table_t *table;
+static unsigned             entries  = 65536;
+static unsigned             buckets  = 4096;
+static uint64_t             duration = (uint64_t)250 * 1000 * 1000;  // ns
+static unsigned char *      present;  // each key is only changed by the thread that owns it
+static pthread_barrier_t    start_barrier;
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 * 1000 * 1000) + ts.tv_nsec;
+}
+
+/* the last of the library's histogram buckets (see readmap_stats_percentile) starting at or below ns */
+static unsigned bench_bucket(uint64_t ns)
+{
+    unsigned low  = 0;
+    unsigned high = READMAP_STATS_BUCKETS - 1;
+    unsigned middle;
+
+    while (low < high) {
+        middle = (low + high + 1) / 2;
+        if (readmap_stats_bucket_value(middle) <= ns) {
+            low = middle;
+        }
+        else {
+            high = middle - 1;
+        }
+    }
+
+    return low;
+}
+
+static uint64_t bench_random(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+
+    return x;
+}
+
+/* lookuptable.c */
+static lookup_table_t *hash_table;
+
+static unsigned hash_setup(unsigned count)
+{
+    hash_table = lookup_table_create(buckets, "bench", NULL, sizeof(unsigned));
+    return (NULL == hash_table) ? 0 : count;
+}
+
+static int hash_insert(unsigned key)
+{
+    return lookup_table_insert(hash_table, &key, (void *)(uintptr_t)(key + 1));
+}
+
+static int hash_lookup(unsigned key)
+{
+    void *object;
+
+    return lookup_table_lookup(hash_table, &key, &object);
+}
+
+static int hash_remove(unsigned key)
+{
+    return lookup_table_remove(hash_table, &key);
+}
+
+static void hash_teardown(void)
+{
+    lookup_table_destroy(hash_table);
+    hash_table = NULL;
+}
+
+/* fdmgr.c */
+static char     fd_file_name[] = "/tmp/tablebench.XXXXXX";
+static int *    fds;
+static unsigned fd_count;
+
+static unsigned fd_setup(unsigned count)
+{
+    struct rlimit limit;
+    int           fd;
+
+    if (0 == getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &limit);
+        (void)getrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur < count + 64) {
+            count = (limit.rlim_cur > 64) ? limit.rlim_cur - 64 : 0;
+        }
+    }
+
+    fd = mkstemp(fd_file_name);
+    fds = calloc(count, sizeof(int));
+    if ((fd < 0) || (NULL == fds)) {
+        return 0;
+    }
+    close(fd);
+
+    for (fd_count = 0; fd_count < count; fd_count++) {
+        fds[fd_count] = open(fd_file_name, O_RDONLY);
+        if (fds[fd_count] < 0) {
+            break;
+        }
+    }
+
+    return fd_count;
+}
+
+static int fd_insert(unsigned key)
+{
+    return (NULL == readmap_create_file_state(fds[key], fd_file_name, O_RDONLY)) ? ENOMEM : 0;
+}
+
+static int fd_lookup(unsigned key)
+{
+    readmap_file_state_t *file_state = readmap_lookup_file_state(fds[key]);
+
+    if (NULL == file_state) {
+        return ENODATA;
+    }
+    readmap_release_file_state(file_state);
+
+    return 0;
+}
+
+static int fd_remove(unsigned key)
+{
+    readmap_file_state_t *file_state = readmap_lookup_file_state(fds[key]);
+
+    if (NULL == file_state) {
+        return ENODATA;
+    }
+    readmap_delete_file_state(file_state);
+    readmap_release_file_state(file_state);
+
+    return 0;
+}
+
+static void fd_teardown(void)
+{
+    for (unsigned index = 0; index < fd_count; index++) {
+        close(fds[index]);
+    }
+    free(fds);
+    fds      = NULL;
+    fd_count = 0;
+    unlink(fd_file_name);
+    strcpy(fd_file_name, "/tmp/tablebench.XXXXXX");
+}
+
+static const bench_table_t tables[] = {
+    {"lookup_table", hash_setup, hash_insert, hash_lookup, hash_remove, hash_teardown},
+    {"fd_table", fd_setup, fd_insert, fd_lookup, fd_remove, fd_teardown},
+};
+
+static const unsigned mixes[] = {100, 90, 50};  // percent lookups
+
+static void *bench_thread(void *arg)
+{
+    bench_thread_t *thread = (bench_thread_t *)arg;
+    const unsigned  owned  = (entries - thread->index + thread->threads - 1) / thread->threads;
+    uint64_t        seed   = 0x9e3779b97f4a7c15ULL * (thread->index + 1);
+    uint64_t        start;
+    uint64_t        end;
+    uint64_t        before;
+    uint64_t        elapsed;
+    uint64_t        choice;
+    unsigned        key;
+    int             result;
+
+    pthread_barrier_wait(&start_barrier);
+
+    start = now();
+    end   = start + duration;
+    while (1) {
+        choice = bench_random(&seed);
+
+        if ((0 == owned) || ((choice % 100) < thread->lookup_percent)) {
+            key    = (choice >> 8) % entries;
+            before = now();
+            (void)table->lookup(key);
+            elapsed = now() - before;
+            thread->lookups++;
+        }
+        else {
+            key    = thread->index + ((choice >> 8) % owned) * thread->threads;
+            before = now();
+            if (present[key]) {
+                result = table->remove(key);
+                thread->removes++;
+            }
+            else {
+                result = table->insert(key);
+                thread->inserts++;
+            }
+            elapsed = now() - before;
+            if (0 == result) {
+                present[key] = !present[key];
+            }
+        }
+
+        thread->histogram[bench_bucket(elapsed)]++;
+        if (elapsed > thread->max_ns) {
+            thread->max_ns = elapsed;
+        }
+
+        if (before + elapsed >= end) {
+            break;
+        }
+    }
+    thread->elapsed_ns = now() - start;
+
+    return NULL;
+}
+
+static int bench_run(unsigned threads, unsigned lookup_percent, FILE *output, int first)
+{
+    bench_thread_t *workers;
+    uint64_t        histogram[READMAP_STATS_BUCKETS];
+    uint64_t        lookups = 0;
+    uint64_t        inserts = 0;
+    uint64_t        removes = 0;
+    uint64_t        elapsed = 0;
+    uint64_t        max_ns  = 0;
+    uint64_t        ops;
+    double          seconds;
+
+    workers = calloc(threads, sizeof(bench_thread_t));
+    if (NULL == workers) {
+        return ENOMEM;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, threads);
+    for (unsigned index = 0; index < threads; index++) {
+        workers[index].index          = index;
+        workers[index].threads        = threads;
+        workers[index].lookup_percent = lookup_percent;
+        if (0 != pthread_create(&workers[index].thread, NULL, bench_thread, &workers[index])) {
+            fprintf(stderr, "tablebench: can't create threads\n");
+            exit(1);
+        }
+    }
+
+    memset(histogram, 0, sizeof(histogram));
+    for (unsigned index = 0; index < threads; index++) {
+        pthread_join(workers[index].thread, NULL);
+        lookups += workers[index].lookups;
+        inserts += workers[index].inserts;
+        removes += workers[index].removes;
+        if (workers[index].elapsed_ns > elapsed) {
+            elapsed = workers[index].elapsed_ns;
+        }
+        if (workers[index].max_ns > max_ns) {
+            max_ns = workers[index].max_ns;
+        }
+        for (unsigned bucket = 0; bucket < READMAP_STATS_BUCKETS; bucket++) {
+            histogram[bucket] += workers[index].histogram[bucket];
+        }
+    }
+    pthread_barrier_destroy(&start_barrier);
+    free(workers);
+
+    ops     = lookups + inserts + removes;
+    seconds = elapsed / 1e9;
+    fprintf(output,
+            "%s    {\"table\": \"%s\", \"entries\": %u, \"buckets\": %u, \"lookup_percent\": %u, \"threads\": %u, "
+            "\"ops\": %lu, \"lookups\": %lu, \"inserts\": %lu, \"removes\": %lu, \"seconds\": %.6f, "
+            "\"ops_per_second\": %.1f, \"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}",
+            first ? "" : ",\n", table->name, entries, buckets, lookup_percent, threads, (unsigned long)ops,
+            (unsigned long)lookups, (unsigned long)inserts, (unsigned long)removes, seconds, ops / seconds,
+            (unsigned long)readmap_stats_percentile(histogram, 50), (unsigned long)readmap_stats_percentile(histogram, 99),
+            (unsigned long)readmap_stats_percentile(histogram, 99.9), (unsigned long)max_ns);
+    fflush(output);
+
+    fprintf(stderr, "%-12s %3u%% lookups %4u threads %14.1f ops/s p99 %8lu ns\n", table->name, lookup_percent, threads,
+            ops / seconds, (unsigned long)readmap_stats_percentile(histogram, 99));
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *   output      = stdout;
+    unsigned max_threads = 128;
+    unsigned requested;
+    int      first  = 1;
+    int      status = 0;
+    int      option;
+
+    while (-1 != (option = getopt(argc, argv, "n:b:t:T:o:"))) {
+        switch (option) {
+        case 'n':
+            entries = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            buckets = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            max_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'T':
+            duration = strtoull(optarg, NULL, 0) * 1000 * 1000;
+            break;
+        case 'o':
+            output = fopen(optarg, "w");
+            if (NULL == output) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n entries] [-b buckets] [-t max threads] [-T milliseconds] [-o output]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if ((0 == entries) || (0 == max_threads)) {
+        fprintf(stderr, "tablebench: there must be entries and threads\n");
+        return 1;
+    }
+
+    readmap_init();
+    requested = entries;
+
+    fprintf(output, "{\"duration_ms\": %lu, \"results\": [\n", (unsigned long)(duration / (1000 * 1000)));
+
+    for (unsigned index = 0; index < sizeof(tables) / sizeof(tables[0]); index++) {
+        table   = &tables[index];
+        entries = table->setup(requested);
+        present = calloc(entries, 1);
+        if ((0 == entries) || (NULL == present)) {
+            fprintf(stderr, "tablebench: can't set up %s\n", table->name);
+            status = 1;
+            free(present);
+            continue;
+        }
+        if (entries < requested) {
+            fprintf(stderr, "tablebench: %s is limited to %u entries\n", table->name, entries);
+        }
+
+        for (unsigned mix = 0; mix < sizeof(mixes) / sizeof(mixes[0]); mix++) {
+            // start each mix with a full table
+            for (unsigned key = 0; key < entries; key++) {
+                if (!present[key] && (0 == table->insert(key))) {
+                    present[key] = 1;
+                }
+            }
+
+            for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+                if (0 != bench_run(threads, mixes[mix], output, first)) {
+                    status = 1;
+                    continue;
+                }
+                first = 0;
+            }
+        }
+
+        for (unsigned key = 0; key < entries; key++) {
+            if (present[key]) {
+                (void)table->remove(key);
+            }
+        }
+        table->teardown();
+        free(present);
+        present = NULL;
+    }
+
+    fprintf(output, "\n]}\n");
+    if (stdout != output) {
+        fclose(output);
+    }
+
+    readmap_shutdown();
+
+    return status;
+}
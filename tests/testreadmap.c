@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,9 +17,12 @@
 #include <sys/random.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include "lookuptable.h"
 #include "munit.h"
 #include "readmap_test.h"
+#include "readmapshm.h"
 
 #if !defined(__notused)
 #define __notused __attribute__((unused))
@@ -69,9 +73,1727 @@ static MunitResult test_open(const MunitParameter params[] __notused, void *prv
     return MUNIT_OK;
 }
 
+/*
+ * Fill the file open on fd with a known pattern.
+ */
+static void fill_test_file(int fd, size_t size)
+{
+
+    for (size_t index = 0; index < size; index += sizeof(uint32_t)) {
+        uint32_t value = (uint32_t)index;
+
+        munit_assert(sizeof(value) == write(fd, &value, sizeof(value)));
+    }
+    munit_assert(0 == ftruncate(fd, size));
+}
+
+/*
+ * Create a test file of the given size, filled with a known pattern.  The caller owns the
+ * returned name.
+ */
+static char *make_test_file(size_t size)
+{
+    char        tempdir[sizeof(dir_template) + 1];
+    char *      tmpname;
+    struct stat st;
+    int         status;
+    int         fd;
+
+    status = stat(TEMPDIR, &st);
+
+    if ((status < 0) && (ENOENT == errno)) {
+        status = mkdir(TEMPDIR, 0700);
+        munit_assert(0 == status);
+    }
+    strcpy(tempdir, dir_template);
+    munit_assert(NULL != mkdtemp(tempdir));
+
+    tmpname = malloc(strlen(tempdir) + 8);
+    munit_assert(NULL != tmpname);
+    strcpy(tmpname, tempdir);
+    strcat(tmpname, "/XXXXXX");
+
+    fd = mkstemp(tmpname);
+    munit_assert(fd >= 0);
+    fill_test_file(fd, size);
+    close(fd);
+
+    return tmpname;
+}
+
+static void check_pattern(const void *buffer, size_t offset, size_t length)
+{
+    const unsigned char *data = (const unsigned char *)buffer;
+
+    for (size_t index = 0; index < length; index++) {
+        uint32_t value = (uint32_t)((offset + index) & ~(sizeof(uint32_t) - 1));
+
+        munit_assert(data[index] == ((const unsigned char *)&value)[(offset + index) % sizeof(uint32_t)]);
+    }
+}
+
+static MunitResult test_read(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t  file_size = (1024 * 1024) + 17;
+    char *        tmpname;
+    char          buffer[1000];
+    ssize_t       bytes_read;
+    size_t        total = 0;
+    int           fd;
+
+    readmap_init();
+    tmpname = make_test_file(file_size);
+
+    fd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd >= 0);
+
+    while (0 < (bytes_read = readmap_read(fd, buffer, sizeof(buffer)))) {
+        check_pattern(buffer, total, bytes_read);
+        total += bytes_read;
+    }
+    munit_assert(0 == bytes_read);
+    munit_assert(file_size == total);
+
+    // the kernel's notion of the offset must agree with ours
+    munit_assert(file_size == readmap_lseek(fd, 0, SEEK_CUR));
+    munit_assert(4093 == readmap_lseek(fd, 4093, SEEK_SET));
+    munit_assert(sizeof(buffer) == readmap_read(fd, buffer, sizeof(buffer)));
+    check_pattern(buffer, 4093, sizeof(buffer));
+
+    munit_assert(0 == readmap_close(fd));
+    unlink(tmpname);
+    free(tmpname);
+
+    readmap_shutdown();
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_write(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t record_count = 100000;
+    char *       tmpname;
+    char         record[37];
+    char         buffer[sizeof(record)];
+    struct stat  st;
+    int          fd;
+
+    readmap_init();
+    tmpname = make_test_file(0);
+
+    fd = readmap_open(tmpname, O_RDWR);
+    munit_assert(fd >= 0);
+
+    // lots of small writes, so the file has to grow several times
+    for (size_t index = 0; index < record_count; index++) {
+        memset(record, 'a' + (index % 26), sizeof(record));
+        munit_assert(sizeof(record) == readmap_write(fd, record, sizeof(record)));
+    }
+
+    munit_assert(0 == readmap_lseek(fd, 0, SEEK_SET));
+    for (size_t index = 0; index < record_count; index++) {
+        memset(record, 'a' + (index % 26), sizeof(record));
+        munit_assert(sizeof(buffer) == readmap_read(fd, buffer, sizeof(buffer)));
+        munit_assert(0 == memcmp(record, buffer, sizeof(record)));
+    }
+    munit_assert(0 == readmap_read(fd, buffer, sizeof(buffer)));
+
+    munit_assert(0 == readmap_close(fd));
+
+    // the padding must be gone once the file is closed
+    munit_assert(0 == stat(tmpname, &st));
+    munit_assert(record_count * sizeof(record) == (size_t)st.st_size);
+
+    // or when the library shuts down with the file still open
+    fd = readmap_open(tmpname, O_RDWR | O_TRUNC);
+    munit_assert(fd >= 0);
+    munit_assert(sizeof(record) == readmap_write(fd, record, sizeof(record)));
+    munit_assert(0 == stat(tmpname, &st));
+    munit_assert((size_t)st.st_size > sizeof(record));
+
+    readmap_shutdown();
+
+    munit_assert(0 == stat(tmpname, &st));
+    munit_assert(sizeof(record) == (size_t)st.st_size);
+    munit_assert(sizeof(record) == lseek(fd, 0, SEEK_CUR));
+    munit_assert(0 == close(fd));
+
+    unlink(tmpname);
+    free(tmpname);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_shared_size(const MunitParameter params[] __notused, void *prv __notused)
+{
+    char *      tmpname;
+    char        record[100];
+    char        buffer[4096];
+    struct stat st;
+    int         writer[2];
+    int         appender;
+    int         reader;
+
+    readmap_init();
+    tmpname = make_test_file(0);
+
+    writer[0] = readmap_open(tmpname, O_RDWR);
+    munit_assert(writer[0] >= 0);
+    reader = readmap_open(tmpname, O_RDONLY);
+    munit_assert(reader >= 0);
+
+    // the writer pads the file out, but the reader sees only what was written, at once
+    memset(record, 'w', sizeof(record));
+    munit_assert(sizeof(record) == readmap_write(writer[0], record, sizeof(record)));
+    munit_assert(0 == stat(tmpname, &st));
+    munit_assert((size_t)st.st_size > sizeof(record));
+    munit_assert(sizeof(record) == readmap_pread(reader, buffer, sizeof(buffer), 0));
+    munit_assert(0 == memcmp(buffer, record, sizeof(record)));
+    munit_assert(0 == readmap_fstat(reader, &st));
+    munit_assert(sizeof(record) == (size_t)st.st_size);
+    munit_assert(sizeof(record) == readmap_lseek(reader, 0, SEEK_END));
+
+    // a second writer shares the padding; it only comes off when the last of them closes
+    writer[1] = readmap_open(tmpname, O_RDWR);
+    munit_assert(writer[1] >= 0);
+    munit_assert(sizeof(record) == readmap_pwrite(writer[1], record, sizeof(record), sizeof(record)));
+
+    // appending goes to the kernel, which must find the real end of the file, not the padding
+    appender = readmap_open(tmpname, O_RDWR | O_APPEND);
+    munit_assert(appender >= 0);
+    munit_assert(sizeof(record) == readmap_write(appender, record, sizeof(record)));
+    munit_assert(0 == readmap_fstat(appender, &st));
+    munit_assert(3 * sizeof(record) == (size_t)st.st_size);
+    munit_assert(0 == readmap_close(appender));
+
+    munit_assert(0 == readmap_close(writer[0]));
+    munit_assert(3 * sizeof(record) == readmap_pread(reader, buffer, sizeof(buffer), 0));
+    munit_assert(0 == readmap_close(writer[1]));
+
+    munit_assert(0 == stat(tmpname, &st));
+    munit_assert(3 * sizeof(record) == (size_t)st.st_size);
+
+    // and the reader, still mapped beyond the new end, stays within it
+    munit_assert(0 == readmap_pread(reader, buffer, sizeof(buffer), 3 * sizeof(record)));
+    munit_assert(3 * sizeof(record) == readmap_pread(reader, buffer, sizeof(buffer), 0));
+    munit_assert(0 == readmap_fstat(reader, &st));
+    munit_assert(3 * sizeof(record) == (size_t)st.st_size);
+
+    munit_assert(0 == readmap_close(reader));
+    unlink(tmpname);
+    free(tmpname);
+
+    readmap_shutdown();
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_positional(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t file_size = (1024 * 1024) + 17;
+    char *       tmpname;
+    char         buffer[3][1000];
+    char         record[100];
+    struct iovec iov[3];
+    int          fd;
+
+    readmap_init();
+    tmpname = make_test_file(file_size);
+
+    fd = readmap_open(tmpname, O_RDWR);
+    munit_assert(fd >= 0);
+
+    munit_assert(sizeof(buffer[0]) == readmap_pread(fd, buffer[0], sizeof(buffer[0]), 12345));
+    check_pattern(buffer[0], 12345, sizeof(buffer[0]));
+    munit_assert(17 == readmap_pread(fd, buffer[0], sizeof(buffer[0]), file_size - 17));
+    check_pattern(buffer[0], file_size - 17, 17);
+    munit_assert(0 == readmap_pread(fd, buffer[0], sizeof(buffer[0]), file_size));
+
+    // positional reads leave the file position alone
+    for (unsigned index = 0; index < 3; index++) {
+        iov[index].iov_base = buffer[index];
+        iov[index].iov_len  = sizeof(buffer[index]) - index;
+    }
+    munit_assert(2997 == readmap_readv(fd, iov, 3));
+    check_pattern(buffer[0], 0, 1000);
+    check_pattern(buffer[1], 1000, 999);
+    check_pattern(buffer[2], 1999, 998);
+    munit_assert(2997 == readmap_preadv(fd, iov, 3, 4096));
+    check_pattern(buffer[2], 4096 + 1999, 998);
+    munit_assert(2997 == readmap_lseek(fd, 0, SEEK_CUR));
+
+    // vectored and positional writes, including one that extends the file
+    memset(record, 'x', sizeof(record));
+    iov[0].iov_base = record;
+    iov[0].iov_len  = sizeof(record);
+    iov[1]          = iov[0];
+    munit_assert(2 * sizeof(record) == readmap_pwritev(fd, iov, 2, file_size - 50));
+    munit_assert(sizeof(record) == readmap_pwrite(fd, record, sizeof(record), 0));
+    munit_assert(2 * sizeof(record) == readmap_writev(fd, iov, 2));
+    munit_assert(2997 + 2 * sizeof(record) == readmap_lseek(fd, 0, SEEK_CUR));
+
+    munit_assert(950 == readmap_pread(fd, buffer[0], sizeof(buffer[0]), file_size - 800));
+    check_pattern(buffer[0], file_size - 800, 750);
+    munit_assert(0 == memcmp(buffer[0] + 750, record, sizeof(record)));
+    munit_assert(0 == memcmp(buffer[0] + 850, record, sizeof(record)));
+    munit_assert(149 == readmap_pread(fd, buffer[0], sizeof(buffer[0]), file_size + 1));
+
+    munit_assert(0 == readmap_close(fd));
+    unlink(tmpname);
+    free(tmpname);
+
+    readmap_shutdown();
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_file_calls(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t   file_size = 64 * 1024;
+    char           record[1000];
+    char           buffer[sizeof(record)];
+    char           zeros[sizeof(record)];
+    char *         tmpname;
+    struct stat    st;
+    readmap_view_t view;
+    int            fd;
+    int            otherfd;
+
+    readmap_init();
+    tmpname = make_test_file(file_size);
+
+    fd = readmap_open(tmpname, O_RDWR);
+    munit_assert(fd >= 0);
+
+    // an appending write pads the file out on disk, but fstat reports the real size
+    memset(record, 'r', sizeof(record));
+    munit_assert(file_size == (size_t)readmap_lseek(fd, 0, SEEK_END));
+    munit_assert(sizeof(record) == readmap_write(fd, record, sizeof(record)));
+    munit_assert(0 == readmap_fstat(fd, &st));
+    munit_assert(file_size + sizeof(record) == (size_t)st.st_size);
+    munit_assert(S_ISREG(st.st_mode));
+    munit_assert(0 == fstat(fd, &st));
+    munit_assert((size_t)st.st_size > file_size + sizeof(record));
+
+    // and the padding doesn't survive an fsync
+    munit_assert(0 == readmap_fsync(fd));
+    munit_assert(0 == fstat(fd, &st));
+    munit_assert(file_size + sizeof(record) == (size_t)st.st_size);
+    munit_assert(0 == readmap_fdatasync(fd));
+
+    // truncation is seen at once
+    munit_assert(0 == readmap_ftruncate(fd, 4096));
+    munit_assert(0 == readmap_fstat(fd, &st));
+    munit_assert(4096 == st.st_size);
+    munit_assert(96 == readmap_pread(fd, buffer, sizeof(buffer), 4000));
+    check_pattern(buffer, 4000, 96);
+
+    // as is allocation past the end, which reads back as zeros
+    memset(zeros, 0, sizeof(zeros));
+    munit_assert(0 == readmap_fallocate(fd, 0, 0, 8192));
+    munit_assert(0 == readmap_fstat(fd, &st));
+    munit_assert(8192 == st.st_size);
+    munit_assert(sizeof(buffer) == readmap_pread(fd, buffer, sizeof(buffer), 5000));
+    munit_assert(0 == memcmp(buffer, zeros, sizeof(zeros)));
+
+    // by the other descriptors for the file too (so what they write doesn't cut it short again)
+    otherfd = readmap_open(tmpname, O_RDWR);
+    munit_assert(otherfd >= 0);
+    munit_assert(sizeof(record) == readmap_pwrite(otherfd, record, sizeof(record), 0));
+    munit_assert(0 == readmap_fallocate(fd, 0, 0, 16384));
+    munit_assert(sizeof(record) == readmap_pwrite(otherfd, record, sizeof(record), 8192));
+    munit_assert(0 == readmap_fstat(otherfd, &st));
+    munit_assert(16384 == st.st_size);
+
+    // cutting the file short cuts short every mapping of it: the rest of a view reads as zeros
+    munit_assert(8192 == readmap_read_view(otherfd, 0, 8192, &view));
+    munit_assert(0 == readmap_ftruncate(fd, 4096));
+    munit_assert(0 == memcmp(view.data + 4096, zeros, sizeof(zeros)));
+    readmap_release_view(&view);
+
+    // and once it grows again, what is written there is what is read back
+    munit_assert(sizeof(record) == readmap_pwrite(fd, record, sizeof(record), 4096));
+    munit_assert(sizeof(record) == readmap_pread(otherfd, buffer, sizeof(buffer), 4096));
+    munit_assert(0 == memcmp(buffer, record, sizeof(record)));
+
+    munit_assert(0 == readmap_close(otherfd));
+    munit_assert(0 == readmap_close(fd));
+    munit_assert(0 == stat(tmpname, &st));
+    munit_assert(4096 + sizeof(record) == (size_t)st.st_size);
+    unlink(tmpname);
+    free(tmpname);
+
+    readmap_shutdown();
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_dirty(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t file_size = 1024 * 1024;
+    char         record[100];
+    char         buffer[sizeof(record)];
+    char *       tmpname;
+    struct stat  st;
+    int          fd;
+
+    // a flusher that kicks in at 1MB dirty
+    setenv("READMAP_DIRTY_LIMIT_MB", "1", 1);
+    readmap_init();
+    tmpname = make_test_file(file_size);
+
+    fd = readmap_open(tmpname, O_RDWR);
+    munit_assert(fd >= 0);
+
+    // more scattered writes than there are extents to track them, some of them in the same pages
+    for (unsigned index = 0; index < 32; index++) {
+        memset(record, 'a' + (index % 26), sizeof(record));
+        munit_assert(sizeof(record) == readmap_pwrite(fd, record, sizeof(record), ((index * 7919) % 200) * 4000));
+    }
+    munit_assert(0 == readmap_fdatasync(fd));
+
+    // then enough appended for the flusher to have something to do
+    munit_assert((off_t)file_size == readmap_lseek(fd, 0, SEEK_END));
+    memset(record, 'z', sizeof(record));
+    for (unsigned index = 0; index < 40000; index++) {
+        munit_assert(sizeof(record) == readmap_write(fd, record, sizeof(record)));
+    }
+    munit_assert(0 == readmap_fsync(fd));
+
+    // what the kernel has is what we wrote, and no more
+    munit_assert(0 == fstat(fd, &st));
+    munit_assert(file_size + (40000 * sizeof(record)) == (size_t)st.st_size);
+    for (unsigned index = 0; index < 32; index++) {
+        // later writes to the same spot win
+        unsigned last = index;
+        for (unsigned later = index + 1; later < 32; later++) {
+            if (((later * 7919) % 200) == ((index * 7919) % 200)) {
+                last = later;
+            }
+        }
+        memset(record, 'a' + (last % 26), sizeof(record));
+        munit_assert(sizeof(buffer) == pread(fd, buffer, sizeof(buffer), ((index * 7919) % 200) * 4000));
+        munit_assert(0 == memcmp(record, buffer, sizeof(record)));
+    }
+    memset(record, 'z', sizeof(record));
+    munit_assert(sizeof(buffer) == pread(fd, buffer, sizeof(buffer), st.st_size - sizeof(buffer)));
+    munit_assert(0 == memcmp(record, buffer, sizeof(record)));
+
+    munit_assert(0 == readmap_close(fd));
+    unlink(tmpname);
+    free(tmpname);
+
+    readmap_shutdown();
+    unsetenv("READMAP_DIRTY_LIMIT_MB");
+
+    return MUNIT_OK;
+}
+
+struct reader_args {
+    int          fd;
+    size_t       file_size;
+    unsigned     iterations;
+    volatile int failed;
+};
+
+static void *pread_thread(void *arg)
+{
+    struct reader_args *args = (struct reader_args *)arg;
+    char                buffer[512];
+    size_t              offset;
+
+    for (unsigned index = 0; index < args->iterations; index++) {
+        offset = ((size_t)index * 4099) % (args->file_size - sizeof(buffer));
+        if (sizeof(buffer) != readmap_pread(args->fd, buffer, sizeof(buffer), offset)) {
+            args->failed = 1;
+            break;
+        }
+        check_pattern(buffer, offset, sizeof(buffer));
+    }
+
+    return NULL;
+}
+
+static MunitResult test_concurrent(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t       file_size = 4 * 1024 * 1024;
+    pthread_t          threads[8];
+    struct reader_args args;
+    char *             tmpname;
+    int                fd;
+
+    readmap_init();
+    tmpname = make_test_file(file_size);
+
+    args.fd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(args.fd >= 0);
+    args.file_size  = file_size;
+    args.iterations = 100000;
+    args.failed     = 0;
+
+    for (unsigned index = 0; index < sizeof(threads) / sizeof(threads[0]); index++) {
+        munit_assert(0 == pthread_create(&threads[index], NULL, pread_thread, &args));
+    }
+
+    // open/close churn on the same file while the readers are running
+    for (unsigned index = 0; index < 10000; index++) {
+        fd = readmap_open(tmpname, O_RDONLY);
+        munit_assert(fd >= 0);
+        munit_assert(0 == readmap_close(fd));
+    }
+
+    for (unsigned index = 0; index < sizeof(threads) / sizeof(threads[0]); index++) {
+        munit_assert(0 == pthread_join(threads[index], NULL));
+    }
+    munit_assert(0 == args.failed);
+
+    munit_assert(0 == readmap_close(args.fd));
+    unlink(tmpname);
+    free(tmpname);
+
+    readmap_shutdown();
+
+    return MUNIT_OK;
+}
+
+struct offset_reader_args {
+    int          fd;
+    size_t       total;
+    volatile int failed;
+};
+
+static void *read_until_eof_thread(void *arg)
+{
+    struct offset_reader_args *args = (struct offset_reader_args *)arg;
+    char                       buffer[4096];
+    ssize_t                    bytes_read;
+
+    while (0 != (bytes_read = readmap_read(args->fd, buffer, sizeof(buffer)))) {
+        if (bytes_read < 0) {
+            args->failed = 1;
+            break;
+        }
+        args->total += bytes_read;
+    }
+
+    return NULL;
+}
+
+static MunitResult test_offset(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t              file_size = (4 * 1024 * 1024) + 123;
+    pthread_t                 threads[4];
+    struct offset_reader_args args[4];
+    size_t                    total = 0;
+    char                      buffer[100];
+    char *                    tmpname;
+    struct stat               st;
+    int                       fd;
+    int                       dupfd;
+
+    readmap_init();
+    tmpname = make_test_file(file_size);
+
+    fd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd >= 0);
+
+    // seeks within the offset we own
+    munit_assert(sizeof(buffer) == readmap_read(fd, buffer, sizeof(buffer)));
+    munit_assert(100 == readmap_lseek(fd, 0, SEEK_CUR));
+    munit_assert(90 == readmap_lseek(fd, -10, SEEK_CUR));
+    munit_assert(sizeof(buffer) == readmap_read(fd, buffer, sizeof(buffer)));
+    check_pattern(buffer, 90, sizeof(buffer));
+    munit_assert((off_t)file_size == readmap_lseek(fd, 0, SEEK_END));
+    munit_assert(-1 == readmap_lseek(fd, -1, SEEK_SET));
+    munit_assert(EINVAL == errno);
+    munit_assert(0 == readmap_lseek(fd, 0, SEEK_SET));
+
+    // concurrent reads at the file position each get their own part of the file
+    for (unsigned index = 0; index < sizeof(threads) / sizeof(threads[0]); index++) {
+        args[index].fd     = fd;
+        args[index].total  = 0;
+        args[index].failed = 0;
+        munit_assert(0 == pthread_create(&threads[index], NULL, read_until_eof_thread, &args[index]));
+    }
+    for (unsigned index = 0; index < sizeof(threads) / sizeof(threads[0]); index++) {
+        munit_assert(0 == pthread_join(threads[index], NULL));
+        munit_assert(0 == args[index].failed);
+        total += args[index].total;
+    }
+    munit_assert(file_size == total);
+    munit_assert((off_t)file_size == readmap_lseek(fd, 0, SEEK_CUR));
+
+    // a duplicate sees where we are, and from then on the kernel keeps the offset
+    munit_assert(1000 == readmap_lseek(fd, 1000, SEEK_SET));
+    munit_assert(sizeof(buffer) == readmap_read(fd, buffer, sizeof(buffer)));
+    dupfd = readmap_dup(fd);
+    munit_assert(dupfd >= 0);
+    munit_assert(1100 == lseek(dupfd, 0, SEEK_CUR));
+    munit_assert(sizeof(buffer) == read(dupfd, buffer, sizeof(buffer)));
+    munit_assert(sizeof(buffer) == readmap_read(fd, buffer, sizeof(buffer)));
+    check_pattern(buffer, 1200, sizeof(buffer));
+    munit_assert(1300 == lseek(dupfd, 0, SEEK_CUR));
+
+    munit_assert(0 == close(dupfd));
+    munit_assert(0 == readmap_close(fd));
+
+    // nor does it see the space writes through the mapping grew the file by
+    fd = readmap_open(tmpname, O_RDWR | O_TRUNC);
+    munit_assert(fd >= 0);
+    munit_assert(5 == readmap_write(fd, "hello", 5));
+    dupfd = readmap_dup(fd);
+    munit_assert(dupfd >= 0);
+    munit_assert(0 == fstat(dupfd, &st));
+    munit_assert(5 == st.st_size);
+    munit_assert(0 == readmap_lseek(fd, 0, SEEK_SET));
+    munit_assert(5 == readmap_read(fd, buffer, sizeof(buffer)));
+    munit_assert(0 == read(dupfd, buffer, sizeof(buffer)));
+    // (and a read that goes to the kernel after it has grown again)
+    munit_assert(5 == readmap_pwrite(fd, "world", 5, 5));
+    munit_assert(5 == readmap_read(fd, buffer, sizeof(buffer)));
+    munit_assert(0 == memcmp(buffer, "world", 5));
+
+    munit_assert(0 == close(dupfd));
+    munit_assert(0 == readmap_close(fd));
+
+    // a descriptor dup2() replaces keeps its state only if the call fails
+    fd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd >= 0);
+    dupfd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(dupfd >= 0);
+    munit_assert(5 == readmap_pread(dupfd, buffer, sizeof(buffer), 5));
+    munit_assert(-1 == readmap_dup2(-1, dupfd));
+    munit_assert(EBADF == errno);
+    munit_assert(readmap_get_page_size(dupfd) > 0);
+    munit_assert(dupfd == readmap_dup2(fd, dupfd));
+    munit_assert(-1 == readmap_get_page_size(dupfd));
+    munit_assert(10 == readmap_pread(dupfd, buffer, sizeof(buffer), 0));
+    munit_assert(0 == memcmp(buffer, "helloworld", 10));
+
+    munit_assert(0 == close(dupfd));
+    munit_assert(0 == readmap_close(fd));
+    unlink(tmpname);
+    free(tmpname);
+
+    readmap_shutdown();
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_fork(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t file_size = (1024 * 1024) + 17;
+    char         buffer[100];
+    char         command[200];
+    char *       argv[] = {(char *)"sh", (char *)"-c", command, NULL};
+    char *       tmpname;
+    pid_t        child;
+    int          status;
+    int          fd;
+
+    readmap_init();
+    tmpname = make_test_file(file_size);
+
+    fd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd >= 0);
+    munit_assert(sizeof(buffer) == readmap_read(fd, buffer, sizeof(buffer)));
+
+    // the child finds the position where we left it
+    child = fork();
+    munit_assert(child >= 0);
+    if (0 == child) {
+        _exit((sizeof(buffer) == lseek(fd, 0, SEEK_CUR)) ? 0 : 1);
+    }
+    munit_assert(child == waitpid(child, &status, 0));
+    munit_assert(WIFEXITED(status) && (0 == WEXITSTATUS(status)));
+
+    // and we take it back: the kernel isn't told about reads until it has to be
+    munit_assert(sizeof(buffer) == readmap_read(fd, buffer, sizeof(buffer)));
+    check_pattern(buffer, sizeof(buffer), sizeof(buffer));
+    munit_assert(sizeof(buffer) == lseek(fd, 0, SEEK_CUR));
+    munit_assert(2 * sizeof(buffer) == readmap_lseek(fd, 0, SEEK_CUR));
+
+    // as do processes started without fork()
+    snprintf(command, sizeof(command), "grep -q '^pos:[[:space:]]*%zu$' /proc/self/fdinfo/%d", 2 * sizeof(buffer), fd);
+    status = readmap_system(command);
+    munit_assert(WIFEXITED(status) && (0 == WEXITSTATUS(status)));
+    munit_assert(sizeof(buffer) == readmap_read(fd, buffer, sizeof(buffer)));
+    snprintf(command, sizeof(command), "grep -q '^pos:[[:space:]]*%zu$' /proc/self/fdinfo/%d", 3 * sizeof(buffer), fd);
+    munit_assert(0 == readmap_posix_spawnp(&child, "sh", NULL, NULL, argv, environ));
+    munit_assert(child == waitpid(child, &status, 0));
+    munit_assert(WIFEXITED(status) && (0 == WEXITSTATUS(status)));
+
+    munit_assert(0 == readmap_close(fd));
+    unlink(tmpname);
+    free(tmpname);
+
+    readmap_shutdown();
+
+    return MUNIT_OK;
+}
+
+static void *pread_until_closed_thread(void *arg)
+{
+    struct reader_args *args = (struct reader_args *)arg;
+    char                buffer[64 * 1024];
+    size_t              offset;
+    ssize_t             bytes_read;
+
+    for (unsigned index = 0;; index++) {
+        offset     = ((size_t)index * 4099) % (args->file_size - sizeof(buffer));
+        bytes_read = readmap_pread(args->fd, buffer, sizeof(buffer), offset);
+        if (bytes_read < 0) {
+            if (EBADF != errno) {
+                args->failed = 1;
+            }
+            break;
+        }
+        if (sizeof(buffer) != bytes_read) {
+            args->failed = 1;
+            break;
+        }
+        check_pattern(buffer, offset, sizeof(buffer));
+    }
+
+    return NULL;
+}
+
+static MunitResult test_close_race(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t       file_size = 4 * 1024 * 1024;
+    pthread_t          threads[8];
+    struct reader_args args;
+    char *             tmpname;
+
+    readmap_init();
+    tmpname = make_test_file(file_size);
+
+    args.fd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(args.fd >= 0);
+    args.file_size = file_size;
+    args.failed    = 0;
+
+    for (unsigned index = 0; index < sizeof(threads) / sizeof(threads[0]); index++) {
+        munit_assert(0 == pthread_create(&threads[index], NULL, pread_until_closed_thread, &args));
+    }
+
+    // close the file out from under the readers; the mapping must stay valid for those still using it
+    usleep(100 * 1000);
+    munit_assert(0 == readmap_close(args.fd));
+
+    for (unsigned index = 0; index < sizeof(threads) / sizeof(threads[0]); index++) {
+        munit_assert(0 == pthread_join(threads[index], NULL));
+    }
+    munit_assert(0 == args.failed);
+
+    unlink(tmpname);
+    free(tmpname);
+
+    readmap_shutdown();
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_shared_mapping(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t file_size = (1024 * 1024) + 17;
+    char *       tmpname;
+    char         buffer[1000];
+    char         record[100];
+    int          readfd;
+    int          writefd;
+
+    readmap_init();
+    tmpname = make_test_file(file_size);
+
+    // the two descriptors share one mapping of the file
+    readfd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(readfd >= 0);
+    writefd = readmap_open(tmpname, O_RDWR);
+    munit_assert(writefd >= 0);
+
+    munit_assert(sizeof(buffer) == readmap_pread(readfd, buffer, sizeof(buffer), 4096));
+    check_pattern(buffer, 4096, sizeof(buffer));
+
+    // a write through one (which needs a writable, larger mapping) is visible through the other
+    memset(record, 'y', sizeof(record));
+    munit_assert(sizeof(record) == readmap_pwrite(writefd, record, sizeof(record), 4096));
+    munit_assert(sizeof(record) == readmap_pwrite(writefd, record, sizeof(record), file_size));
+    munit_assert(sizeof(buffer) == readmap_pread(readfd, buffer, sizeof(buffer), 4096));
+    munit_assert(0 == memcmp(buffer, record, sizeof(record)));
+    check_pattern(buffer + sizeof(record), 4096 + sizeof(record), sizeof(buffer) - sizeof(record));
+
+    munit_assert(0 == readmap_close(writefd));
+
+    // the mapping outlives the descriptor that created it
+    munit_assert(sizeof(buffer) == readmap_pread(readfd, buffer, sizeof(buffer), 8192));
+    check_pattern(buffer, 8192, sizeof(buffer));
+    munit_assert(0 == readmap_close(readfd));
+
+    // and is still cached when the file is opened again (this time, seeing the new size)
+    readfd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(readfd >= 0);
+    munit_assert(sizeof(record) + 17 == readmap_pread(readfd, buffer, sizeof(buffer), file_size - 17));
+    check_pattern(buffer, file_size - 17, 17);
+    munit_assert(0 == memcmp(buffer + 17, record, sizeof(record)));
+    munit_assert(0 == readmap_close(readfd));
+
+    unlink(tmpname);
+    free(tmpname);
+
+    readmap_shutdown();
+
+    return MUNIT_OK;
+}
+
+/*
+ * Grow the file behind the library's back; returns once the new data is on disk.
+ */
+static void append_natively(const char *name, const void *data, size_t length)
+{
+    int fd = open(name, O_WRONLY | O_APPEND);
+
+    munit_assert(fd >= 0);
+    munit_assert((ssize_t)length == write(fd, data, length));
+    munit_assert(0 == close(fd));
+}
+
+static MunitResult test_size_tracking(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t file_size = 64 * 1024;
+    char *       tmpname;
+    char         buffer[1000];
+    char         record[100];
+    struct stat  st;
+    int          fd;
+    unsigned     tries;
+
+    readmap_init();
+    tmpname = make_test_file(file_size);
+    memset(record, 'z', sizeof(record));
+
+    fd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd >= 0);
+    munit_assert(0 == readmap_pread(fd, buffer, sizeof(buffer), file_size));
+
+    // with no interval, every check goes to the file system
+    munit_assert(0 == readmap_set_size_interval(fd, 0));
+    append_natively(tmpname, record, sizeof(record));
+    munit_assert(sizeof(record) == readmap_pread(fd, buffer, sizeof(buffer), file_size));
+    munit_assert(0 == memcmp(buffer, record, sizeof(record)));
+
+    // a long interval means we keep using the size we have
+    munit_assert(0 == readmap_set_size_interval(fd, 3600 * 1000));
+    munit_assert(sizeof(record) == readmap_pread(fd, buffer, sizeof(buffer), file_size));
+    append_natively(tmpname, record, sizeof(record));
+    munit_assert(sizeof(record) == readmap_pread(fd, buffer, sizeof(buffer), file_size));
+
+    // a check that fails is reported, not papered over with the size we had
+    munit_assert(0 == readmap_set_size_interval(fd, 0));
+    munit_assert(0 == close(fd));
+    munit_assert(-1 == readmap_fstat(fd, &st));
+    munit_assert(EBADF == errno);
+    munit_assert(-1 == readmap_pread(fd, buffer, sizeof(buffer), file_size));
+    munit_assert(EBADF == errno);
+
+    munit_assert(-1 == readmap_close(fd));
+    munit_assert(-1 == readmap_set_size_interval(fd, 0));
+    munit_assert(EBADF == errno);
+    readmap_shutdown();
+
+    // when watching, changes are noticed (shortly) regardless of the interval
+    setenv("READMAP_SIZE_WATCH", "1", 1);
+    setenv("READMAP_SIZE_INTERVAL_MS", "3600000", 1);
+    readmap_init();
+
+    fd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd >= 0);
+    munit_assert(2 * sizeof(record) == readmap_pread(fd, buffer, sizeof(buffer), file_size));
+    append_natively(tmpname, record, sizeof(record));
+    for (tries = 0; tries < 1000; tries++) {
+        if (3 * sizeof(record) == readmap_pread(fd, buffer, sizeof(buffer), file_size)) {
+            break;
+        }
+        usleep(1000);
+    }
+    munit_assert(tries < 1000);
+    munit_assert(0 == readmap_close(fd));
+
+    readmap_shutdown();
+    unsetenv("READMAP_SIZE_WATCH");
+    unsetenv("READMAP_SIZE_INTERVAL_MS");
+
+    unlink(tmpname);
+    free(tmpname);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_stale(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t file_size = 64 * 1024;
+    char *       tmpname;
+    char *       othername;
+    char         buffer[1000];
+    char         other[sizeof(buffer)];
+    FILE *       file;
+    int          fd;
+
+    readmap_init();
+    tmpname   = make_test_file(file_size);
+    othername = make_test_file(0);
+    memset(other, 'o', sizeof(other));
+    append_natively(othername, other, sizeof(other));
+
+    // a stream's descriptor is let go when the stream is closed
+    file = readmap_fopen(tmpname, "r");
+    munit_assert(NULL != file);
+    fd = fileno(file);
+    munit_assert(sizeof(buffer) == readmap_pread(fd, buffer, sizeof(buffer), sizeof(buffer)));
+    munit_assert(0 == readmap_fclose(file));
+    munit_assert(fd == open(othername, O_RDONLY));
+    munit_assert(sizeof(buffer) == readmap_pread(fd, buffer, sizeof(buffer), 0));
+    munit_assert(0 == memcmp(buffer, other, sizeof(other)));
+    munit_assert(0 == close(fd));
+
+    // and one closed without our seeing it is noticed when the size is next checked
+    fd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd >= 0);
+    munit_assert(sizeof(buffer) == readmap_pread(fd, buffer, sizeof(buffer), sizeof(buffer)));
+    munit_assert(0 == readmap_set_size_interval(fd, 0));
+    munit_assert(0 == close(fd));
+    munit_assert(fd == open(othername, O_RDONLY));
+    munit_assert(sizeof(buffer) == readmap_pread(fd, buffer, sizeof(buffer), 0));
+    munit_assert(0 == memcmp(buffer, other, sizeof(other)));
+    munit_assert(-1 == readmap_set_size_interval(fd, 0));
+    munit_assert(0 == readmap_close(fd));
+
+    readmap_shutdown();
+
+    unlink(tmpname);
+    free(tmpname);
+    unlink(othername);
+    free(othername);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_hugepage(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t file_size = (4 * 1024 * 1024) + 17;
+    const long   base_size = sysconf(_SC_PAGESIZE);
+    char         shmname[] = "/dev/shm/readmap_testXXXXXX";
+    char *       tmpname;
+    char         buffer[1000];
+    long         page_size;
+    int          fd;
+
+    setenv("READMAP_HUGEPAGE", "1", 1);
+    setenv("READMAP_HUGEPAGE_THRESHOLD", "1048576", 1);
+    readmap_init();
+
+    // an ordinary file system doesn't get large pages unless we insist
+    tmpname = make_test_file(file_size);
+    fd      = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd >= 0);
+    munit_assert(sizeof(buffer) == readmap_pread(fd, buffer, sizeof(buffer), file_size - sizeof(buffer)));
+    check_pattern(buffer, file_size - sizeof(buffer), sizeof(buffer));
+    munit_assert(base_size == readmap_get_page_size(fd));
+    munit_assert(0 == readmap_close(fd));
+    munit_assert(-1 == readmap_get_page_size(fd));
+    unlink(tmpname);
+    free(tmpname);
+
+    // tmpfs does (if the kernel will take the hint)
+    fd = mkstemp(shmname);
+    if (fd >= 0) {
+        fill_test_file(fd, file_size);
+        close(fd);
+
+        fd = readmap_open(shmname, O_RDONLY);
+        munit_assert(fd >= 0);
+        munit_assert(base_size == readmap_get_page_size(fd));  // not mapped yet
+        munit_assert(sizeof(buffer) == readmap_pread(fd, buffer, sizeof(buffer), file_size - sizeof(buffer)));
+        check_pattern(buffer, file_size - sizeof(buffer), sizeof(buffer));
+        page_size = readmap_get_page_size(fd);
+        munit_assert((page_size == base_size) || (page_size >= 2 * 1024 * 1024));
+        munit_assert(0 == readmap_close(fd));
+        unlink(shmname);
+    }
+
+    readmap_shutdown();
+    unsetenv("READMAP_HUGEPAGE");
+    unsetenv("READMAP_HUGEPAGE_THRESHOLD");
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_windows(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t file_size = (8 * 1024 * 1024) + 17;
+    char *       tmpname;
+    char *       big;
+    char         buffer[1000];
+    struct iovec iov[2];
+    ssize_t      bytes_read;
+    size_t       total = 0;
+    int          fd[2];
+
+    // 1MB windows for anything of 1MB or more, with room for only two of them when idle
+    setenv("READMAP_WINDOW_SIZE", "1048576", 1);
+    setenv("READMAP_WINDOW_THRESHOLD", "1048576", 1);
+    setenv("READMAP_MAPPING_CACHE_LIMIT", "2097152", 1);
+    readmap_init();
+    tmpname = make_test_file(file_size);
+
+    fd[0] = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd[0] >= 0);
+    fd[1] = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd[1] >= 0);
+
+    // sequential reads, most of which end up straddling a window boundary at some point
+    while (0 < (bytes_read = readmap_read(fd[0], buffer, sizeof(buffer)))) {
+        check_pattern(buffer, total, bytes_read);
+        total += bytes_read;
+
+        // keep the other descriptor bouncing around the file
+        munit_assert(sizeof(buffer) == readmap_pread(fd[1], buffer, sizeof(buffer), (file_size - total) / 2));
+        check_pattern(buffer, (file_size - total) / 2, sizeof(buffer));
+    }
+    munit_assert(0 == bytes_read);
+    munit_assert(file_size == total);
+
+    // one read that covers several windows
+    big = malloc(3 * 1024 * 1024);
+    munit_assert(NULL != big);
+    munit_assert(3 * 1024 * 1024 == readmap_pread(fd[1], big, 3 * 1024 * 1024, 512 * 1024 + 3));
+    check_pattern(big, 512 * 1024 + 3, 3 * 1024 * 1024);
+
+    // and a vectored one that runs into the end of the file
+    iov[0].iov_base = buffer;
+    iov[0].iov_len  = sizeof(buffer);
+    iov[1].iov_base = big;
+    iov[1].iov_len  = 2 * 1024 * 1024;
+    munit_assert(1024 * 1024 + 17 == readmap_preadv(fd[1], iov, 2, file_size - (1024 * 1024) - 17));
+    check_pattern(buffer, file_size - (1024 * 1024) - 17, sizeof(buffer));
+    check_pattern(big, file_size - (1024 * 1024) - 17 + sizeof(buffer), 1024 * 1024 + 17 - sizeof(buffer));
+    free(big);
+
+    munit_assert(0 == readmap_close(fd[0]));
+    munit_assert(0 == readmap_close(fd[1]));
+
+    unlink(tmpname);
+    free(tmpname);
+
+    readmap_shutdown();
+    unsetenv("READMAP_WINDOW_SIZE");
+    unsetenv("READMAP_WINDOW_THRESHOLD");
+    unsetenv("READMAP_MAPPING_CACHE_LIMIT");
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_access_pattern(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t file_size = 16 * 1024 * 1024;
+    char *       tmpname;
+    char         buffer[4096];
+    size_t       offset;
+    int          fd;
+
+    readmap_init();
+    tmpname = make_test_file(file_size);
+
+    fd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd >= 0);
+    munit_assert(READMAP_ACCESS_UNKNOWN == readmap_get_access_pattern(fd));
+
+    // a scan through the whole file (so we go past the read ahead and drop behind distances)
+    for (offset = 0; offset < file_size; offset += sizeof(buffer)) {
+        munit_assert(sizeof(buffer) == readmap_read(fd, buffer, sizeof(buffer)));
+        if (0 == offset % (1024 * 1024)) {
+            check_pattern(buffer, offset, sizeof(buffer));
+        }
+    }
+    munit_assert(READMAP_ACCESS_SEQUENTIAL == readmap_get_access_pattern(fd));
+
+    // every 64KB
+    for (offset = 0; offset < file_size; offset += 65536) {
+        munit_assert(100 == readmap_pread(fd, buffer, 100, offset));
+        check_pattern(buffer, offset, 100);
+    }
+    munit_assert(READMAP_ACCESS_STRIDED == readmap_get_access_pattern(fd));
+
+    // all over the place
+    for (unsigned index = 0; index < 16; index++) {
+        offset = ((index * 7919) % 251) * 65536 + index;
+        munit_assert(100 == readmap_pread(fd, buffer, 100, offset));
+        check_pattern(buffer, offset, 100);
+    }
+    munit_assert(READMAP_ACCESS_RANDOM == readmap_get_access_pattern(fd));
+
+    munit_assert(0 == readmap_close(fd));
+    munit_assert(-1 == readmap_get_access_pattern(fd));
+
+    unlink(tmpname);
+    free(tmpname);
+
+    readmap_shutdown();
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_prefetch(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t file_size = (16 * 1024 * 1024) + 17;
+    char *       tmpname;
+    char         buffer[4096];
+    ssize_t      bytes_read;
+    size_t       total;
+    int          fd;
+
+    setenv("READMAP_PREFETCH_THREADS", "2", 1);
+    readmap_init();
+    tmpname = make_test_file(file_size);
+
+    for (unsigned pass = 0; pass < 4; pass++) {
+        fd = readmap_open(tmpname, O_RDONLY);
+        munit_assert(fd >= 0);
+
+        total = 0;
+        while (0 < (bytes_read = readmap_read(fd, buffer, sizeof(buffer)))) {
+            check_pattern(buffer, total, bytes_read);
+            total += bytes_read;
+
+            if ((pass & 1) && (total > file_size / 2)) {
+                // close with prefetches (probably) still queued
+                break;
+            }
+        }
+        munit_assert(READMAP_ACCESS_SEQUENTIAL == readmap_get_access_pattern(fd));
+        munit_assert(0 == readmap_close(fd));
+    }
+
+    unlink(tmpname);
+    free(tmpname);
+
+    readmap_shutdown();
+    unsetenv("READMAP_PREFETCH_THREADS");
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_streaming_copy(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t file_size = (1024 * 1024) + 17;
+    char *       tmpname;
+    char *       buffer;
+    int          fd;
+
+    // use the streaming copy for almost everything
+    setenv("READMAP_COPY_NT_THRESHOLD", "256", 1);
+    readmap_init();
+    tmpname = make_test_file(file_size);
+
+    buffer = malloc(file_size + 64);
+    munit_assert(NULL != buffer);
+
+    fd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd >= 0);
+
+    // odd sizes, offsets and buffer alignments, so every copy has a ragged head and tail
+    for (size_t length = 1; length < file_size; length = (length * 3) + 7) {
+        for (unsigned misalign = 0; misalign < 64; misalign += 13) {
+            size_t offset = (length * 7) % (file_size - length);
+
+            memset(buffer, 0, length + misalign + 1);
+            munit_assert((ssize_t)length == readmap_pread(fd, buffer + misalign, length, offset));
+            check_pattern(buffer + misalign, offset, length);
+            munit_assert(0 == buffer[misalign + length]);
+        }
+    }
+
+    munit_assert(0 == readmap_close(fd));
+    free(buffer);
+
+    unlink(tmpname);
+    free(tmpname);
+
+    readmap_shutdown();
+    unsetenv("READMAP_COPY_NT_THRESHOLD");
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_view(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t   file_size = (4 * 1024 * 1024) + 17;
+    char *         tmpname;
+    readmap_view_t view;
+    readmap_view_t views[4];
+    ssize_t        length;
+    size_t         total;
+    int            fd;
+
+    // 1MB windows, so views get cut short at window boundaries, and room for just one when idle
+    setenv("READMAP_WINDOW_SIZE", "1048576", 1);
+    setenv("READMAP_WINDOW_THRESHOLD", "1048576", 1);
+    setenv("READMAP_MAPPING_CACHE_LIMIT", "1048576", 1);
+    readmap_init();
+    tmpname = make_test_file(file_size);
+
+    fd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd >= 0);
+
+    // walk the whole file without copying anything
+    for (total = 0; total < file_size; total += length) {
+        length = readmap_read_view(fd, total, 300000, &view);
+        munit_assert(length > 0);
+        munit_assert(view.length == (size_t)length);
+        munit_assert((total / (1024 * 1024)) == ((total + length - 1) / (1024 * 1024)));
+        check_pattern(view.data, total, length);
+        readmap_release_view(&view);
+        munit_assert(NULL == view.data);
+    }
+    munit_assert(file_size == total);
+    munit_assert(0 == readmap_read_view(fd, file_size, 100, &view));
+    readmap_release_view(&view);  // harmless
+    munit_assert(-1 == readmap_read_view(fd, -1, 100, &view));
+    munit_assert(EINVAL == errno);
+
+    // a view that runs into a window boundary is cut short
+    munit_assert(100 == readmap_read_view(fd, (1024 * 1024) - 100, 1000, &view));
+    readmap_release_view(&view);
+
+    // views survive the file being closed
+    for (unsigned index = 0; index < 4; index++) {
+        munit_assert(1000 == readmap_read_view(fd, index * 1024 * 1024 + 17, 1000, &views[index]));
+    }
+    munit_assert(0 == readmap_close(fd));
+    munit_assert(-1 == readmap_read_view(fd, 0, 100, &view));
+    munit_assert(EBADF == errno);
+
+    // and the mappings being pushed out of the cache
+    fd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd >= 0);
+    for (total = 0; total + 100 < file_size; total += 1024 * 1024) {
+        munit_assert(100 == readmap_read_view(fd, total, 100, &view));
+        readmap_release_view(&view);
+    }
+    munit_assert(0 == readmap_close(fd));
+
+    for (unsigned index = 0; index < 4; index++) {
+        check_pattern(views[index].data, index * 1024 * 1024 + 17, 1000);
+        readmap_release_view(&views[index]);
+    }
+
+    unlink(tmpname);
+    free(tmpname);
+
+    readmap_shutdown();
+    unsetenv("READMAP_WINDOW_SIZE");
+    unsetenv("READMAP_WINDOW_THRESHOLD");
+    unsetenv("READMAP_MAPPING_CACHE_LIMIT");
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_batch(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t            file_size = (3 * 1024 * 1024) + 17;
+    const unsigned          count     = 100;  // more than fit on the stack
+    char *                  tmpnames[2];
+    int                     fds[3];
+    char *                  buffers;
+    readmap_batch_request_t requests[100];
+
+    // 1MB windows, so some reads need more than one
+    setenv("READMAP_WINDOW_SIZE", "1048576", 1);
+    setenv("READMAP_WINDOW_THRESHOLD", "1048576", 1);
+    readmap_init();
+
+    for (unsigned index = 0; index < 2; index++) {
+        tmpnames[index] = make_test_file(file_size);
+        fds[index]      = readmap_open(tmpnames[index], O_RDONLY);
+        munit_assert(fds[index] >= 0);
+    }
+    fds[2] = open(tmpnames[0], O_RDONLY);  // not one of ours
+    munit_assert(fds[2] >= 0);
+
+    buffers = malloc(count * 8192);
+    munit_assert(NULL != buffers);
+
+    // scattered across the files, in no particular order
+    for (unsigned index = 0; index < count; index++) {
+        requests[index].fd     = fds[index % 3];
+        requests[index].offset = ((index * 7919) % 89) * 32771;
+        requests[index].buffer = buffers + (index * 8192);
+        requests[index].length = 8192;
+    }
+    requests[0].offset = file_size - 100;       // runs off the end
+    requests[1].offset = file_size + 100;       // past the end
+    requests[2].offset = (1024 * 1024) - 4000;  // spans windows
+    requests[3].offset = -1;                    // bad
+    requests[4].fd     = -1;                    // bad
+
+    munit_assert((int)(count - 2) == readmap_submit_batch(requests, count));
+
+    munit_assert(100 == requests[0].result);
+    check_pattern(requests[0].buffer, requests[0].offset, 100);
+    munit_assert(0 == requests[1].result);
+    munit_assert(-EINVAL == requests[3].result);
+    munit_assert(-EBADF == requests[4].result);
+    for (unsigned index = 2; index < count; index++) {
+        if ((3 == index) || (4 == index)) {
+            continue;
+        }
+        munit_assert(8192 == requests[index].result);
+        check_pattern(requests[index].buffer, requests[index].offset, 8192);
+    }
+
+    munit_assert(0 == readmap_submit_batch(requests, 0));
+    munit_assert(-1 == readmap_submit_batch(NULL, 1));
+    munit_assert(EINVAL == errno);
+
+    free(buffers);
+    close(fds[2]);
+    for (unsigned index = 0; index < 2; index++) {
+        munit_assert(0 == readmap_close(fds[index]));
+        unlink(tmpnames[index]);
+        free(tmpnames[index]);
+    }
+
+    readmap_shutdown();
+    unsetenv("READMAP_WINDOW_SIZE");
+    unsetenv("READMAP_WINDOW_THRESHOLD");
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_async(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t         file_size = (1024 * 1024) + 17;
+    const char *         settings[] = {"1", "0"};  // with and without the ring
+    char *               tmpname;
+    char                 message[64];
+    char                 received[64];
+    char                 buffers[8][4096];
+    readmap_completion_t completions[16];
+    unsigned             seen;
+    int                  count;
+    int                  pipefds[2];
+    int                  native;
+    int                  fd;
+
+    tmpname = make_test_file(file_size);
+
+    for (unsigned setting = 0; setting < 2; setting++) {
+        setenv("READMAP_URING", settings[setting], 1);
+        readmap_init();
+
+        fd = readmap_open(tmpname, O_RDONLY);
+        munit_assert(fd >= 0);
+        native = open(tmpname, O_RDONLY);  // not one of ours
+        munit_assert(native >= 0);
+        munit_assert(0 == pipe(pipefds));
+
+        // reads of a mapped file, an unmapped one, and a pipe, all at once
+        for (unsigned index = 0; index < 8; index++) {
+            munit_assert(0 == readmap_async_read((index & 1) ? native : fd, buffers[index], 4096, index * 100003,
+                                                 (void *)(uintptr_t)index));
+        }
+        snprintf(message, sizeof(message), "message through the pipe");
+        munit_assert(0 == readmap_async_write(pipefds[1], message, strlen(message) + 1, -1, (void *)(uintptr_t)100));
+        munit_assert(0 == readmap_async_read(pipefds[0], received, sizeof(received), -1, (void *)(uintptr_t)101));
+
+        for (seen = 0; seen < 10; seen += count) {
+            count = readmap_async_reap(completions, 16, 1);
+            munit_assert(count > 0);
+
+            for (int index = 0; index < count; index++) {
+                uintptr_t tag = (uintptr_t)completions[index].user_data;
+
+                if (tag < 8) {
+                    munit_assert(4096 == completions[index].result);
+                    check_pattern(buffers[tag], tag * 100003, 4096);
+                }
+                else if (100 == tag) {
+                    munit_assert((ssize_t)(strlen(message) + 1) == completions[index].result);
+                }
+                else {
+                    munit_assert(101 == tag);
+                    munit_assert((ssize_t)(strlen(message) + 1) == completions[index].result);
+                    munit_assert(0 == strcmp(message, received));
+                }
+            }
+        }
+        munit_assert(10 == seen);
+        munit_assert(0 == readmap_async_reap(completions, 16, 16));  // nothing left
+
+        // failures are reported through the completion
+        munit_assert(0 == readmap_async_read(pipefds[1], received, sizeof(received), -1, NULL));
+        munit_assert(1 == readmap_async_reap(completions, 16, 1));
+        munit_assert(-EBADF == completions[0].result);
+        munit_assert(-1 == readmap_async_read(fd, received, sizeof(received), -2, NULL));
+        munit_assert(EINVAL == errno);
+
+        close(pipefds[0]);
+        close(pipefds[1]);
+        close(native);
+        munit_assert(0 == readmap_close(fd));
+
+        readmap_shutdown();
+    }
+
+    unsetenv("READMAP_URING");
+    unlink(tmpname);
+    free(tmpname);
+
+    return MUNIT_OK;
+}
+
+static void *stats_thread(void *arg)
+{
+    char buffer[100];
+
+    munit_assert(100 == readmap_pread(*(int *)arg, buffer, sizeof(buffer), 0));
+
+    return NULL;
+}
+
+static MunitResult test_stats(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t          file_size = (1024 * 1024) + 17;
+    char *                tmpname;
+    char                  statsname[64];
+    char                  signal[16];
+    char                  buffer[4096];
+    readmap_stats_t *     before;
+    readmap_stats_t *     after;
+    readmap_call_stats_t *pread_stats;
+    readmap_call_stats_t *pread_before;
+    pthread_t             thread;
+    struct stat           st;
+    uint64_t              total;
+    int                   native;
+    int                   fd;
+
+    before = malloc(sizeof(readmap_stats_t));
+    after  = malloc(sizeof(readmap_stats_t));
+    munit_assert((NULL != before) && (NULL != after));
+
+    tmpname = make_test_file(file_size);
+    strcpy(statsname, "/tmp/readmap_stats_XXXXXX");
+    fd = mkstemp(statsname);
+    munit_assert(fd >= 0);
+    close(fd);
+
+    snprintf(signal, sizeof(signal), "%d", SIGUSR1);
+    setenv("READMAP_STATS", "1", 1);
+    setenv("READMAP_STATS_SIGNAL", signal, 1);
+    setenv("READMAP_STATS_FILE", statsname, 1);
+    readmap_init();
+
+    munit_assert(0 == readmap_get_stats(before));
+
+    fd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd >= 0);
+    native = open(tmpname, O_RDONLY);  // not one of ours
+    munit_assert(native >= 0);
+
+    for (unsigned index = 0; index < 10; index++) {
+        munit_assert(sizeof(buffer) == readmap_pread(fd, buffer, sizeof(buffer), index * 65536));
+    }
+    for (unsigned index = 0; index < 5; index++) {
+        munit_assert(sizeof(buffer) == readmap_pread(native, buffer, sizeof(buffer), index * 65536));
+    }
+    munit_assert(-1 == readmap_pread(-1, buffer, sizeof(buffer), 0));
+
+    // the counts of a thread that has gone away are still there
+    munit_assert(0 == pthread_create(&thread, NULL, stats_thread, &fd));
+    munit_assert(0 == pthread_join(thread, NULL));
+
+    munit_assert(0 == readmap_get_stats(after));
+    pread_before = &before->calls[READMAP_CALL_PREAD];
+    pread_stats  = &after->calls[READMAP_CALL_PREAD];
+    munit_assert(17 == pread_stats->calls - pread_before->calls);
+    munit_assert(1 == pread_stats->failures - pread_before->failures);
+    munit_assert(11 == pread_stats->count[READMAP_PATH_MAPPED] - pread_before->count[READMAP_PATH_MAPPED]);
+    munit_assert(6 == pread_stats->count[READMAP_PATH_NATIVE] - pread_before->count[READMAP_PATH_NATIVE]);
+
+    for (unsigned path = 0; path < READMAP_PATH_COUNT; path++) {
+        total = 0;
+        for (unsigned bucket = 0; bucket < READMAP_STATS_BUCKETS; bucket++) {
+            total += pread_stats->histogram[path][bucket];
+        }
+        munit_assert(total == pread_stats->count[path]);
+        munit_assert(readmap_stats_percentile(pread_stats->histogram[path], 100) >= pread_stats->max_ns[path]);
+        munit_assert(readmap_stats_percentile(pread_stats->histogram[path], 50) <=
+                     readmap_stats_percentile(pread_stats->histogram[path], 99));
+    }
+
+    for (unsigned bucket = 0; bucket < READMAP_STATS_BUCKETS; bucket++) {
+        munit_assert(readmap_stats_bucket_value(bucket) < readmap_stats_bucket_value(bucket + 1));
+    }
+    munit_assert(0 == strcmp("pread", readmap_stats_call_name(READMAP_CALL_PREAD)));
+    munit_assert(-1 == readmap_get_stats(NULL));
+    munit_assert(EINVAL == errno);
+
+    // a dump on demand
+    munit_assert(0 == raise(SIGUSR1));
+    for (unsigned wait = 0; wait < 200; wait++) {
+        munit_assert(0 == stat(statsname, &st));
+        if (st.st_size > 0) {
+            break;
+        }
+        usleep(10000);
+    }
+    munit_assert(st.st_size > 0);
+
+    close(native);
+    munit_assert(0 == readmap_close(fd));
+
+    // and another one at shutdown
+    readmap_shutdown();
+    munit_assert(0 == stat(statsname, &st));
+    munit_assert(st.st_size > 0);
+
+    unsetenv("READMAP_STATS");
+    unsetenv("READMAP_STATS_SIGNAL");
+    unsetenv("READMAP_STATS_FILE");
+    unlink(statsname);
+    unlink(tmpname);
+    free(tmpname);
+    free(before);
+    free(after);
+
+    return MUNIT_OK;
+}
+
+/*
+ * Take a consistent copy of this process' published statistics (the reader's side of the protocol
+ * in readmapshm.h.)  Returns non-zero on success.
+ */
+static int read_shm_stats(readmap_shm_stats_t *stats)
+{
+    char                       name[64];
+    const readmap_shm_stats_t *segment;
+    uint64_t                   before;
+    int                        fd;
+    int                        copied = 0;
+
+    snprintf(name, sizeof(name), "/dev/shm%s%d", READMAP_SHM_PREFIX, (int)getpid());
+    fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    segment = mmap(NULL, sizeof(readmap_shm_stats_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    munit_assert(MAP_FAILED != segment);
+
+    munit_assert(READMAP_SHM_MAGIC == segment->magic);
+    munit_assert(READMAP_SHM_VERSION == segment->version);
+    munit_assert(sizeof(readmap_shm_stats_t) == segment->size);
+    munit_assert((uint32_t)getpid() == segment->pid);
+
+    for (unsigned attempt = 0; (attempt < 1000) && !copied; attempt++) {
+        before = __atomic_load_n(&segment->sequence, __ATOMIC_ACQUIRE);
+        if ((0 == before) || (before & 1)) {
+            usleep(1000);
+            continue;
+        }
+        memcpy(stats, segment, sizeof(readmap_shm_stats_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        copied = (before == __atomic_load_n(&segment->sequence, __ATOMIC_RELAXED));
+    }
+
+    munmap((void *)(uintptr_t)segment, sizeof(readmap_shm_stats_t));
+
+    return copied;
+}
+
+static MunitResult test_shm_stats(const MunitParameter params[] __notused, void *prv __notused)
+{
+    const size_t         file_size = (1024 * 1024) + 17;
+    char *               tmpname;
+    char                 buffer[4096];
+    char                 name[64];
+    readmap_shm_stats_t *stats;
+    struct stat          st;
+    int                  found = 0;
+    int                  fd;
+
+    stats = malloc(sizeof(readmap_shm_stats_t));
+    munit_assert(NULL != stats);
+
+    setenv("READMAP_STATS_SHM", "1", 1);
+    setenv("READMAP_STATS_SHM_INTERVAL_MS", "10", 1);
+    setenv("READMAP_STATS_FILE", "/dev/null", 1);
+    readmap_init();
+    tmpname = make_test_file(file_size);
+
+    fd = readmap_open(tmpname, O_RDONLY);
+    munit_assert(fd >= 0);
+    for (unsigned index = 0; index < 10; index++) {
+        munit_assert(sizeof(buffer) == readmap_pread(fd, buffer, sizeof(buffer), index * 65536));
+    }
+
+    // wait for it to be published
+    for (unsigned wait = 0; (wait < 500) && !found; wait++) {
+        if (read_shm_stats(stats) && (stats->calls[READMAP_CALL_PREAD].count[READMAP_PATH_MAPPED] >= 10)) {
+            for (unsigned index = 0; index < stats->file_count; index++) {
+                if ((fd == stats->files[index].fd) && (stats->files[index].served_calls >= 10)) {
+                    munit_assert(stats->files[index].served_bytes >= 10 * sizeof(buffer));
+                    munit_assert(file_size == stats->files[index].size);
+                    munit_assert(stats->files[index].mapped_bytes > 0);
+                    found = 1;
+                }
+            }
+        }
+        if (!found) {
+            usleep(10000);
+        }
+    }
+    munit_assert(found);
+    munit_assert(stats->bytes_mapped > 0);
+    munit_assert(stats->minor_faults > 0);
+    munit_assert(10000000 == stats->interval_ns);
+
+    munit_assert(0 == readmap_close(fd));
+    readmap_shutdown();
+
+    // and it's gone
+    snprintf(name, sizeof(name), "/dev/shm%s%d", READMAP_SHM_PREFIX, (int)getpid());
+    munit_assert(0 != stat(name, &st));
+
+    unsetenv("READMAP_STATS_SHM");
+    unsetenv("READMAP_STATS_SHM_INTERVAL_MS");
+    unsetenv("READMAP_STATS_FILE");
+    unlink(tmpname);
+    free(tmpname);
+    free(stats);
+
+    return MUNIT_OK;
+}
+
+#define LOOKUP_TEST_THREADS 4
+#define LOOKUP_TEST_KEYS 50000
+
+typedef struct lookup_test {
+    lookup_table_t *table;
+    unsigned        index;
+} lookup_test_t;
+
+static void *lookup_insert_thread(void *arg)
+{
+    lookup_test_t *test = (lookup_test_t *)arg;
+    void *         object;
+    unsigned       key;
+
+    for (unsigned count = 0; count < LOOKUP_TEST_KEYS; count++) {
+        key = test->index + (count * LOOKUP_TEST_THREADS);
+        munit_assert(0 == lookup_table_insert(test->table, &key, (void *)(uintptr_t)(key + 1)));
+        munit_assert(EEXIST == lookup_table_insert(test->table, &key, NULL));
+
+        // something inserted a little while ago (the table may well have been resized since)
+        key = test->index + ((count / 2) * LOOKUP_TEST_THREADS);
+        munit_assert(0 == lookup_table_lookup(test->table, &key, &object));
+        munit_assert((uintptr_t)(key + 1) == (uintptr_t)object);
+    }
+
+    return NULL;
+}
+
+static void *lookup_remove_thread(void *arg)
+{
+    lookup_test_t *test = (lookup_test_t *)arg;
+    void *         object;
+    unsigned       key;
+
+    for (unsigned count = 0; count < LOOKUP_TEST_KEYS; count++) {
+        key = test->index + (count * LOOKUP_TEST_THREADS);
+        munit_assert(0 == lookup_table_remove(test->table, &key));
+        munit_assert(ENODATA == lookup_table_remove(test->table, &key));
+        munit_assert(ENODATA == lookup_table_lookup(test->table, &key, &object));
+        munit_assert(NULL == object);
+    }
+
+    return NULL;
+}
+
+static MunitResult test_lookup_table(const MunitParameter params[] __notused, void *prv __notused)
+{
+    lookup_test_t tests[LOOKUP_TEST_THREADS];
+    pthread_t     threads[LOOKUP_TEST_THREADS];
+    void *        object;
+    unsigned      key;
+
+    tests[0].table = lookup_table_create(1, "test", NULL, sizeof(unsigned));
+    munit_assert(NULL != tests[0].table);
+    munit_assert(lookup_table_bucket_count(tests[0].table) <= 16);
+
+    for (unsigned index = 0; index < LOOKUP_TEST_THREADS; index++) {
+        tests[index].table = tests[0].table;
+        tests[index].index = index;
+        munit_assert(0 == pthread_create(&threads[index], NULL, lookup_insert_thread, &tests[index]));
+    }
+    for (unsigned index = 0; index < LOOKUP_TEST_THREADS; index++) {
+        munit_assert(0 == pthread_join(threads[index], NULL));
+    }
+
+    // it grew along the way, and nothing was lost doing so
+    munit_assert(lookup_table_bucket_count(tests[0].table) >= (LOOKUP_TEST_THREADS * LOOKUP_TEST_KEYS) / 4);
+    for (key = 0; key < LOOKUP_TEST_THREADS * LOOKUP_TEST_KEYS; key++) {
+        munit_assert(0 == lookup_table_lookup(tests[0].table, &key, &object));
+        munit_assert((uintptr_t)(key + 1) == (uintptr_t)object);
+    }
+
+    for (unsigned index = 0; index < LOOKUP_TEST_THREADS; index++) {
+        munit_assert(0 == pthread_create(&threads[index], NULL, lookup_remove_thread, &tests[index]));
+    }
+    for (unsigned index = 0; index < LOOKUP_TEST_THREADS; index++) {
+        munit_assert(0 == pthread_join(threads[index], NULL));
+    }
+
+    // and shrank again; resizes only happen as the table is used, so use it a little more
+    for (key = 0; key < 10000; key++) {
+        munit_assert(0 == lookup_table_insert(tests[0].table, &key, NULL));
+        munit_assert(0 == lookup_table_remove(tests[0].table, &key));
+    }
+    munit_assert(lookup_table_bucket_count(tests[0].table) <= 64);
+
+    lookup_table_destroy(tests[0].table);
+
+    return MUNIT_OK;
+}
+
 static const MunitTest perf_tests[] = {
     TEST("/null", test_null, NULL),
     TEST("/open", test_open, NULL),
+    TEST("/read", test_read, NULL),
+    TEST("/write", test_write, NULL),
+    TEST("/shared_size", test_shared_size, NULL),
+    TEST("/positional", test_positional, NULL),
+    TEST("/file_calls", test_file_calls, NULL),
+    TEST("/dirty", test_dirty, NULL),
+    TEST("/concurrent", test_concurrent, NULL),
+    TEST("/offset", test_offset, NULL),
+    TEST("/fork", test_fork, NULL),
+    TEST("/close_race", test_close_race, NULL),
+    TEST("/shared_mapping", test_shared_mapping, NULL),
+    TEST("/size_tracking", test_size_tracking, NULL),
+    TEST("/stale", test_stale, NULL),
+    TEST("/hugepage", test_hugepage, NULL),
+    TEST("/windows", test_windows, NULL),
+    TEST("/access_pattern", test_access_pattern, NULL),
+    TEST("/prefetch", test_prefetch, NULL),
+    TEST("/streaming_copy", test_streaming_copy, NULL),
+    TEST("/view", test_view, NULL),
+    TEST("/batch", test_batch, NULL),
+    TEST("/async", test_async, NULL),
+    TEST("/stats", test_stats, NULL),
+    TEST("/shm_stats", test_shm_stats, NULL),
+    TEST("/lookup_table", test_lookup_table, NULL),
     TEST(NULL, NULL, NULL),
 };
 
@@ -0,0 +1,308 @@
+/*
+ * (C) Copyright 2021 Tony Mason
+ * All Rights Reserved
+ */
+
+/*
+ * Watch the statistics published by running readmap processes (see readmapshm.h.)
+ *
+ *     readmap-top [-i seconds] [-n iterations] [-f] [pid ...]
+ *
+ * Without pids, every process that is publishing is shown.  -f adds each process' open files.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "readmapshm.h"
+
+#define TOP_MAX_PROCESSES 256
+
+typedef struct top_process {
+    uint32_t            pid;
+    int                 seen;      // in this round
+    int                 previous;  // last holds the previous round's numbers
+    readmap_shm_stats_t last;
+} top_process_t;
+
+static const char *call_names[READMAP_SHM_CALLS] = {
+    "read", "pread", "readv", "preadv", "write", "pwrite", "writev", "pwritev",
+};
+
+static const char *pattern_names[] = {"-", "seq", "stride", "random"};
+
+static top_process_t processes[TOP_MAX_PROCESSES];
+
+/*
+ * Take a consistent copy of the published statistics of process pid.  Returns 0 or an errno.
+ */
+static int top_read(uint32_t pid, readmap_shm_stats_t *stats)
+{
+    char                       name[64];
+    struct stat                st;
+    const readmap_shm_stats_t *segment;
+    uint64_t                   before;
+    uint64_t                   after;
+    int                        status = EAGAIN;
+    int                        fd;
+
+    snprintf(name, sizeof(name), "/dev/shm%s%u", READMAP_SHM_PREFIX, pid);
+    fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno;
+    }
+
+    if ((0 != fstat(fd, &st)) || (st.st_size < (off_t)sizeof(readmap_shm_stats_t))) {
+        close(fd);
+        return EINVAL;
+    }
+
+    segment = mmap(NULL, sizeof(readmap_shm_stats_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == segment) {
+        return errno;
+    }
+
+    if ((READMAP_SHM_MAGIC != segment->magic) || (READMAP_SHM_VERSION != segment->version) ||
+        (segment->size < sizeof(readmap_shm_stats_t))) {
+        munmap((void *)(uintptr_t)segment, sizeof(readmap_shm_stats_t));
+        return EINVAL;
+    }
+
+    for (unsigned attempt = 0; attempt < 1000; attempt++) {
+        before = __atomic_load_n(&segment->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            // being updated
+            sched_yield();
+            continue;
+        }
+
+        memcpy(stats, segment, sizeof(readmap_shm_stats_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&segment->sequence, __ATOMIC_RELAXED);
+
+        if (before == after) {
+            status = (0 == before) ? ENODATA : 0;  // nothing published yet
+            break;
+        }
+    }
+
+    munmap((void *)(uintptr_t)segment, sizeof(readmap_shm_stats_t));
+
+    return status;
+}
+
+static top_process_t *top_find(uint32_t pid)
+{
+    top_process_t *free_slot = NULL;
+
+    for (unsigned index = 0; index < TOP_MAX_PROCESSES; index++) {
+        if (pid == processes[index].pid) {
+            return &processes[index];
+        }
+        if ((NULL == free_slot) && (0 == processes[index].pid)) {
+            free_slot = &processes[index];
+        }
+    }
+
+    if (NULL != free_slot) {
+        memset(free_slot, 0, sizeof(top_process_t));
+        free_slot->pid = pid;
+    }
+
+    return free_slot;
+}
+
+static const char *top_scaled(uint64_t value, char *buffer, size_t length)
+{
+    const char *units = " KMGTP";
+    double      scaled = value;
+
+    while ((scaled >= 1024) && ('\0' != units[1])) {
+        scaled /= 1024;
+        units++;
+    }
+
+    if (' ' == units[0]) {
+        snprintf(buffer, length, "%lu", (unsigned long)value);
+    }
+    else {
+        snprintf(buffer, length, "%.1f%c", scaled, units[0]);
+    }
+
+    return buffer;
+}
+
+static void top_show(top_process_t *process, const readmap_shm_stats_t *stats, int show_files)
+{
+    const readmap_shm_stats_t *last = process->previous ? &process->last : NULL;
+    const readmap_shm_call_t * call;
+    uint64_t                   calls    = 0;
+    uint64_t                   hits     = 0;
+    uint64_t                   previous = 0;
+    double                     seconds  = 0;
+    char                       mapped[16];
+    char                       bytes[16];
+
+    for (unsigned index = 0; index < READMAP_SHM_CALLS; index++) {
+        calls += stats->calls[index].calls;
+        hits += stats->calls[index].count[0];
+        if (NULL != last) {
+            previous += last->calls[index].calls;
+        }
+    }
+
+    if ((NULL != last) && (stats->updated_ns > last->updated_ns)) {
+        seconds = (stats->updated_ns - last->updated_ns) / 1e9;
+    }
+
+    printf("%-8u %12lu %10.0f %6.1f%% %8s %10lu %8lu %10lu %10.3f\n", stats->pid, (unsigned long)calls,
+           (seconds > 0) ? (calls - previous) / seconds : 0.0, calls ? (100.0 * hits) / calls : 0.0,
+           top_scaled(stats->bytes_mapped, mapped, sizeof(mapped)), (unsigned long)stats->minor_faults,
+           (unsigned long)stats->major_faults, (unsigned long)stats->lock_waits, stats->lock_wait_ns / 1e6);
+
+    for (unsigned index = 0; index < READMAP_SHM_CALLS; index++) {
+        call = &stats->calls[index];
+        if (0 == call->calls) {
+            continue;
+        }
+
+        printf("    %-8s %12lu %12lu %10lu %10lu %10lu %10lu %10lu\n", call_names[index], (unsigned long)call->count[0],
+               (unsigned long)call->count[1], (unsigned long)call->failures, (unsigned long)call->p50_ns[0],
+               (unsigned long)call->p99_ns[0], (unsigned long)call->p50_ns[1], (unsigned long)call->p99_ns[1]);
+    }
+
+    if (!show_files) {
+        return;
+    }
+
+    for (unsigned index = 0; index < stats->file_count; index++) {
+        const readmap_shm_file_t *file = &stats->files[index];
+
+        printf("    fd %-5d %3lu:%-10lu size %8s mapped %8s served %10lu", file->fd, (unsigned long)file->dev,
+               (unsigned long)file->ino, top_scaled(file->size, bytes, sizeof(bytes)),
+               top_scaled(file->mapped_bytes, mapped, sizeof(mapped)), (unsigned long)file->served_calls);
+        printf(" (%s) %s\n", top_scaled(file->served_bytes, bytes, sizeof(bytes)),
+               (file->access_pattern >= 0) && (file->access_pattern < 4) ? pattern_names[file->access_pattern] : "?");
+    }
+    if (0 != stats->files_omitted) {
+        printf("    (%u more files)\n", stats->files_omitted);
+    }
+}
+
+static void top_round(uint32_t *pids, unsigned pid_count, int show_files)
+{
+    static readmap_shm_stats_t stats;
+    uint32_t                   found[TOP_MAX_PROCESSES];
+    unsigned                   count = 0;
+    DIR *                      directory;
+    struct dirent *            entry;
+    top_process_t *            process;
+    const size_t               prefix = strlen(READMAP_SHM_PREFIX) - 1;  // without the '/'
+
+    if (0 != pid_count) {
+        memcpy(found, pids, pid_count * sizeof(uint32_t));
+        count = pid_count;
+    }
+    else if (NULL != (directory = opendir("/dev/shm"))) {
+        while ((count < TOP_MAX_PROCESSES) && (NULL != (entry = readdir(directory)))) {
+            if (0 == strncmp(entry->d_name, READMAP_SHM_PREFIX + 1, prefix)) {
+                found[count++] = strtoul(entry->d_name + prefix, NULL, 10);
+            }
+        }
+        closedir(directory);
+    }
+
+    printf("%-8s %12s %10s %7s %8s %10s %8s %10s %10s\n", "PID", "CALLS", "CALLS/s", "HIT%", "MAPPED", "MINFLT",
+           "MAJFLT", "LOCKWAITS", "WAIT(ms)");
+    printf("    %-8s %12s %12s %10s %10s %10s %10s %10s\n", "call", "hits", "fallbacks", "failures", "hit p50", "hit p99",
+           "fb p50", "fb p99");
+
+    for (unsigned index = 0; index < TOP_MAX_PROCESSES; index++) {
+        processes[index].seen = 0;
+    }
+
+    for (unsigned index = 0; index < count; index++) {
+        if ((0 != kill(found[index], 0)) && (ESRCH == errno)) {
+            // left behind by a process that died
+            continue;
+        }
+
+        if (0 != top_read(found[index], &stats)) {
+            continue;
+        }
+
+        process = top_find(found[index]);
+        if (NULL == process) {
+            continue;
+        }
+
+        top_show(process, &stats, show_files);
+        process->seen     = 1;
+        process->previous = 1;
+        process->last     = stats;
+    }
+
+    // forget processes that have gone away
+    for (unsigned index = 0; index < TOP_MAX_PROCESSES; index++) {
+        if (!processes[index].seen) {
+            processes[index].pid = 0;
+        }
+    }
+
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t pids[TOP_MAX_PROCESSES];
+    unsigned pid_count  = 0;
+    double   interval   = 1;
+    long     iterations = -1;
+    int      show_files = 0;
+    int      option;
+
+    while (-1 != (option = getopt(argc, argv, "i:n:f"))) {
+        switch (option) {
+        case 'i':
+            interval = strtod(optarg, NULL);
+            break;
+        case 'n':
+            iterations = strtol(optarg, NULL, 0);
+            break;
+        case 'f':
+            show_files = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-i seconds] [-n iterations] [-f] [pid ...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (int index = optind; (index < argc) && (pid_count < TOP_MAX_PROCESSES); index++) {
+        pids[pid_count++] = strtoul(argv[index], NULL, 0);
+    }
+
+    for (long iteration = 0; (iterations < 0) || (iteration < iterations); iteration++) {
+        if (0 != iteration) {
+            usleep(interval * 1e6);
+        }
+        top_round(pids, pid_count, show_files);
+    }
+
+    return 0;
+}